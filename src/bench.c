@@ -0,0 +1,427 @@
+/*---------------------------------------------------------------------------*/
+/* bench.c                                                                   */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "common.h"
+#include "skvsclient.h"
+/*---------------------------------------------------------------------------*/
+/* a load generator: threads keep requests pipelined against the server(s)
+ * for a while, then the throughput and latency percentiles are reported */
+#define BENCH_THREADS 4
+#define BENCH_DEPTH 16
+#define BENCH_KEYS 10000
+#define BENCH_READ_PCT 90
+#define BENCH_VALUE_SIZE 32
+#define BENCH_SECONDS 5
+#define HIST_SUB 16 // buckets per power of two of latency
+#define HIST_BUCKETS (64 * HIST_SUB)
+/*---------------------------------------------------------------------------*/
+struct bench
+{
+    skvs_cluster_t *cluster;
+    int depth;
+    long keys;
+    int read_pct;
+    char *value;
+    size_t value_size;
+    double *zipf_cdf; // NULL for uniform keys
+    uint64_t deadline_ns;
+    const char *shm_name; // reads go to this mirror first, when set
+};
+/*---------------------------------------------------------------------------*/
+struct worker
+{
+    struct bench *b;
+    pthread_t thread;
+    uint64_t seed;
+    skvs_shm_t *shm;
+    uint64_t ops, errors;
+    uint64_t hist[HIST_BUCKETS]; // latencies in ns, log-linear
+};
+/*---------------------------------------------------------------------------*/
+/* one request in flight */
+struct slot
+{
+    skvs_op_t op;
+    skvs_conn_t *conn;
+    uint64_t start_ns;
+};
+/*---------------------------------------------------------------------------*/
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+/* xorshift64*, one state per thread */
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+/*---------------------------------------------------------------------------*/
+static int hist_index(uint64_t v)
+{
+    int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+/*---------------------------------------------------------------------------*/
+/* smallest value of the bucket at index */
+static uint64_t hist_value(int index)
+{
+    int msb = index / HIST_SUB + 3;
+
+    if (index < HIST_SUB)
+        return index;
+    return (1ULL << msb) | ((uint64_t)(index % HIST_SUB) << (msb - 4));
+}
+/*---------------------------------------------------------------------------*/
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+                                double pct)
+{
+    uint64_t want = total * pct / 100.0, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+/*---------------------------------------------------------------------------*/
+/* cumulative distribution of Zipf(theta) over n ranks */
+static double *zipf_init(long n, double theta)
+{
+    double *cdf = malloc(sizeof(double) * n), sum = 0;
+    long i;
+
+    if (cdf == NULL)
+        return NULL;
+    for (i = 0; i < n; i++)
+        sum += 1.0 / pow(i + 1, theta);
+    for (i = 0; i < n; i++)
+        cdf[i] = (i ? cdf[i - 1] : 0) + 1.0 / pow(i + 1, theta) / sum;
+
+    return cdf;
+}
+/*---------------------------------------------------------------------------*/
+static long pick_key(struct bench *b, uint64_t *seed)
+{
+    double u;
+    long lo = 0, hi = b->keys - 1, mid;
+
+    if (b->zipf_cdf == NULL)
+        return rnd(seed) % b->keys;
+
+    u = (rnd(seed) >> 11) * (1.0 / 9007199254740992.0);
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (b->zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+/*---------------------------------------------------------------------------*/
+static int submit(struct worker *w, skvs_conn_t **conns, struct slot *s)
+{
+    struct bench *b = w->b;
+    char key[MAX_KEY_LEN + 1], value[BUFFER_SIZE];
+    size_t value_len;
+    int server, read;
+
+    while (1)
+    {
+        snprintf(key, sizeof(key), "key%ld", pick_key(b, &w->seed));
+        read = (int)(rnd(&w->seed) % 100) < b->read_pct;
+        if (!read || !w->shm || now_ns() >= b->deadline_ns)
+            break;
+
+        /* reads the mirror answers complete right here */
+        s->start_ns = now_ns();
+        if (skvs_shm_read(w->shm, key, value, sizeof(value),
+                          &value_len) < 0)
+            break;
+        w->ops++;
+        w->hist[hist_index(now_ns() - s->start_ns)]++;
+    }
+    server = skvs_cluster_route(b->cluster, key);
+
+    s->conn = conns[server];
+    s->start_ns = now_ns();
+    if (read)
+        return skvs_submit(s->conn, &s->op, "READ", key, NULL, 0);
+    return skvs_submit(s->conn, &s->op, "UPDATE", key, b->value,
+                       b->value_size);
+}
+/*---------------------------------------------------------------------------*/
+static void *run(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+    skvs_conn_t **conns;
+    struct slot *slots;
+    uint64_t done;
+    int i, n = b->cluster->nservers;
+
+    conns = calloc(n, sizeof(skvs_conn_t *));
+    slots = calloc(b->depth, sizeof(struct slot));
+    if (b->shm_name)
+        w->shm = skvs_shm_open(b->shm_name);
+    if (conns == NULL || slots == NULL || (b->shm_name && w->shm == NULL))
+    {
+        w->errors++;
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+        conns[i] = skvs_acquire(b->cluster->servers[i]);
+        if (conns[i] == NULL)
+        {
+            w->errors++;
+            goto out;
+        }
+    }
+
+    /* keep depth requests in flight, replacing the oldest as it completes */
+    for (i = 0; i < b->depth; i++)
+    {
+        submit(w, conns, &slots[i]);
+    }
+    for (i = 0; now_ns() < b->deadline_ns; i = (i + 1) % b->depth)
+    {
+        skvs_poll(slots[i].conn, 0);
+        skvs_wait(slots[i].conn, &slots[i].op);
+        done = now_ns();
+        if (slots[i].op.status != SKVS_OK)
+            w->errors++;
+        w->ops++;
+        w->hist[hist_index(done - slots[i].start_ns)]++;
+        skvs_op_release(&slots[i].op);
+        submit(w, conns, &slots[i]);
+    }
+
+out:
+    for (i = 0; conns && i < n; i++)
+    {
+        if (conns[i])
+            skvs_release(b->cluster->servers[i], conns[i]);
+    }
+    if (slots)
+    {
+        for (i = 0; i < b->depth; i++)
+            skvs_op_release(&slots[i].op);
+    }
+    free(slots);
+    free(conns);
+    if (w->shm)
+        skvs_shm_close(w->shm);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* creates every key, so that reads and updates find them */
+static int load(struct bench *b)
+{
+    struct skvs_req *reqs;
+    skvs_op_t *ops;
+    char(*keys)[MAX_KEY_LEN + 1];
+    long i, batch = 1024, n;
+    int failed = 0, j;
+
+    reqs = malloc(sizeof(*reqs) * batch);
+    ops = calloc(batch, sizeof(*ops));
+    keys = malloc(sizeof(*keys) * batch);
+    if (reqs == NULL || ops == NULL || keys == NULL)
+    {
+        free(reqs);
+        free(ops);
+        free(keys);
+        return -1;
+    }
+
+    for (i = 0; i < b->keys; i += batch)
+    {
+        n = b->keys - i < batch ? b->keys - i : batch;
+        for (j = 0; j < n; j++)
+        {
+            snprintf(keys[j], sizeof(keys[j]), "key%ld", i + j);
+            reqs[j].cmd = "CREATE";
+            reqs[j].key = keys[j];
+            reqs[j].value = b->value;
+            reqs[j].value_len = b->value_size;
+        }
+        failed += skvs_cluster_exec(b->cluster, reqs, ops, n);
+        for (j = 0; j < n; j++)
+            skvs_op_release(&ops[j]);
+    }
+
+    free(reqs);
+    free(ops);
+    free(keys);
+    return failed ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    char *ip = DEFAULT_LOOPBACK_IP;
+    int port = DEFAULT_PORT;
+    int threads = BENCH_THREADS, seconds = BENCH_SECONDS, preload = 0;
+    double theta = 0;
+    struct bench b;
+    struct worker *workers;
+    uint64_t hist[HIST_BUCKETS] = {0}, ops = 0, errors = 0, start;
+    double elapsed;
+    int opt, i, j;
+
+    memset(&b, 0, sizeof(b));
+    b.depth = BENCH_DEPTH;
+    b.keys = BENCH_KEYS;
+    b.read_pct = BENCH_READ_PCT;
+    b.value_size = BENCH_VALUE_SIZE;
+
+    while ((opt = getopt(argc, argv, "i:p:u:c:d:n:r:v:z:s:lm:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            ip = optarg;
+            break;
+        case 'u':
+            if (!IS_UNIX_PATH(optarg))
+            {
+                fprintf(stderr, "Invalid unix socket %s, expected a path "
+                                "with a '/' or @name\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            b.depth = atoi(optarg);
+            break;
+        case 'n':
+            b.keys = atol(optarg);
+            break;
+        case 'r':
+            b.read_pct = atoi(optarg);
+            break;
+        case 'v':
+            b.value_size = atol(optarg);
+            break;
+        case 'z':
+            theta = atof(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'l':
+            preload = 1;
+            break;
+        case 'm':
+            b.shm_name = optarg;
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-i server[:port][,server[:port]...] (%s)] "
+                   "[-p port (%d)] [-u unix_path|@name] "
+                   "[-c connections (%d)] "
+                   "[-d pipeline_depth (%d)] [-n keys (%d)] "
+                   "[-r read_percent (%d)] [-v value_size (%d)] "
+                   "[-z zipf_theta (uniform)] [-s seconds (%d)] "
+                   "[-l (create the keys first)] "
+                   "[-m shm_name (read the server's mirror)]\n",
+                   argv[0], DEFAULT_LOOPBACK_IP, DEFAULT_PORT,
+                   BENCH_THREADS, BENCH_DEPTH, BENCH_KEYS, BENCH_READ_PCT,
+                   BENCH_VALUE_SIZE, BENCH_SECONDS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads <= 0 || b.depth <= 0 || b.keys <= 0 || seconds <= 0 ||
+        b.value_size == 0 || b.read_pct < 0 || b.read_pct > 100)
+    {
+        fprintf(stderr, "bench: invalid parameters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    b.value = malloc(b.value_size);
+    b.cluster = skvs_cluster_open(ip, port, threads, 0);
+    if (b.value == NULL || b.cluster == NULL)
+    {
+        fprintf(stderr, "bench: invalid server list %s\n", ip);
+        exit(EXIT_FAILURE);
+    }
+    memset(b.value, 'v', b.value_size);
+    if (theta > 0 && (b.zipf_cdf = zipf_init(b.keys, theta)) == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (preload && load(&b) < 0)
+    {
+        fprintf(stderr, "bench: loading keys failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    workers = calloc(threads, sizeof(struct worker));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    start = now_ns();
+    b.deadline_ns = start + (uint64_t)seconds * 1000000000;
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].b = &b;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+        for (j = 0; j < HIST_BUCKETS; j++)
+            hist[j] += workers[i].hist[j];
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    printf("ops=%" PRIu64 " ops/s=%.0f p50_us=%.1f p99_us=%.1f "
+           "p999_us=%.1f errors=%" PRIu64 "\n",
+           ops, ops / elapsed, hist_percentile(hist, ops, 50) / 1e3,
+           hist_percentile(hist, ops, 99) / 1e3,
+           hist_percentile(hist, ops, 99.9) / 1e3, errors);
+
+    free(workers);
+    free(b.zipf_cdf);
+    free(b.value);
+    skvs_cluster_close(b.cluster);
+    return errors ? EXIT_FAILURE : 0;
+}
+/*---------------------------------------------------------------------------*/
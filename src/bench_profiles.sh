@@ -0,0 +1,50 @@
+#!/bin/sh
+#-----------------------------------------------------------------------------#
+# bench_profiles.sh                                                           #
+#-----------------------------------------------------------------------------#
+# builds the server in each profile and measures it with the same
+# release-built load generator, or, given "train", only runs the workload
+# that "make pgo" records its profile from.
+#
+# environment: PROFILES (debug release pgo asan tsan), BENCH_PORT (9500),
+# BENCH_ARGS (-c 4 -d 16 -n 10000 -r 90 -s 5), SERVER_ARGS
+set -e
+cd "$(dirname "$0")"
+
+PROFILES=${PROFILES:-"debug release pgo asan tsan"}
+PORT=${BENCH_PORT:-9500}
+BENCH_ARGS=${BENCH_ARGS:-"-c 4 -d 16 -n 10000 -r 90 -s 5"}
+BENCH=./bench
+
+# runs the load generator against a freshly started server
+run() {
+    ./server -p "$PORT" $SERVER_ARGS >/dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    "$BENCH" -p "$PORT" -l $BENCH_ARGS || true
+    # SIGINT, so that the server exits normally (and writes its profile)
+    kill -INT "$pid"
+    wait "$pid" || true
+}
+
+if [ "$1" = "train" ]; then
+    run >/dev/null
+    exit 0
+fi
+
+# one load generator for every run, so that only the server differs
+make -s clean-build
+make -s PROFILE=release bench
+cp bench bench.release
+BENCH=./bench.release
+
+for p in $PROFILES; do
+    if [ "$p" = "pgo" ]; then
+        make -s pgo >/dev/null
+    else
+        make -s clean-build
+        make -s PROFILE="$p" server
+    fi
+    printf '%-8s %s\n' "$p" "$(run | tail -n 1)"
+done
+rm -f bench.release
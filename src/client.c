@@ -13,7 +13,201 @@
 #include <netdb.h>
 #include <getopt.h>
 #include <errno.h>
+#include <strings.h>
 #include "common.h"
+#include "skvsclient.h"
+/*---------------------------------------------------------------------------*/
+/* replies awaited at once when reading requests from a pipe */
+#define PIPELINE_DEPTH 64
+/*---------------------------------------------------------------------------*/
+/* prints the reply of a completed op */
+static int print_reply(skvs_op_t *op, const char *prefix)
+{
+    if (op->status != SKVS_OK)
+    {
+        fprintf(stderr, "client: %s\n",
+                op->status == SKVS_ETIMEDOUT ? "request timed out"
+                                             : "connection failed");
+        return -1;
+    }
+
+    fputs(prefix, stdout);
+    fwrite(op->reply, 1, op->reply_len, stdout);
+    fputc('\n', stdout);
+    skvs_op_release(op);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* copies the key of a request line (its second word) into key,
+ * or returns NULL for commands without one */
+static const char *line_key(const char *line, size_t len, char *key)
+{
+    static const char *keyless[] = {"RANGE", "PREFIX", "SCAN", "EXPORT",
+                                    "STATS", "SYNC"};
+    size_t i = 0, n = 0, k;
+
+    while (i < len && line[i] != ' ')
+        i++;
+    for (k = 0; k < sizeof(keyless) / sizeof(keyless[0]); k++)
+        if (i == strlen(keyless[k]) && !strncmp(line, keyless[k], i))
+            return NULL;
+    while (i < len && line[i] == ' ')
+        i++;
+    while (i < len && line[i] != ' ' && n < MAX_KEY_LEN)
+        key[n++] = line[i++];
+    key[n] = '\0';
+
+    return n ? key : NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* runs an MGET line, which is answered with one reply per key, as one
+ * MGET per server owning some of the keys, and prints the replies in the
+ * order of the keys.
+ * returns 1 when the line is not a well-formed MGET, so it is to be sent
+ * as is, -1 when a request failed, 0 on success. */
+static int run_mget(skvs_cluster_t *cluster, skvs_conn_t **conns,
+                    char *line, size_t len, const char *prefix)
+{
+    const char *keys[MGET_MAX_KEYS], *grouped[MGET_MAX_KEYS];
+    skvs_op_t ops[MGET_MAX_KEYS];
+    int pos[MGET_MAX_KEYS], owner[MGET_MAX_KEYS];
+    int n = 0, m = 0, first, s, i, ret = 0;
+    char copy[BUFFER_SIZE], *tok, *save;
+
+    if (len < 5 || len >= sizeof(copy) || strncasecmp(line, "MGET ", 5))
+        return 1;
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    strtok_r(copy, " ", &save);
+    while ((tok = strtok_r(NULL, " ", &save)) != NULL)
+    {
+        if (n == MGET_MAX_KEYS || strlen(tok) > MAX_KEY_LEN)
+            return 1; // let the server refuse it
+        owner[n] = skvs_cluster_route(cluster, tok);
+        keys[n++] = tok;
+    }
+    if (n == 0)
+        return 1;
+
+    /* the keys of each server go together, in their order */
+    memset(ops, 0, sizeof(ops));
+    for (s = 0; s < cluster->nservers; s++)
+    {
+        first = m;
+        for (i = 0; i < n; i++)
+        {
+            if (owner[i] != s)
+                continue;
+            pos[i] = m;
+            grouped[m++] = keys[i];
+        }
+        if (m > first && skvs_submit_mget(conns[s], &ops[first],
+                                          &grouped[first], m - first) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < n && ret == 0; i++)
+    {
+        skvs_wait(conns[owner[i]], &ops[pos[i]]);
+        ret = print_reply(&ops[pos[i]], prefix);
+    }
+    for (; i < n; i++)
+    {
+        skvs_wait(conns[owner[i]], &ops[pos[i]]);
+        skvs_op_release(&ops[pos[i]]);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* runs the requests read after a MULTI line, up to the EXEC line, as one
+ * block that the server applies at once, and prints their replies.
+ * the keys of a block must all be on the same server.
+ * returns -1 when a request failed or the input ended, 0 otherwise. */
+static int run_multi(skvs_cluster_t *cluster, skvs_conn_t **conns,
+                     const char *prompt, const char *prefix)
+{
+    struct skvs_req reqs[MULTI_MAX_OPS];
+    skvs_op_t ops[MULTI_MAX_OPS];
+    char words[MULTI_MAX_LEN], *cmd, *key, *value;
+    char *line = NULL;
+    size_t line_cap = 0, off = 0;
+    ssize_t len;
+    int n = 0, s = 0, i, bad = 0, ret = 0;
+
+    while (1)
+    {
+        if (prompt)
+        {
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+        len = getline(&line, &line_cap, stdin);
+        if (len < 0)
+        {
+            free(line);
+            return -1;
+        }
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (strcasecmp(line, "EXEC") == 0)
+            break;
+        if (n == MULTI_MAX_OPS || off + len + 1 > sizeof(words))
+        {
+            bad = 1;
+            continue;
+        }
+
+        /* "cmd key [value]", the value being the rest of the line */
+        cmd = memcpy(words + off, line, len + 1);
+        off += len + 1;
+        key = strchr(cmd, ' ');
+        if (key == NULL)
+        {
+            bad = 1;
+            continue;
+        }
+        *key++ = '\0';
+        value = strchr(key, ' ');
+        if (value)
+            *value++ = '\0';
+        reqs[n].cmd = cmd;
+        reqs[n].key = key;
+        reqs[n].value = value;
+        reqs[n].value_len = value ? strlen(value) : 0;
+        if (n == 0)
+            s = skvs_cluster_route(cluster, key);
+        else if (skvs_cluster_route(cluster, key) != s)
+            bad = 2;
+        n++;
+    }
+    free(line);
+
+    if (n == 0)
+        return 0;
+    memset(ops, 0, sizeof(ops));
+    if (bad || skvs_submit_multi(conns[s], ops, reqs, n) < 0)
+    {
+        fprintf(stderr, "client: %s\n",
+                bad == 2 ? "the keys of a MULTI block are on several servers"
+                         : "invalid MULTI block");
+        return 0;
+    }
+
+    for (i = 0; i < n && ret == 0; i++)
+    {
+        skvs_wait(conns[s], &ops[i]);
+        ret = print_reply(&ops[i], prefix);
+    }
+    for (; i < n; i++)
+    {
+        skvs_wait(conns[s], &ops[i]);
+        skvs_op_release(&ops[i]);
+    }
+
+    return ret;
+}
 /*---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
 {
@@ -24,20 +218,36 @@ int main(int argc, char *argv[])
 
     /*---------------------------------------------------------------------------*/
     /* free to declare any variables */
-    struct addrinfo hints, *server_info, *p;
-    int sockfd = -1;
-    int status;
-    char port_str[6];
+    skvs_cluster_t *cluster;
+    skvs_conn_t **conns;
+    skvs_op_t ops[PIPELINE_DEPTH];
+    int owner[PIPELINE_DEPTH]; /* server of each op in flight */
+    char key[MAX_KEY_LEN + 1];
+    int s, slot;
+    unsigned long submitted = 0, completed = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int ret = 0;
     /*---------------------------------------------------------------------------*/
 
     /* parse command line options */
-    while ((opt = getopt(argc, argv, "i:p:th")) != -1)
+    while ((opt = getopt(argc, argv, "i:p:u:th")) != -1)
     {
         switch (opt)
         {
         case 'i':
             ip = optarg;
             break;
+        case 'u':
+            if (!IS_UNIX_PATH(optarg))
+            {
+                fprintf(stderr, "Invalid unix socket %s, expected a path "
+                                "with a '/' or @name\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            ip = optarg;
+            break;
         case 'p':
             port = atoi(optarg);
             if (port <= 1024 || port >= 65536)
@@ -51,8 +261,8 @@ int main(int argc, char *argv[])
             break;
         case 'h':
         default:
-            printf("Usage: %s [-i server_ip_or_domain (%s)] "
-                   "[-p port (%d)] [-t]\n",
+            printf("Usage: %s [-i server[:port][,server[:port]...] (%s)] "
+                   "[-p port (%d)] [-u unix_path|@name] [-t]\n",
                    argv[0],
                    DEFAULT_LOOPBACK_IP,
                    DEFAULT_PORT);
@@ -62,93 +272,158 @@ int main(int argc, char *argv[])
 
     /*---------------------------------------------------------------------------*/
     /* edit here */
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    snprintf(port_str, sizeof(port_str), "%d", port);
-
-    if ((status = getaddrinfo(ip, port_str, &hints, &server_info)) != 0)
+    memset(ops, 0, sizeof(ops));
+    /* several servers share the keys; each line goes to the owner of
+     * its key, and keyless commands to the first server */
+    cluster = skvs_cluster_open(ip, port, 1, 0);
+    if (cluster == NULL)
     {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        fprintf(stderr, "client: invalid server list %s\n", ip);
         exit(EXIT_FAILURE);
     }
-
-    /* Try each address until we successfully connect */
-    for (p = server_info; p != NULL; p = p->ai_next)
+    conns = calloc(cluster->nservers, sizeof(skvs_conn_t *));
+    if (conns == NULL)
     {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1)
-        {
-            perror("client: socket");
-            continue;
-        }
-
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
-        {
-            close(sockfd);
-            perror("client: connect");
-            continue;
-        }
-
-        break;
+        fprintf(stderr, "client: out of memory\n");
+        exit(EXIT_FAILURE);
     }
-
-    freeaddrinfo(server_info);
-
-    if (p == NULL)
+    for (s = 0; s < cluster->nservers; s++)
     {
-        fprintf(stderr, "client: failed to connect\n");
-        exit(EXIT_FAILURE);
+        conns[s] = skvs_acquire(cluster->servers[s]);
+        if (conns[s] == NULL)
+        {
+            fprintf(stderr, "client: failed to connect to %s",
+                    cluster->servers[s]->host);
+            if (!IS_UNIX_PATH(cluster->servers[s]->host))
+                fprintf(stderr, ":%d", cluster->servers[s]->port);
+            fprintf(stderr, "\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     if (interactive)
     {
-        char line[BUFFER_SIZE];
-        printf("Connected to %s:%d\n", ip, port);
+        if (cluster->nservers == 1 && IS_UNIX_PATH(ip))
+            printf("Connected to %s\n", ip);
+        else if (cluster->nservers == 1)
+            printf("Connected to %s:%d\n", ip, port);
+        else
+            printf("Connected to %d servers (%s)\n", cluster->nservers, ip);
 
         while (1)
         {
             printf("Enter command: ");
             fflush(stdout);
 
-            if (fgets(line, sizeof(line), stdin) == NULL)
+            line_len = getline(&line, &line_cap, stdin);
+            if (line_len < 0)
                 break;
+            if (line_len > 0 && line[line_len - 1] == '\n')
+                line[--line_len] = '\0';
 
-            if (line[0] == 'c' && (line[1] == '\n' || line[1] == '\0'))
+            if (line[0] == 'c' && line_len == 1)
                 break;
 
-            write(sockfd, line, strlen(line));
+            if (strcasecmp(line, "MULTI") == 0)
+            {
+                if (run_multi(cluster, conns, "Enter command: ",
+                              "Server reply: ") < 0)
+                    break;
+                fflush(stdout);
+                continue;
+            }
 
-            char response[BUFFER_SIZE];
-            ssize_t bytes_read = read(sockfd, response, sizeof(response) - 1);
-            if (bytes_read > 0)
+            ret = run_mget(cluster, conns, line, line_len, "Server reply: ");
+            if (ret < 0)
+                break;
+            if (ret == 0)
             {
-                response[bytes_read] = '\0';
-                printf("Server reply: %s", response);
+                fflush(stdout);
+                continue;
             }
+            ret = 0;
+
+            s = skvs_cluster_route(cluster, line_key(line, line_len, key));
+            if (skvs_submit_line(conns[s], &ops[0], line, line_len) < 0)
+                break;
+            skvs_wait(conns[s], &ops[0]);
+            if (print_reply(&ops[0], "Server reply: ") < 0)
+                break;
+            fflush(stdout);
         }
     }
     else
     {
-        /* Silent mode - only process stdin */
-        char line[BUFFER_SIZE];
-        while (fgets(line, sizeof(line), stdin) != NULL)
+        /* Silent mode - only process stdin, keeping requests in flight
+         * on every server at once and printing the replies in order */
+        while (ret == 0 &&
+               (line_len = getline(&line, &line_cap, stdin)) >= 0)
         {
-            write(sockfd, line, strlen(line));
+            if (line_len > 0 && line[line_len - 1] == '\n')
+                line[--line_len] = '\0';
+            if (submitted - completed == PIPELINE_DEPTH)
+            {
+                slot = completed % PIPELINE_DEPTH;
+                skvs_wait(conns[owner[slot]], &ops[slot]);
+                ret = print_reply(&ops[slot], "");
+                completed++;
+                if (ret < 0)
+                    break;
+            }
 
-            char response[BUFFER_SIZE];
-            ssize_t bytes_read = read(sockfd, response, sizeof(response) - 1);
-            if (bytes_read > 0)
+            /* an MGET or a MULTI block waits for everything before it
+             * to be printed */
+            if (strcasecmp(line, "MULTI") == 0 ||
+                (line_len >= 5 && strncasecmp(line, "MGET ", 5) == 0))
             {
-                response[bytes_read] = '\0';
-                fprintf(stdout, "%s", response);
-                fflush(stdout);
+                while (ret == 0 && completed < submitted)
+                {
+                    slot = completed % PIPELINE_DEPTH;
+                    skvs_wait(conns[owner[slot]], &ops[slot]);
+                    ret = print_reply(&ops[slot], "");
+                    completed++;
+                }
+                if (ret == 0 && strcasecmp(line, "MULTI") == 0)
+                {
+                    ret = run_multi(cluster, conns, NULL, "");
+                    continue;
+                }
+                if (ret == 0)
+                    ret = run_mget(cluster, conns, line, line_len, "");
+                if (ret <= 0)
+                    continue;
+                ret = 0;
             }
+
+            slot = submitted % PIPELINE_DEPTH;
+            s = skvs_cluster_route(cluster, line_key(line, line_len, key));
+            if (skvs_submit_line(conns[s], &ops[slot], line, line_len) < 0)
+                break;
+            owner[slot] = s;
+            submitted++;
+
+            /* send without waiting, and print whatever came back */
+            if (skvs_poll(conns[s], 0) < 0)
+                ret = -1;
+            while (ret == 0 && completed < submitted &&
+                   ops[completed % PIPELINE_DEPTH].status != SKVS_PENDING)
+                ret = print_reply(&ops[completed++ % PIPELINE_DEPTH], "");
+        }
+        while (ret == 0 && completed < submitted)
+        {
+            slot = completed % PIPELINE_DEPTH;
+            skvs_wait(conns[owner[slot]], &ops[slot]);
+            ret = print_reply(&ops[slot], "");
+            completed++;
         }
+        fflush(stdout);
     }
 
-    close(sockfd);
+    free(line);
+    for (s = 0; s < cluster->nservers; s++)
+        skvs_release(cluster->servers[s], conns[s]);
+    free(conns);
+    skvs_cluster_close(cluster);
     /*---------------------------------------------------------------------------*/
 
     return 0;
@@ -6,17 +6,60 @@
 #define _COMMON_H
 /*---------------------------------------------------------------------------*/
 #include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 /*---------------------------------------------------------------------------*/
 #define MAX_KEY_LEN 32
 #define BUFFER_SIZE 4096
+#define MAX_VALUE_LEN (BUFFER_SIZE - 1) // largest value in a plain request
+#define MAX_BODY_LEN (64 << 20)        // largest value in a framed request
 #define DEFAULT_PORT 8080
 #define DEFAULT_LOOPBACK_IP "127.0.0.1"
 #define DEFAULT_ANY_IP "0.0.0.0"
-#define NUM_BACKLOG 20
+#define NUM_BACKLOG 128
+#define CONNS_PER_WORKER 64 // open connections per worker, without -c
+#define MAX_INFLIGHT 64 // unsent responses before a connection is not read
+#define SEND_TIMEOUT 10 // seconds a peer may leave responses unread
+#define MGET_MAX_KEYS 100 // keys in one MGET, which fits in a message
+#define MULTI_MAX_OPS 64  // requests in one MULTI ... EXEC block
+#define MULTI_MAX_LEN (BUFFER_SIZE * 2) // bytes in one, all read at once
 #define NUM_THREADS 10
+#define MIN_THREADS 2
 #define RWLOCK_DELAY 0
 #define TIMEOUT 1
 /*---------------------------------------------------------------------------*/
+/* a server address that names a unix domain socket rather than a host: a
+ * path (with a '/' in it), or '@' and a name in the abstract namespace */
+#define UNIX_ABSTRACT '@'
+#define IS_UNIX_PATH(s) ((s)[0] == UNIX_ABSTRACT || strchr((s), '/') != NULL)
+/*---------------------------------------------------------------------------*/
+/* fills addr for the unix domain socket path; "@name" is name in the
+ * abstract namespace, which has no file and goes away with its socket.
+ * returns -1 when path is too long, or else the length of addr. */
+static inline int
+unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    size_t len = strlen(path);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (len == 0 || len >= sizeof(addr->sun_path))
+    {
+        errno = len ? ENAMETOOLONG : EINVAL;
+        return -1;
+    }
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == UNIX_ABSTRACT)
+    {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return sizeof(*addr);
+}
+/*---------------------------------------------------------------------------*/
 #ifdef DEBUG
 #define DEBUG_PRINT(...)                                               \
     do                                                                 \
@@ -0,0 +1,204 @@
+/*---------------------------------------------------------------------------*/
+/* flight.c                                                                  */
+/*---------------------------------------------------------------------------*/
+#include "flight.h"
+/*---------------------------------------------------------------------------*/
+/* 64-bit FNV-1a */
+static inline uint64_t
+key_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+static inline struct flight_slot *
+slot_of(struct flights *f, const struct flight *fl)
+{
+    return &f->slots[fl->hash % FLIGHT_SLOTS];
+}
+/*---------------------------------------------------------------------------*/
+/* takes fl out of the flights of its slot; caller holds the slot lock */
+static void
+unlink_flight(struct flight_slot *s, struct flight *fl)
+{
+    struct flight **link;
+
+    for (link = &s->head; *link; link = &(*link)->next)
+    {
+        if (*link == fl)
+        {
+            *link = fl->next;
+            break;
+        }
+    }
+    fl->sealed = 1;
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_flight(struct flight *fl)
+{
+    free(fl->reply);
+    free(fl);
+}
+/*---------------------------------------------------------------------------*/
+struct flights *flight_init(void)
+{
+    TRACE_PRINT();
+    struct flights *f = calloc(1, sizeof(struct flights));
+    int i;
+
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < FLIGHT_SLOTS; i++)
+    {
+        if (pthread_mutex_init(&f->slots[i].lock, NULL) != 0)
+        {
+            break;
+        }
+        if (pthread_cond_init(&f->slots[i].landed, NULL) != 0)
+        {
+            pthread_mutex_destroy(&f->slots[i].lock);
+            break;
+        }
+    }
+    if (i < FLIGHT_SLOTS)
+    {
+        while (i-- > 0)
+        {
+            pthread_cond_destroy(&f->slots[i].landed);
+            pthread_mutex_destroy(&f->slots[i].lock);
+        }
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+/*---------------------------------------------------------------------------*/
+void flight_destroy(struct flights *f)
+{
+    TRACE_PRINT();
+    int i;
+
+    for (i = 0; i < FLIGHT_SLOTS; i++)
+    {
+        pthread_cond_destroy(&f->slots[i].landed);
+        pthread_mutex_destroy(&f->slots[i].lock);
+    }
+    free(f);
+}
+/*---------------------------------------------------------------------------*/
+int flight_join(struct flights *f, const char *key, struct flight **flp)
+{
+    uint64_t hash = key_hash(key);
+    struct flight_slot *s = &f->slots[hash % FLIGHT_SLOTS];
+    struct flight *fl;
+
+    pthread_mutex_lock(&s->lock);
+    for (fl = s->head; fl; fl = fl->next)
+    {
+        if (fl->hash == hash && strcmp(fl->key, key) == 0)
+        {
+            break;
+        }
+    }
+
+    if (fl)
+    {
+        fl->refs++;
+        while (!fl->landed)
+        {
+            pthread_cond_wait(&s->landed, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (fl->reply)
+        {
+            __atomic_add_fetch(&f->shared, 1, __ATOMIC_RELAXED);
+        }
+        *flp = fl;
+        return 0;
+    }
+
+    fl = calloc(1, sizeof(struct flight));
+    if (fl == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    fl->hash = hash;
+    strcpy(fl->key, key);
+    fl->next = s->head;
+    s->head = fl;
+    pthread_mutex_unlock(&s->lock);
+
+    *flp = fl;
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+void flight_seal(struct flights *f, struct flight *fl)
+{
+    struct flight_slot *s = slot_of(f, fl);
+
+    pthread_mutex_lock(&s->lock);
+    unlink_flight(s, fl);
+    pthread_mutex_unlock(&s->lock);
+}
+/*---------------------------------------------------------------------------*/
+void flight_land(struct flights *f, struct flight *fl,
+                 const char *reply, size_t len)
+{
+    struct flight_slot *s = slot_of(f, fl);
+
+    pthread_mutex_lock(&s->lock);
+    if (!fl->sealed)
+    {
+        /* the leader never got to read, followers read alone */
+        unlink_flight(s, fl);
+        reply = NULL;
+    }
+    if (fl->refs == 0)
+    {
+        pthread_mutex_unlock(&s->lock);
+        free_flight(fl);
+        return;
+    }
+
+    /* followers keep the flight, the last one to leave frees it */
+    if (reply)
+    {
+        fl->reply = malloc(len);
+        if (fl->reply)
+        {
+            memcpy(fl->reply, reply, len);
+            fl->reply_len = len;
+        }
+    }
+    fl->landed = 1;
+    pthread_cond_broadcast(&s->landed);
+    pthread_mutex_unlock(&s->lock);
+}
+/*---------------------------------------------------------------------------*/
+void flight_leave(struct flights *f, struct flight *fl)
+{
+    struct flight_slot *s = slot_of(f, fl);
+    int last;
+
+    pthread_mutex_lock(&s->lock);
+    last = --fl->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (last)
+    {
+        free_flight(fl);
+    }
+}
+/*---------------------------------------------------------------------------*/
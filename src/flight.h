@@ -0,0 +1,91 @@
+/*---------------------------------------------------------------------------*/
+/* flight.h                                                                  */
+/*---------------------------------------------------------------------------*/
+#ifndef _FLIGHT_H
+#define _FLIGHT_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* single-flight READs: of the READs of a key that run at the same time,
+ * the first (the leader) reads the table, and the others (followers)
+ * wait for its reply and copy it, without touching the bucket lock.
+ *
+ * a follower may only join while the leader still holds the bucket
+ * read lock, which the leader marks by sealing the flight before it lets
+ * the lock go. the table cannot change while the lock is held, so the
+ * value every follower gets is the value at a moment after it arrived.
+ * one that comes later starts a flight of its own. */
+#define FLIGHT_SLOTS 256 // stripes of flights in the air, by key hash
+/*---------------------------------------------------------------------------*/
+struct flight
+{
+    struct flight *next;
+    uint64_t hash;
+    char key[MAX_KEY_LEN + 1];
+    int sealed;       // no more followers, the flight left its slot
+    int landed;       // the reply is in, or the leader has none
+    int refs;         // followers yet to copy the reply
+    char *reply;      // NULL when the leader has none to share
+    size_t reply_len;
+};
+/*---------------------------------------------------------------------------*/
+struct flight_slot
+{
+    pthread_mutex_t lock;
+    pthread_cond_t landed;
+    struct flight *head; // flights that still take followers
+};
+/*---------------------------------------------------------------------------*/
+struct flights
+{
+    struct flight_slot slots[FLIGHT_SLOTS];
+    uint64_t shared; // READs answered with the reply of a leader
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * creates an empty set of flights.
+ * returns NULL when any internal errors occur.
+ */
+struct flights *flight_init(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * frees the set, which must have no flight left.
+ */
+void flight_destroy(struct flights *f);
+/*---------------------------------------------------------------------------*/
+/**
+ * joins the flight of a READ of key, or starts one, and sets *fl to it.
+ * a follower waits here until the flight lands.
+ * returns -1 when any internal errors occur; the caller reads alone.
+ * returns 1 when the caller leads the flight, and has to read the table,
+ * call flight_seal() before it releases the bucket lock, then
+ * flight_land().
+ * returns 0 when the caller follows, and has to copy (*fl)->reply unless
+ * it is NULL, then call flight_leave().
+ */
+int flight_join(struct flights *f, const char *key, struct flight **fl);
+/*---------------------------------------------------------------------------*/
+/**
+ * takes no more followers on fl; called by its leader with the bucket of
+ * the key still read-locked.
+ */
+void flight_seal(struct flights *f, struct flight *fl);
+/*---------------------------------------------------------------------------*/
+/**
+ * hands a copy of the reply of len bytes (NULL when the leader has none)
+ * to the followers of fl, and lets go of fl.
+ */
+void flight_land(struct flights *f, struct flight *fl,
+                 const char *reply, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * lets go of fl once its follower copied the reply.
+ */
+void flight_leave(struct flights *f, struct flight *fl);
+/*---------------------------------------------------------------------------*/
+#endif // _FLIGHT_H
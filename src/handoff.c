@@ -0,0 +1,280 @@
+/*---------------------------------------------------------------------------*/
+/* handoff.c                                                                 */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+/*---------------------------------------------------------------------------*/
+/* bounds how long fd blocks in reads and writes */
+static void
+set_timeout(int fd)
+{
+    struct timeval tv = {HANDOFF_TIMEOUT_SEC, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+/*---------------------------------------------------------------------------*/
+int handoff_listen(const char *path)
+{
+    TRACE_PRINT();
+    struct sockaddr_un addr;
+    int fd, addr_len = unix_addr(&addr, path);
+
+    if (addr_len < 0)
+    {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (path[0] != UNIX_ABSTRACT)
+    {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0 ||
+        listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+/*---------------------------------------------------------------------------*/
+int handoff_accept(int lfd)
+{
+    TRACE_PRINT();
+    int fd = accept(lfd, NULL, NULL);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    set_timeout(fd);
+    if (handoff_expect_msg(fd, HANDOFF_REQUEST,
+                           strlen(HANDOFF_REQUEST)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+/*---------------------------------------------------------------------------*/
+int handoff_request(const char *path)
+{
+    TRACE_PRINT();
+    struct sockaddr_un addr;
+    int fd, addr_len = unix_addr(&addr, path);
+
+    if (addr_len < 0)
+    {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_timeout(fd);
+    if (handoff_send_msg(fd, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+/*---------------------------------------------------------------------------*/
+int handoff_send_msg(int fd, const char *msg, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, msg, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        msg += n;
+        len -= n;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int handoff_expect_msg(int fd, const char *msg, size_t len)
+{
+    char buf[32];
+    size_t got = 0;
+    ssize_t n;
+
+    if (len > sizeof(buf))
+    {
+        return -1;
+    }
+    while (got < len)
+    {
+        n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        got += n;
+    }
+
+    return memcmp(buf, msg, len) == 0 ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+/* sends one message of n descriptors (none when n is 0) */
+static int
+send_batch(int fd, const int *fds, int n)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } ctl;
+    uint32_t count = n;
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n > 0)
+    {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    }
+
+    do
+    {
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == sizeof(count) ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+int handoff_send_fds(int fd, const int *fds, int n)
+{
+    TRACE_PRINT();
+    int i, batch;
+
+    for (i = 0; i < n; i += batch)
+    {
+        batch = n - i < HANDOFF_BATCH ? n - i : HANDOFF_BATCH;
+        if (send_batch(fd, fds + i, batch) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return send_batch(fd, NULL, 0);
+}
+/*---------------------------------------------------------------------------*/
+int handoff_recv_fds(int fd, int **fds)
+{
+    TRACE_PRINT();
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } ctl;
+    uint32_t count;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int *all = NULL, *grown, n = 0, i, got;
+    ssize_t ret;
+
+    while (1)
+    {
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        do
+        {
+            ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != sizeof(count) || count > HANDOFF_BATCH ||
+            (msg.msg_flags & MSG_CTRUNC))
+        {
+            goto fail;
+        }
+        if (count == 0)
+        {
+            break;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            goto fail;
+        }
+        got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        grown = realloc(all, sizeof(int) * (n + got));
+        if (grown == NULL)
+        {
+            /* still take ownership, so they get closed below */
+            for (i = 0; i < got; i++)
+            {
+                close(((int *)CMSG_DATA(cmsg))[i]);
+            }
+            goto fail;
+        }
+        all = grown;
+        memcpy(all + n, CMSG_DATA(cmsg), sizeof(int) * got);
+        n += got;
+        if (got != count)
+        {
+            goto fail;
+        }
+    }
+
+    *fds = all;
+    return n;
+
+fail:
+    for (i = 0; i < n; i++)
+    {
+        close(all[i]);
+    }
+    free(all);
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
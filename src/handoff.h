@@ -0,0 +1,78 @@
+/*---------------------------------------------------------------------------*/
+/* handoff.h                                                                 */
+/*---------------------------------------------------------------------------*/
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* hot restart: a running server listens on a unix socket at a known path.
+ * a new server connects to it and sends HANDOFF_REQUEST. the old server
+ * stops accepting, finishes the requests it has read, and writes its table
+ * in the hash_export() stream format. the new server loads it and answers
+ * with HANDOFF_ACK, and the old server passes its listening sockets and
+ * the client connections it was serving over SCM_RIGHTS, then exits.
+ * descriptors go in messages of a u32 count followed by that many
+ * descriptors, at most HANDOFF_BATCH at a time, ending with a count of 0.
+ * the listening sockets come first, before any connection. */
+#define HANDOFF_REQUEST "TAKEOVER\n"
+#define HANDOFF_ACK "LOADED\n"
+#define HANDOFF_BATCH 64       // descriptors per message
+#define HANDOFF_TIMEOUT_SEC 10 // wait for the peer at most this long
+/*---------------------------------------------------------------------------*/
+/**
+ * listens on a unix socket at path, replacing a stale one, or at "@name"
+ * in the abstract namespace.
+ * returns -1 when any internal errors occur.
+ * returns the listening socket on success.
+ */
+int handoff_listen(const char *path);
+/*---------------------------------------------------------------------------*/
+/**
+ * accepts a connection on the socket of handoff_listen() and reads its
+ * request. a connection that does not ask for a handoff is closed.
+ * returns -1 when no handoff was requested.
+ * returns the connection to the new server on success.
+ */
+int handoff_accept(int lfd);
+/*---------------------------------------------------------------------------*/
+/**
+ * asks the server listening at path to hand over.
+ * returns -1 when no server listens there, or any internal errors occur.
+ * returns the connection to the old server on success.
+ */
+int handoff_request(const char *path);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes len bytes of msg to fd.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int handoff_send_msg(int fd, const char *msg, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * waits for exactly the len bytes of msg from fd.
+ * returns -1 when something else arrives, or any internal errors occur.
+ * returns 0 on success.
+ */
+int handoff_expect_msg(int fd, const char *msg, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * passes n descriptors over fd. they stay open in the caller.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int handoff_send_fds(int fd, const int *fds, int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * receives the descriptors of handoff_send_fds() into a new array *fds.
+ * returns -1 when any internal errors occur; descriptors received so
+ * far are closed.
+ * returns the number of descriptors on success.
+ */
+int handoff_recv_fds(int fd, int **fds);
+/*---------------------------------------------------------------------------*/
+#endif // _HANDOFF_H
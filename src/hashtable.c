@@ -5,6 +5,291 @@
 /*---------------------------------------------------------------------------*/
 #include "hashtable.h"
 /*---------------------------------------------------------------------------*/
+/* hands out a table-wide unique version, so a deleted and re-created key
+ * never reuses a version a CAS client may still hold */
+static inline uint64_t
+next_version(hashtable_t *table)
+{
+    return __atomic_add_fetch(&table->version_seq, 1, __ATOMIC_RELAXED);
+}
+/*---------------------------------------------------------------------------*/
+/* reports a mutation of node; caller holds its bucket write lock */
+static inline void
+notify(hashtable_t *table, int op, const node_t *node)
+{
+    int i;
+
+    for (i = 0; i < table->nhooks; i++)
+    {
+        table->hooks[i](table->hook_args[i], op, node);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* finds the node of key in a bucket; caller holds the bucket lock */
+static inline node_t *
+bucket_find(node_t *node, const char *key)
+{
+    while (node)
+    {
+        if (strcmp(node->key, key) == 0)
+        {
+            return node;
+        }
+        node = node->next;
+    }
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* the transaction of this thread, see hash_txn_begin() */
+static __thread struct
+{
+    hashtable_t *table;               // NULL outside a transaction
+    unsigned int index[HASH_TXN_MAX]; // write-locked buckets, ascending
+    int n;
+} t_txn;
+/*---------------------------------------------------------------------------*/
+/* returns 1 when the transaction of this thread holds lock, or -1 when it
+ * does not although one is open on table, or 0 outside a transaction */
+static inline int
+txn_holds(hashtable_t *table, rwlock_t *lock)
+{
+    unsigned int index = lock - table->locks;
+    int i;
+
+    if (t_txn.table != table)
+    {
+        return 0;
+    }
+    for (i = 0; i < t_txn.n; i++)
+    {
+        if (t_txn.index[i] == index)
+        {
+            return 1;
+        }
+    }
+
+    return -1; // the key was not declared
+}
+/*---------------------------------------------------------------------------*/
+/* write-locks the bucket at index and makes its sequence odd, so that
+ * optimistic readers (see hash_search_copy()) drop what they read meanwhile */
+static inline int
+seq_write_lock(hashtable_t *table, unsigned int index)
+{
+    uint32_t *seq = &table->seqs[index];
+
+    if (rwlock_write_lock(&table->locks[index]) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return 0;
+}
+static inline void
+seq_write_unlock(hashtable_t *table, unsigned int index)
+{
+    uint32_t *seq = &table->seqs[index];
+
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+    rwlock_write_unlock(&table->locks[index]);
+}
+/*---------------------------------------------------------------------------*/
+/* the bucket locks of point operations, which leave the buckets of a
+ * transaction alone, as it holds their write locks until it ends */
+static inline int
+bucket_read_lock(hashtable_t *table, rwlock_t *lock)
+{
+    int held = txn_holds(table, lock);
+
+    return held ? (held > 0 ? 0 : -1) : rwlock_read_lock(lock);
+}
+static inline void
+bucket_read_unlock(hashtable_t *table, rwlock_t *lock)
+{
+    if (txn_holds(table, lock) == 0)
+    {
+        rwlock_read_unlock(lock);
+    }
+}
+static inline int
+bucket_write_lock(hashtable_t *table, rwlock_t *lock)
+{
+    int held = txn_holds(table, lock);
+
+    return held ? (held > 0 ? 0 : -1)
+                : seq_write_lock(table, lock - table->locks);
+}
+static inline void
+bucket_write_unlock(hashtable_t *table, rwlock_t *lock)
+{
+    if (txn_holds(table, lock) == 0)
+    {
+        seq_write_unlock(table, lock - table->locks);
+    }
+}
+/*---------------------------------------------------------------------------*/
+static inline size_t
+reverse_bits(size_t v)
+{
+    size_t r = 0;
+    int i;
+
+    for (i = 0; i < sizeof(v) * 8; i++)
+    {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+
+    return r;
+}
+/*---------------------------------------------------------------------------*/
+/* allocates a node holding key and value for the bucket at index, reusing
+ * one deleted from it when there is; caller holds its write lock. when
+ * owned, a value too long to be stored inline is adopted as is instead of
+ * being copied; a short one is copied and stays with the caller. */
+static node_t *
+node_alloc(hashtable_t *table, unsigned int index, const char *key,
+           char *value, size_t value_size, int owned)
+{
+    size_t key_size = strlen(key);
+    int inline_value = value_size < NODE_INLINE_VALUE;
+    node_t *node = table->free_nodes[index];
+
+    if (node)
+    {
+        table->free_nodes[index] = node->next;
+    }
+    else
+    {
+        node = malloc(NODE_SIZE);
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+
+    memcpy(node->key, key, key_size + 1);
+    node->key_size = key_size;
+    node->flags = 0;
+    if (inline_value)
+    {
+        node->value = node->key + key_size + 1;
+        memcpy(node->value, value, value_size + 1);
+    }
+    else if (owned)
+    {
+        node->value = value;
+    }
+    else
+    {
+        node->value = malloc(value_size + 1);
+        if (!node->value)
+        {
+            node->next = table->free_nodes[index];
+            table->free_nodes[index] = node;
+            return NULL;
+        }
+        memcpy(node->value, value, value_size + 1);
+    }
+    node->value_size = value_size;
+
+    return node;
+}
+/*---------------------------------------------------------------------------*/
+/* keeps node for the next node_alloc() of the bucket at index; caller
+ * holds its write lock. an optimistic reader may still be on the node,
+ * so its memory is only given back by hash_destroy(). */
+static void
+node_free(hashtable_t *table, unsigned int index, node_t *node)
+{
+    if (!NODE_INLINE(node))
+    {
+        free(node->value);
+    }
+    node->next = table->free_nodes[index];
+    table->free_nodes[index] = node;
+}
+/*---------------------------------------------------------------------------*/
+/* replaces the value of node with the concatenation of head and tail
+ * (either may be NULL). moves it to the inline slot when the result fits,
+ * and leaves the node untouched when allocation fails. */
+static int
+node_set_value(node_t *node, const char *head, size_t head_len,
+               const char *tail, size_t tail_len)
+{
+    size_t len = head_len + tail_len;
+    char *buf;
+
+    if (len < NODE_INLINE_VALUE)
+    {
+        buf = node->key + node->key_size + 1;
+        memmove(buf, head, head_len);
+        if (!NODE_INLINE(node))
+        {
+            free(node->value);
+        }
+    }
+    else if (!NODE_INLINE(node) && head == node->value)
+    {
+        /* appending to a heap value grows it where possible */
+        buf = realloc(node->value, len + 1);
+        if (!buf)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        buf = malloc(len + 1);
+        if (!buf)
+        {
+            return -1;
+        }
+        memcpy(buf, head, head_len);
+        if (!NODE_INLINE(node))
+        {
+            free(node->value);
+        }
+    }
+    if (tail_len)
+    {
+        memcpy(buf + head_len, tail, tail_len);
+    }
+    buf[len] = '\0';
+
+    node->value = buf;
+    node->value_size = len;
+    node->flags = 0;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* replaces the value of node with an owned heap buffer, which is copied
+ * into the inline slot instead when it fits there */
+static void
+node_take_value(node_t *node, char *value, size_t value_size, int flags)
+{
+    if (!NODE_INLINE(node))
+    {
+        free(node->value);
+    }
+    if (value_size < NODE_INLINE_VALUE)
+    {
+        node->value = node->key + node->key_size + 1;
+        memcpy(node->value, value, value_size + 1);
+        free(value);
+    }
+    else
+    {
+        node->value = value;
+    }
+    node->value_size = value_size;
+    node->flags = flags;
+}
+/*---------------------------------------------------------------------------*/
 int hash(const char *key, size_t hash_size)
 {
     TRACE_PRINT();
@@ -17,7 +302,7 @@ int hash(const char *key, size_t hash_size)
     return hash % hash_size;
 }
 /*---------------------------------------------------------------------------*/
-hashtable_t *hash_init(size_t hash_size, int delay)
+hashtable_t *hash_init(size_t hash_size, int delay, int flags)
 {
     TRACE_PRINT();
     int i, j, ret;
@@ -31,6 +316,12 @@ hashtable_t *hash_init(size_t hash_size, int delay)
 
     table->hash_size = hash_size;
     table->total_entries = 0;
+    table->version_seq = 0;
+    table->index = NULL;
+    table->nhooks = 0;
+    table->lock_policy = (flags & HASH_LOCK_FAIR)     ? RWLOCK_PHASE_FAIR
+                         : (flags & HASH_LOCK_WRITER) ? RWLOCK_WRITER_PREF
+                                                      : RWLOCK_READER_PREF;
 
     table->buckets = malloc(hash_size * sizeof(node_t *));
     if (table->buckets == NULL)
@@ -40,7 +331,7 @@ hashtable_t *hash_init(size_t hash_size, int delay)
         return NULL;
     }
 
-    table->locks = malloc(hash_size * sizeof(rwlock_t));
+    table->locks = calloc(hash_size, sizeof(rwlock_t));
     if (table->locks == NULL)
     {
         DEBUG_PRINT("Failed to allocate memory for hash table locks");
@@ -49,12 +340,20 @@ hashtable_t *hash_init(size_t hash_size, int delay)
         return NULL;
     }
 
+    /* apart from the locks, which readers write, so that optimistic readers
+     * share the cache lines of the sequences with writers only */
+    table->seqs = calloc(hash_size, sizeof(*table->seqs));
+    table->free_nodes = calloc(hash_size, sizeof(*table->free_nodes));
     table->bucket_sizes = malloc(hash_size * sizeof(*table->bucket_sizes));
-    if (table->bucket_sizes == NULL)
+    if (table->seqs == NULL || table->free_nodes == NULL ||
+        table->bucket_sizes == NULL)
     {
-        DEBUG_PRINT("Failed to allocate memory for hash table bucket sizes");
+        DEBUG_PRINT("Failed to allocate memory for hash table buckets");
         free(table->buckets);
         free(table->locks);
+        free(table->seqs);
+        free(table->free_nodes);
+        free(table->bucket_sizes);
         free(table);
         return NULL;
     }
@@ -63,7 +362,7 @@ hashtable_t *hash_init(size_t hash_size, int delay)
     {
         table->buckets[i] = NULL;
         table->bucket_sizes[i] = 0;
-        ret = rwlock_init(&table->locks[i], delay);
+        ret = rwlock_init(&table->locks[i], delay, table->lock_policy);
         if (ret != 0)
         {
             DEBUG_PRINT("Failed to initialize read-write lock");
@@ -73,12 +372,25 @@ hashtable_t *hash_init(size_t hash_size, int delay)
             }
             free(table->buckets);
             free(table->locks);
+            free(table->seqs);
+            free(table->free_nodes);
             free(table->bucket_sizes);
             free(table);
             return NULL;
         }
     }
 
+    if (flags & HASH_ORDERED)
+    {
+        table->index = skiplist_init();
+        if (table->index == NULL)
+        {
+            DEBUG_PRINT("Failed to initialize ordered key index");
+            hash_destroy(table);
+            return NULL;
+        }
+    }
+
     return table;
 }
 /*---------------------------------------------------------------------------*/
@@ -95,8 +407,13 @@ int hash_destroy(hashtable_t *table)
         {
             tmp = node;
             node = node->next;
-            free(tmp->key);
-            free(tmp->value);
+            node_free(table, i, tmp);
+        }
+        node = table->free_nodes[i];
+        while (node)
+        {
+            tmp = node;
+            node = node->next;
             free(tmp);
         }
         if (rwlock_destroy(&table->locks[i]) != 0)
@@ -106,15 +423,24 @@ int hash_destroy(hashtable_t *table)
         }
     }
 
+    if (table->index)
+    {
+        skiplist_destroy(table->index);
+    }
     free(table->buckets);
     free(table->locks);
+    free(table->seqs);
+    free(table->free_nodes);
     free(table->bucket_sizes);
     free(table);
 
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-int hash_insert(hashtable_t *table, const char *key, const char *value)
+/* inserts key with a value of value_size bytes, adopting value when owned */
+static int
+insert_value(hashtable_t *table, const char *key,
+             char *value, size_t value_size, int owned, int flags)
 {
     TRACE_PRINT();
     node_t *node;
@@ -124,7 +450,7 @@ int hash_insert(hashtable_t *table, const char *key, const char *value)
     /*---------------------------------------------------------------------------*/
     /* edit here */
     lock = &table->locks[index];
-    if (rwlock_write_lock(lock) != 0)
+    if (bucket_write_lock(table, lock) != 0)
     {
         return -1; // Lock acquisition failed
     }
@@ -135,42 +461,50 @@ int hash_insert(hashtable_t *table, const char *key, const char *value)
     {
         if (strcmp(node->key, key) == 0)
         {
-            rwlock_write_unlock(lock);
+            bucket_write_unlock(table, lock);
             return 0; // Collision
         }
         node = node->next;
     }
 
-    /* Create new node */
-    node = malloc(sizeof(node_t));
+    /* Create new node with its key and (short) value inline */
+    node = node_alloc(table, index, key, value, value_size, owned);
     if (!node)
     {
-        rwlock_write_unlock(lock);
+        bucket_write_unlock(table, lock);
         return -1;
     }
+    node->version = next_version(table);
+    node->flags = flags;
 
-    /* Duplicate key and value */
-    node->key = strdup(key);
-    node->value = strdup(value);
-    if (!node->key || !node->value)
+    /* keep the ordered index in step while the bucket is still locked; it
+     * only locks the index nodes around the key, never waiting on a scan */
+    if (table->index && skiplist_insert(table->index, key) < 0)
     {
-        free(node->key); // One might be NULL
-        free(node->value);
-        free(node);
-        rwlock_write_unlock(lock);
+        if (owned && !NODE_INLINE(node))
+        {
+            /* hand the value back to the caller */
+            node->value = NULL;
+        }
+        node_free(table, index, node);
+        bucket_write_unlock(table, lock);
         return -1;
     }
 
-    node->key_size = strlen(key);
-    node->value_size = strlen(value);
+    if (owned && NODE_INLINE(node))
+    {
+        /* copied inline, the buffer is no longer needed */
+        free(value);
+    }
 
     /* Insert at head of bucket */
     node->next = table->buckets[index];
     table->buckets[index] = node;
     table->bucket_sizes[index]++;
-    table->total_entries++;
+    __atomic_add_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
+    notify(table, HASH_OP_SET, node);
 
-    rwlock_write_unlock(lock);
+    bucket_write_unlock(table, lock);
 
     /*---------------------------------------------------------------------------*/
 
@@ -178,7 +512,19 @@ int hash_insert(hashtable_t *table, const char *key, const char *value)
     return 1;
 }
 /*---------------------------------------------------------------------------*/
-int hash_search(hashtable_t *table, const char *key, const char **value)
+int hash_insert(hashtable_t *table, const char *key, const char *value)
+{
+    return insert_value(table, key, (char *)value, strlen(value), 0, 0);
+}
+/*---------------------------------------------------------------------------*/
+int hash_insert_owned(hashtable_t *table, const char *key,
+                      char *value, size_t value_size, int flags)
+{
+    return insert_value(table, key, value, value_size, 1, flags);
+}
+/*---------------------------------------------------------------------------*/
+int hash_search(hashtable_t *table, const char *key,
+                const char **value, size_t *value_size, int *flags)
 {
     TRACE_PRINT();
     node_t *node;
@@ -188,7 +534,7 @@ int hash_search(hashtable_t *table, const char *key, const char **value)
     /*---------------------------------------------------------------------------*/
     /* edit here */
     lock = &table->locks[index];
-    if (rwlock_read_lock(lock) != 0)
+    if (bucket_read_lock(table, lock) != 0)
     {
         return -1; // Lock acquisition failed
     }
@@ -200,13 +546,15 @@ int hash_search(hashtable_t *table, const char *key, const char **value)
         if (strcmp(node->key, key) == 0)
         {
             *value = node->value;
-            rwlock_read_unlock(lock);
+            *value_size = node->value_size;
+            *flags = node->flags;
+            bucket_read_unlock(table, lock);
             return 1; // Found
         }
         node = node->next;
     }
 
-    rwlock_read_unlock(lock);
+    bucket_read_unlock(table, lock);
 
     /*---------------------------------------------------------------------------*/
 
@@ -214,18 +562,106 @@ int hash_search(hashtable_t *table, const char *key, const char **value)
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-int hash_update(hashtable_t *table, const char *key, const char *value)
+/* prefetches the buckets at index[0..n), their locks, then the first node
+ * of each. the heads are read without the locks, so a node may be freed
+ * meanwhile; prefetching it is harmless, nothing else uses it */
+static inline void
+prefetch_buckets(hashtable_t *table, const unsigned int *index, int n)
+{
+    node_t *node;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        __builtin_prefetch(&table->buckets[index[i]]);
+        __builtin_prefetch(&table->locks[index[i]], 1);
+    }
+#ifndef __SANITIZE_THREAD__
+    /* the unlocked read is a race by design, which tsan would report */
+    for (i = 0; i < n; i++)
+    {
+        node = __atomic_load_n(&table->buckets[index[i]], __ATOMIC_RELAXED);
+        if (node)
+        {
+            __builtin_prefetch(node);
+        }
+    }
+#else
+    (void)node;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+int hash_search_batch(hashtable_t *table, const char **keys, int n,
+                      hash_batch_fn fn, void *arg)
+{
+    TRACE_PRINT();
+    unsigned int index[HASH_BATCH];
+    node_t *node;
+    rwlock_t *lock;
+    int i, j, m, ret, found = 0;
+
+    for (i = 0; i < n; i += m)
+    {
+        m = n - i < HASH_BATCH ? n - i : HASH_BATCH;
+        for (j = 0; j < m; j++)
+        {
+            index[j] = hash(keys[i + j], table->hash_size);
+        }
+        prefetch_buckets(table, index, m);
+
+        for (j = 0; j < m; j++)
+        {
+            lock = &table->locks[index[j]];
+            if (bucket_read_lock(table, lock) != 0)
+            {
+                return -1;
+            }
+            node = bucket_find(table->buckets[index[j]], keys[i + j]);
+            ret = node ? fn(arg, i + j, node->value, node->value_size,
+                            node->flags)
+                       : fn(arg, i + j, NULL, 0, 0);
+            bucket_read_unlock(table, lock);
+            if (ret < 0)
+            {
+                return -1;
+            }
+            found += node != NULL;
+        }
+    }
+
+    return found;
+}
+/*---------------------------------------------------------------------------*/
+void hash_prefetch(hashtable_t *table, const char **keys, int n)
+{
+    unsigned int index[HASH_BATCH];
+    int i;
+
+    if (n > HASH_BATCH)
+    {
+        n = HASH_BATCH;
+    }
+    for (i = 0; i < n; i++)
+    {
+        index[i] = hash(keys[i], table->hash_size);
+    }
+    prefetch_buckets(table, index, n);
+}
+/*---------------------------------------------------------------------------*/
+/* updates key to a value of value_size bytes, adopting value when owned */
+static int
+update_value(hashtable_t *table, const char *key,
+             char *value, size_t value_size, int owned, int flags)
 {
     TRACE_PRINT();
     node_t *node;
     rwlock_t *lock;
-    char *new_value;
     unsigned int index = hash(key, table->hash_size);
 
     /*---------------------------------------------------------------------------*/
     /* edit here */
     lock = &table->locks[index];
-    if (rwlock_write_lock(lock) != 0)
+    if (bucket_write_lock(table, lock) != 0)
     {
         return -1; // Lock acquisition failed
     }
@@ -236,26 +672,26 @@ int hash_update(hashtable_t *table, const char *key, const char *value)
     {
         if (strcmp(node->key, key) == 0)
         {
-            /* Duplicate new value */
-            new_value = strdup(value);
-            if (!new_value)
+            /* Replace value, in place when it fits */
+            if (owned)
+            {
+                node_take_value(node, value, value_size, flags);
+            }
+            else if (node_set_value(node, value, value_size, NULL, 0) < 0)
             {
-                rwlock_write_unlock(lock);
+                bucket_write_unlock(table, lock);
                 return -1;
             }
+            node->version = next_version(table);
+            notify(table, HASH_OP_SET, node);
 
-            /* Free old value and update */
-            free(node->value);
-            node->value = new_value;
-            node->value_size = strlen(value);
-
-            rwlock_write_unlock(lock);
+            bucket_write_unlock(table, lock);
             return 1; // Updated
         }
         node = node->next;
     }
 
-    rwlock_write_unlock(lock);
+    bucket_write_unlock(table, lock);
 
     /*---------------------------------------------------------------------------*/
 
@@ -263,6 +699,17 @@ int hash_update(hashtable_t *table, const char *key, const char *value)
     return 0;
 }
 /*---------------------------------------------------------------------------*/
+int hash_update(hashtable_t *table, const char *key, const char *value)
+{
+    return update_value(table, key, (char *)value, strlen(value), 0, 0);
+}
+/*---------------------------------------------------------------------------*/
+int hash_update_owned(hashtable_t *table, const char *key,
+                      char *value, size_t value_size, int flags)
+{
+    return update_value(table, key, value, value_size, 1, flags);
+}
+/*---------------------------------------------------------------------------*/
 int hash_delete(hashtable_t *table, const char *key)
 {
     TRACE_PRINT();
@@ -273,7 +720,7 @@ int hash_delete(hashtable_t *table, const char *key)
     /*---------------------------------------------------------------------------*/
     /* edit here */
     lock = &table->locks[index];
-    if (rwlock_write_lock(lock) != 0)
+    if (bucket_write_lock(table, lock) != 0)
     {
         return -1; // Lock acquisition failed
     }
@@ -291,22 +738,27 @@ int hash_delete(hashtable_t *table, const char *key)
             else
                 table->buckets[index] = node->next;
 
+            if (table->index)
+            {
+                skiplist_delete(table->index, key);
+            }
+            node->version = next_version(table);
+            notify(table, HASH_OP_DELETE, node);
+
             /* Free node */
-            free(node->key);
-            free(node->value);
-            free(node);
+            node_free(table, index, node);
 
             table->bucket_sizes[index]--;
-            table->total_entries--;
+            __atomic_sub_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
 
-            rwlock_write_unlock(lock);
+            bucket_write_unlock(table, lock);
             return 1; // Deleted
         }
         prev = node;
         node = node->next;
     }
 
-    rwlock_write_unlock(lock);
+    bucket_write_unlock(table, lock);
 
     /*---------------------------------------------------------------------------*/
 
@@ -314,28 +766,982 @@ int hash_delete(hashtable_t *table, const char *key)
     return 0;
 }
 /*---------------------------------------------------------------------------*/
-/* function to dump the contents of the hash table, including locks status */
-void hash_dump(hashtable_t *table)
+int hash_restore_owned(hashtable_t *table, const char *key, char *value,
+                       size_t value_size, int flags, uint64_t version)
 {
     TRACE_PRINT();
     node_t *node;
-    int i;
+    uint64_t seq;
+    unsigned int index = hash(key, table->hash_size);
 
-    printf("[Hash Table Dump]");
-    printf("Total Entries: %ld\n", table->total_entries);
+    if (seq_write_lock(table, index) != 0)
+    {
+        return -1;
+    }
 
-    for (i = 0; i < table->hash_size; i++)
+    node = bucket_find(table->buckets[index], key);
+    if (node)
     {
-        if (!table->bucket_sizes[i])
+        node_take_value(node, value, value_size, flags);
+    }
+    else
+    {
+        node = node_alloc(table, index, key, value, value_size, 1);
+        if (!node)
         {
-            continue;
+            seq_write_unlock(table, index);
+            return -1;
         }
-        printf("Bucket %d: %ld entries\n", i, table->bucket_sizes[i]);
-        printf("  Lock State -> Read Count: %d, Write Count: %d\n",
-               table->locks[i].read_count, table->locks[i].write_count);
-        node = table->buckets[i];
-        while (node)
+        if (table->index && skiplist_insert(table->index, key) < 0)
+        {
+            if (!NODE_INLINE(node))
+            {
+                node->value = NULL;
+            }
+            node_free(table, index, node);
+            seq_write_unlock(table, index);
+            return -1;
+        }
+        if (NODE_INLINE(node))
         {
+            free(value);
+        }
+        node->flags = flags;
+        node->next = table->buckets[index];
+        table->buckets[index] = node;
+        table->bucket_sizes[index]++;
+        __atomic_add_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
+    }
+    node->version = version;
+
+    /* versions handed out later must stay above the restored ones */
+    seq = __atomic_load_n(&table->version_seq, __ATOMIC_RELAXED);
+    while (seq < version &&
+           !__atomic_compare_exchange_n(&table->version_seq, &seq, version,
+                                        1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+    notify(table, HASH_OP_SET, node);
+
+    seq_write_unlock(table, index);
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+int hash_clear(hashtable_t *table)
+{
+    TRACE_PRINT();
+    node_t *node, *tmp;
+    size_t i;
+
+    for (i = 0; i < table->hash_size; i++)
+    {
+        if (seq_write_lock(table, i) != 0)
+        {
+            return -1;
+        }
+
+        node = table->buckets[i];
+        while (node)
+        {
+            tmp = node;
+            node = node->next;
+            notify(table, HASH_OP_DELETE, tmp);
+            if (table->index)
+            {
+                skiplist_delete(table->index, tmp->key);
+            }
+            node_free(table, i, tmp);
+            __atomic_sub_fetch(&table->total_entries, 1, __ATOMIC_RELAXED);
+        }
+        table->buckets[i] = NULL;
+        table->bucket_sizes[i] = 0;
+
+        seq_write_unlock(table, i);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int hash_add_hook(hashtable_t *table, hash_hook_fn fn, void *arg)
+{
+    if (table->nhooks == HASH_MAX_HOOKS)
+    {
+        return -1;
+    }
+    table->hooks[table->nhooks] = fn;
+    table->hook_args[table->nhooks] = arg;
+    table->nhooks++;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+void hash_remove_hook(hashtable_t *table, hash_hook_fn fn, void *arg)
+{
+    int i;
+
+    for (i = 0; i < table->nhooks; i++)
+    {
+        if (table->hooks[i] == fn && table->hook_args[i] == arg)
+        {
+            table->nhooks--;
+            memmove(&table->hooks[i], &table->hooks[i + 1],
+                    (table->nhooks - i) * sizeof(hash_hook_fn));
+            memmove(&table->hook_args[i], &table->hook_args[i + 1],
+                    (table->nhooks - i) * sizeof(void *));
+            return;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+void hash_lock_stats(hashtable_t *table, struct rwlock_stats *stats)
+{
+    size_t i;
+
+    for (i = 0; i < table->hash_size; i++)
+    {
+        rwlock_stats(&table->locks[i], stats);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* one pass over the bucket at index without its lock, copying the value
+ * of key into buf like hash_search_copy() does. the nodes may change or
+ * be deleted under it, but never freed (see node_free()), so every field
+ * is read once, checked before it is used, and kept only if the sequence
+ * of the bucket did not move.
+ * returns -1 when the bucket changed meanwhile.
+ * returns -2 when the value has to be read under the lock.
+ * returns what hash_search_copy() does otherwise. */
+static int
+search_optimistic(hashtable_t *table, unsigned int index, const char *key,
+                  char *buf, size_t len, size_t *value_size,
+                  uint64_t *version)
+{
+    const uint32_t *seqp = &table->seqs[index];
+    size_t key_size = strlen(key);
+    const node_t *node;
+    const char *value;
+    uint64_t node_version = 0;
+    uint32_t seq, size = 0;
+    int steps, ret = 0;
+
+    if (key_size > MAX_KEY_LEN)
+    {
+        return -2;
+    }
+    seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+    {
+        return -1; // being written
+    }
+
+    node = __atomic_load_n(&table->buckets[index], __ATOMIC_RELAXED);
+    for (steps = 1; node; steps++)
+    {
+        if (__atomic_load_n(&node->key_size, __ATOMIC_RELAXED) ==
+                key_size &&
+            memcmp(node->key, key, key_size) == 0)
+        {
+            value = __atomic_load_n(&node->value, __ATOMIC_RELAXED);
+            size = __atomic_load_n(&node->value_size, __ATOMIC_RELAXED);
+            node_version = node->version;
+            if (size >= len)
+            {
+                /* a compressed value is longer once decompressed */
+                ret = 2;
+            }
+            else if (value != node->key + key_size + 1 ||
+                     size >= NODE_INLINE_VALUE ||
+                     (node->flags & NODE_COMPRESSED))
+            {
+                return -2;
+            }
+            else
+            {
+                memcpy(buf, value, size);
+                buf[size] = '\0';
+                ret = 1;
+            }
+            break;
+        }
+        node = __atomic_load_n(&node->next, __ATOMIC_RELAXED);
+
+        /* a walk that keeps being sent back by writers must not go on
+         * forever, while one over an unchanged bucket ends by itself */
+        if (steps % 16 == 0 &&
+            __atomic_load_n(seqp, __ATOMIC_ACQUIRE) != seq)
+        {
+            return -1;
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seqp, __ATOMIC_RELAXED) != seq)
+    {
+        return -1;
+    }
+    if (ret > 0)
+    {
+        *value_size = size;
+        *version = node_version;
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* tries search_optimistic() up to HASH_SEQ_RETRIES times.
+ * returns -2 when the caller has to read under the lock instead. */
+static int
+search_seq(hashtable_t *table, unsigned int index, const char *key,
+           char *buf, size_t len, size_t *value_size, uint64_t *version)
+{
+#ifndef __SANITIZE_THREAD__
+    int ret, tries;
+
+    /* the buckets of a transaction of this thread stay odd until it ends,
+     * and it reads them under the locks it holds */
+    for (tries = 0; tries < HASH_SEQ_RETRIES && t_txn.table != table;
+         tries++)
+    {
+        ret = search_optimistic(table, index, key, buf, len, value_size,
+                                version);
+        if (ret != -1)
+        {
+            return ret;
+        }
+    }
+#endif
+    /* the unlocked reads race with writers by design, which tsan would
+     * report */
+    return -2;
+}
+/*---------------------------------------------------------------------------*/
+int hash_search_copy(hashtable_t *table, const char *key, char *buf,
+                     size_t len, size_t *value_size, int *flags)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    uint64_t version;
+    int ret;
+    unsigned int index = hash(key, table->hash_size);
+
+    ret = search_seq(table, index, key, buf, len, value_size, &version);
+    if (ret != -2)
+    {
+        *flags = 0;
+        return ret;
+    }
+
+    lock = &table->locks[index];
+    if (bucket_read_lock(table, lock) != 0)
+    {
+        return -1;
+    }
+
+    node = bucket_find(table->buckets[index], key);
+    if (!node)
+    {
+        ret = 0;
+    }
+    else
+    {
+        *value_size = node->value_size;
+        *flags = node->flags;
+        ret = 2;
+        if (node->value_size < len)
+        {
+            memcpy(buf, node->value, node->value_size + 1);
+            ret = 1;
+        }
+    }
+
+    bucket_read_unlock(table, lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+int hash_gets(hashtable_t *table, const char *key,
+              char *buf, size_t len, uint64_t *version)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    size_t value_size;
+    int ret;
+    unsigned int index = hash(key, table->hash_size);
+
+    ret = search_seq(table, index, key, buf, len, &value_size, version);
+    if (ret != -2)
+    {
+        return ret;
+    }
+
+    lock = &table->locks[index];
+    if (bucket_read_lock(table, lock) != 0)
+    {
+        return -1;
+    }
+
+    node = bucket_find(table->buckets[index], key);
+    if (!node)
+    {
+        ret = 0;
+    }
+    else if (node->flags & NODE_COMPRESSED)
+    {
+        if (compressed_raw_size(node->value) >= len)
+        {
+            ret = 2;
+        }
+        else if (hash_decompress(node->value, node->value_size,
+                                 buf, len) < 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            *version = node->version;
+            ret = 1;
+        }
+    }
+    else if (node->value_size >= len)
+    {
+        ret = 2;
+    }
+    else
+    {
+        memcpy(buf, node->value, node->value_size + 1);
+        *version = node->version;
+        ret = 1;
+    }
+
+    bucket_read_unlock(table, lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+int hash_cas(hashtable_t *table, const char *key,
+             const char *value, uint64_t version)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    unsigned int index = hash(key, table->hash_size);
+
+    lock = &table->locks[index];
+    if (bucket_write_lock(table, lock) != 0)
+    {
+        return -1;
+    }
+
+    node = bucket_find(table->buckets[index], key);
+    if (!node)
+    {
+        bucket_write_unlock(table, lock);
+        return 0;
+    }
+    if (node->version != version)
+    {
+        bucket_write_unlock(table, lock);
+        return 2;
+    }
+
+    if (node_set_value(node, value, strlen(value), NULL, 0) < 0)
+    {
+        bucket_write_unlock(table, lock);
+        return -1;
+    }
+    node->version = next_version(table);
+    notify(table, HASH_OP_SET, node);
+
+    bucket_write_unlock(table, lock);
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+int hash_incr(hashtable_t *table, const char *key,
+              long long delta, long long *result)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    char *end, *value, *raw = NULL;
+    char num[32];
+    long long cur;
+    int n;
+    unsigned int index = hash(key, table->hash_size);
+
+    lock = &table->locks[index];
+    if (bucket_write_lock(table, lock) != 0)
+    {
+        return -1;
+    }
+
+    node = bucket_find(table->buckets[index], key);
+    if (!node)
+    {
+        bucket_write_unlock(table, lock);
+        return 0;
+    }
+
+    value = node->value;
+    if (node->flags & NODE_COMPRESSED)
+    {
+        raw = malloc(compressed_raw_size(node->value) + 1);
+        if (!raw || hash_decompress(node->value, node->value_size, raw,
+                                    compressed_raw_size(node->value) + 1) < 0)
+        {
+            free(raw);
+            bucket_write_unlock(table, lock);
+            return -1;
+        }
+        value = raw;
+    }
+
+    /* the whole value must be a decimal integer */
+    errno = 0;
+    cur = strtoll(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' ||
+        __builtin_add_overflow(cur, delta, &cur))
+    {
+        free(raw);
+        bucket_write_unlock(table, lock);
+        return 2;
+    }
+    free(raw);
+
+    n = snprintf(num, sizeof(num), "%lld", cur);
+    if (node_set_value(node, num, n, NULL, 0) < 0)
+    {
+        bucket_write_unlock(table, lock);
+        return -1;
+    }
+    node->version = next_version(table);
+    notify(table, HASH_OP_SET, node);
+    *result = cur;
+
+    bucket_write_unlock(table, lock);
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+int hash_append(hashtable_t *table, const char *key,
+                const char *value, size_t max_len)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    size_t len = strlen(value), raw;
+    char *buf;
+    unsigned int index = hash(key, table->hash_size);
+
+    lock = &table->locks[index];
+    if (bucket_write_lock(table, lock) != 0)
+    {
+        return -1;
+    }
+
+    node = bucket_find(table->buckets[index], key);
+    if (!node)
+    {
+        bucket_write_unlock(table, lock);
+        return 0;
+    }
+    raw = (node->flags & NODE_COMPRESSED) ? compressed_raw_size(node->value)
+                                          : node->value_size;
+    if (raw + len > max_len)
+    {
+        bucket_write_unlock(table, lock);
+        return 2;
+    }
+
+    if (node->flags & NODE_COMPRESSED)
+    {
+        /* the appended value is stored uncompressed again */
+        buf = malloc(raw + len + 1);
+        if (!buf || hash_decompress(node->value, node->value_size,
+                                    buf, raw + len + 1) < 0)
+        {
+            free(buf);
+            bucket_write_unlock(table, lock);
+            return -1;
+        }
+        memcpy(buf + raw, value, len + 1);
+        node_take_value(node, buf, raw + len, 0);
+    }
+    else if (node_set_value(node, node->value, node->value_size,
+                            value, len) < 0)
+    {
+        bucket_write_unlock(table, lock);
+        return -1;
+    }
+    node->version = next_version(table);
+    notify(table, HASH_OP_SET, node);
+
+    bucket_write_unlock(table, lock);
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+int hash_txn_begin(hashtable_t *table, const char **keys, int n)
+{
+    TRACE_PRINT();
+    unsigned int index, *held = t_txn.index;
+    int i, j, m = 0;
+
+    if (t_txn.table != NULL || n > HASH_TXN_MAX)
+    {
+        return -1;
+    }
+
+    /* the buckets of the keys, sorted and without duplicates */
+    for (i = 0; i < n; i++)
+    {
+        index = hash(keys[i], table->hash_size);
+        for (j = m; j > 0 && held[j - 1] > index; j--)
+            ;
+        if (j > 0 && held[j - 1] == index)
+        {
+            continue;
+        }
+        memmove(&held[j + 1], &held[j], (m - j) * sizeof(*held));
+        held[j] = index;
+        m++;
+    }
+
+    /* every other path holds a single bucket at a time, and transactions
+     * take theirs in ascending order, so no cycle of waits can form */
+    for (i = 0; i < m; i++)
+    {
+        if (seq_write_lock(table, held[i]) != 0)
+        {
+            while (i-- > 0)
+            {
+                seq_write_unlock(table, held[i]);
+            }
+            return -1;
+        }
+    }
+    t_txn.n = m;
+    t_txn.table = table;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+void hash_txn_end(hashtable_t *table)
+{
+    TRACE_PRINT();
+    int i;
+
+    if (t_txn.table != table)
+    {
+        return;
+    }
+    for (i = t_txn.n - 1; i >= 0; i--)
+    {
+        seq_write_unlock(table, t_txn.index[i]);
+    }
+    t_txn.table = NULL;
+    t_txn.n = 0;
+}
+/*---------------------------------------------------------------------------*/
+int hash_range(hashtable_t *table, const char *start,
+               skiplist_fn fn, void *arg)
+{
+    TRACE_PRINT();
+    if (table->index == NULL)
+    {
+        return -1;
+    }
+
+    return skiplist_scan(table->index, start, fn, arg);
+}
+/*---------------------------------------------------------------------------*/
+ssize_t hash_scan(hashtable_t *table, size_t *cursor, size_t count,
+                  char *buf, size_t len)
+{
+    TRACE_PRINT();
+    node_t *node;
+    rwlock_t *lock;
+    size_t mask, v, left, n, i, skip, need, copied = 0;
+    size_t visits = count < SIZE_MAX / 10 ? count * 10 : SIZE_MAX;
+    size_t off = 0;
+
+    /* cursors walk the smallest power-of-two space covering all buckets */
+    for (mask = 1; mask < table->hash_size; mask <<= 1)
+        ;
+    mask--;
+    v = *cursor & mask;
+    left = *cursor >> HASH_SCAN_LEFT_SHIFT;
+
+    do
+    {
+        if (v < table->hash_size)
+        {
+            lock = &table->locks[v];
+            if (rwlock_read_lock(lock) != 0)
+            {
+                return -1;
+            }
+
+            /* new keys go to the head of a bucket, so the last left keys
+             * are still the ones a split bucket has not returned yet */
+            n = 0;
+            for (node = table->buckets[v]; node; node = node->next)
+            {
+                n++;
+            }
+            skip = left > 0 && left < n ? n - left : 0;
+            need = 0;
+            for (i = 0, node = table->buckets[v]; node; node = node->next, i++)
+            {
+                if (i >= skip)
+                {
+                    need += node->key_size + 1;
+                }
+            }
+            if (off > 0 && off + need >= len)
+            {
+                rwlock_read_unlock(lock);
+                break;
+            }
+            for (i = 0, node = table->buckets[v]; node; node = node->next, i++)
+            {
+                if (i < skip)
+                {
+                    continue;
+                }
+                if (off + node->key_size + 1 >= len)
+                {
+                    break;
+                }
+                buf[off++] = ' ';
+                memcpy(buf + off, node->key, node->key_size);
+                off += node->key_size;
+                copied++;
+            }
+
+            rwlock_read_unlock(lock);
+
+            if (node != NULL)
+            {
+                if (off == 0)
+                {
+                    /* not even a single key fits */
+                    return -1;
+                }
+                /* the bucket alone does not fit; resume inside it */
+                buf[off] = '\0';
+                *cursor = v | ((n - i) << HASH_SCAN_LEFT_SHIFT);
+                return off;
+            }
+        }
+        left = 0;
+
+        /* increment the reversed cursor */
+        v |= ~mask;
+        v = reverse_bits(v);
+        v++;
+        v = reverse_bits(v);
+    } while (v != 0 && copied < count && --visits > 0);
+
+    buf[off] = '\0';
+    *cursor = v;
+
+    return off;
+}
+/*---------------------------------------------------------------------------*/
+/* one export thread's share of the buckets */
+struct export_arg
+{
+    hashtable_t *table;
+    size_t from, to;       // bucket range [from, to)
+    int fd;
+    pthread_mutex_t *lock; // serializes writes to fd
+    int ret;
+};
+/*---------------------------------------------------------------------------*/
+static int
+write_full(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+export_flush(struct export_arg *arg, const char *buf, size_t len)
+{
+    int ret;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(arg->lock);
+    ret = write_full(arg->fd, buf, len);
+    pthread_mutex_unlock(arg->lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+static void *
+export_worker(void *p)
+{
+    TRACE_PRINT();
+    struct export_arg *arg = p;
+    hashtable_t *table = arg->table;
+    size_t cap = HASH_EXPORT_BUF_SIZE, off = 0, need, i;
+    char *buf = malloc(cap), *tmp;
+    uint16_t hdr[2];
+    uint32_t value_size;
+    node_t *node;
+    rwlock_t *lock;
+
+    arg->ret = -1;
+    if (!buf)
+    {
+        return NULL;
+    }
+
+    for (i = arg->from; i < arg->to; i++)
+    {
+        lock = &table->locks[i];
+        if (rwlock_read_lock(lock) != 0)
+        {
+            goto out;
+        }
+
+        need = 0;
+        for (node = table->buckets[i]; node; node = node->next)
+        {
+            need += 16 + node->key_size + node->value_size;
+        }
+        if (off + need > cap)
+        {
+            /* never write while holding the bucket lock */
+            rwlock_read_unlock(lock);
+            if (export_flush(arg, buf, off) < 0)
+            {
+                goto out;
+            }
+            off = 0;
+            if (need > cap)
+            {
+                tmp = realloc(buf, need);
+                if (!tmp)
+                {
+                    goto out;
+                }
+                buf = tmp;
+                cap = need;
+            }
+            /* the bucket may have changed meanwhile */
+            i--;
+            continue;
+        }
+
+        for (node = table->buckets[i]; node; node = node->next)
+        {
+            hdr[0] = node->key_size;
+            hdr[1] = node->flags;
+            value_size = node->value_size;
+            memcpy(buf + off, hdr, 4);
+            memcpy(buf + off + 4, &value_size, 4);
+            memcpy(buf + off + 8, &node->version, 8);
+            off += 16;
+            memcpy(buf + off, node->key, node->key_size);
+            off += node->key_size;
+            memcpy(buf + off, node->value, node->value_size);
+            off += node->value_size;
+        }
+
+        rwlock_read_unlock(lock);
+    }
+
+    if (export_flush(arg, buf, off) == 0)
+    {
+        arg->ret = 0;
+    }
+
+out:
+    free(buf);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int hash_export(hashtable_t *table, int fd, int nthreads)
+{
+    TRACE_PRINT();
+    struct export_arg *args;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    uint32_t header[2] = {0, HASH_EXPORT_FORMAT};
+    char trailer[16] = {0};
+    int i, started, ret = 0;
+
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    if (nthreads > table->hash_size)
+    {
+        nthreads = table->hash_size;
+    }
+
+    args = calloc(nthreads, sizeof(*args));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!args || !threads || pthread_mutex_init(&lock, NULL) != 0)
+    {
+        free(args);
+        free(threads);
+        return -1;
+    }
+
+    memcpy(&header[0], HASH_EXPORT_MAGIC, 4);
+    if (write_full(fd, (const char *)header, sizeof(header)) < 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+    for (started = 0; started < nthreads; started++)
+    {
+        args[started].table = table;
+        args[started].from = table->hash_size * started / nthreads;
+        args[started].to = table->hash_size * (started + 1) / nthreads;
+        args[started].fd = fd;
+        args[started].lock = &lock;
+        if (pthread_create(&threads[started], NULL,
+                           export_worker, &args[started]) != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (args[i].ret < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && write_full(fd, trailer, sizeof(trailer)) < 0)
+    {
+        ret = -1;
+    }
+
+out:
+    pthread_mutex_destroy(&lock);
+    free(args);
+    free(threads);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+char *hash_compress(const char *value, size_t value_size, size_t *out_size)
+{
+    TRACE_PRINT();
+    size_t cap = COMPRESSED_HDR + LZ_BOUND(value_size), n;
+    uint32_t raw = value_size;
+    char *buf, *tmp;
+
+    buf = malloc(cap + 1);
+    if (!buf)
+    {
+        return NULL;
+    }
+
+    n = lz_compress(value, value_size, buf + COMPRESSED_HDR,
+                    value_size - value_size / 8);
+    if (n == 0)
+    {
+        /* not worth it */
+        free(buf);
+        return NULL;
+    }
+    memcpy(buf, &raw, COMPRESSED_HDR);
+    n += COMPRESSED_HDR;
+    buf[n] = '\0';
+
+    /* give back the slack of the worst-case bound */
+    tmp = realloc(buf, n + 1);
+    *out_size = n;
+
+    return tmp ? tmp : buf;
+}
+/*---------------------------------------------------------------------------*/
+long hash_decompress(const char *value, size_t value_size,
+                     char *buf, size_t len)
+{
+    TRACE_PRINT();
+    long n;
+
+    if (value_size < COMPRESSED_HDR ||
+        compressed_raw_size(value) >= len)
+    {
+        return -1;
+    }
+
+    n = lz_decompress(value + COMPRESSED_HDR, value_size - COMPRESSED_HDR,
+                      buf, len - 1);
+    if (n != compressed_raw_size(value))
+    {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* function to dump the contents of the hash table, including locks status */
+void hash_dump(hashtable_t *table)
+{
+    TRACE_PRINT();
+    node_t *node;
+    int i;
+
+    printf("[Hash Table Dump]");
+    printf("Total Entries: %ld\n", table->total_entries);
+
+    for (i = 0; i < table->hash_size; i++)
+    {
+        if (!table->bucket_sizes[i])
+        {
+            continue;
+        }
+        printf("Bucket %d: %ld entries\n", i, table->bucket_sizes[i]);
+        printf("  Lock State -> Read Count: %d, Write Count: %d\n",
+               table->locks[i].read_count, table->locks[i].write_count);
+        node = table->buckets[i];
+        while (node)
+        {
+            if (node->flags & NODE_COMPRESSED)
+            {
+                printf("    Key:   %s\n"
+                       "    Value: (%u bytes compressed to %u)\n",
+                       node->key, compressed_raw_size(node->value),
+                       node->value_size);
+                node = node->next;
+                continue;
+            }
             printf("    Key:   %s\n"
                    "    Value: %s\n",
                    node->key, node->value);
@@ -8,27 +8,104 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "rwlock.h"
+#include "skiplist.h"
+#include "lz.h"
 #include "common.h"
 /*---------------------------------------------------------------------------*/
 #define DEFAULT_HASH_SIZE 1024
+/* hash_export() stream format: a header of HASH_EXPORT_MAGIC and
+ * HASH_EXPORT_FORMAT (4 bytes each), then one record per entry
+ * (u16 key_size, u16 flags, u32 value_size, u64 version, key, value)
+ * in host byte order, terminated by a record with key_size 0.
+ * values are written as stored, so compressed ones stay compressed. */
+#define HASH_EXPORT_MAGIC "SKVS"
+#define HASH_EXPORT_FORMAT 2
+#define HASH_EXPORT_BUF_SIZE (1 << 20)
+/* hash_init() flags */
+#define HASH_ORDERED 0x1 // maintain an ordered key index for range scans
+/* bucket lock policy (see rwlock.h), reader-preferring when neither */
+#define HASH_LOCK_WRITER 0x2 // writer-preferring
+#define HASH_LOCK_FAIR 0x4   // phase-fair
 /*---------------------------------------------------------------------------*/
+/* values shorter than this are stored inside the node itself */
+#define NODE_INLINE_VALUE 16
+/* node flags */
+#define NODE_COMPRESSED 0x1 // value is a u32 raw size followed by an LZ block
+/*---------------------------------------------------------------------------*/
+/* a node is a single allocation of NODE_SIZE bytes: the header, the
+ * null-terminated key, and an inline slot of NODE_INLINE_VALUE bytes
+ * right after it that holds short values. longer values live in a
+ * separate heap buffer. the size is fixed so that the memory of a deleted
+ * node can be kept for the next node of its bucket, and a reader that
+ * walks a bucket without its lock never touches freed memory. */
 typedef struct node_t
 {
-    char *key;
-    size_t key_size;
-    char *value;
-    size_t value_size;
     struct node_t *next;
+    char *value;         // points right after the key when stored inline
+    uint64_t version;    // bumped on every successful mutation
+    uint16_t key_size;   // keys never exceed MAX_KEY_LEN
+    uint16_t flags;      // NODE_* flags
+    uint32_t value_size; // stored size, compressed or not
+    char key[];
 } node_t;
+#define NODE_SIZE (sizeof(node_t) + MAX_KEY_LEN + 1 + NODE_INLINE_VALUE)
+/* whether the value of node is stored in its inline slot */
+#define NODE_INLINE(node) ((node)->value == (node)->key + (node)->key_size + 1)
+/* a NODE_COMPRESSED value starts with its uncompressed size */
+#define COMPRESSED_HDR 4
+static inline uint32_t
+compressed_raw_size(const char *value)
+{
+    uint32_t n;
+
+    memcpy(&n, value, sizeof(n)); // inline values may be unaligned
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* mutation hook operations */
+#define HASH_OP_SET 0    // node was created or got a new value
+#define HASH_OP_DELETE 1 // node is about to be freed
+/* called with the bucket of node write-locked after every successful
+ * mutation, so calls for the same key come in the order of the changes.
+ * it must not call back into the table. */
+typedef void (*hash_hook_fn)(void *arg, int op, const node_t *node);
+#define HASH_MAX_HOOKS 4
+/*---------------------------------------------------------------------------*/
+/* keys looked up together by hash_search_batch(), whose cache misses
+ * overlap rather than come one after another */
+#define HASH_BATCH 16
+/* called by hash_search_batch() for the i-th key with its bucket
+ * read-locked, so the value may be copied out but not kept; value is NULL
+ * when the key is not found. a negative return stops the batch. */
+typedef int (*hash_batch_fn)(void *arg, int i, const char *value,
+                             size_t value_size, int flags);
+/* keys one transaction may declare */
+#define HASH_TXN_MAX 64
+/* optimistic passes of hash_search_copy() over a bucket that keeps
+ * changing before it takes the bucket read lock instead */
+#define HASH_SEQ_RETRIES 4
+/* hash_scan() cursors hold the bucket in their low bits and, above this
+ * shift, how many keys of a bucket too large for one reply are left */
+#define HASH_SCAN_LEFT_SHIFT 40
 /*---------------------------------------------------------------------------*/
 typedef struct hashtable_t
 {
     node_t **buckets;
     rwlock_t *locks;
+    uint32_t *seqs;       // bucket sequences, odd while a writer is in
+    node_t **free_nodes;  // nodes deleted from each bucket, for reuse
     size_t *bucket_sizes; // number of entries in each bucket
-    size_t total_entries;
+    size_t total_entries; // updated atomically, under any bucket lock
     size_t hash_size;
+    int lock_policy;      // RWLOCK_POLICY of every bucket lock
+    uint64_t version_seq; // last version handed out, table-wide
+    skiplist_t *index;    // ordered key index, NULL unless HASH_ORDERED
+    hash_hook_fn hooks[HASH_MAX_HOOKS]; // mutation hooks, in call order
+    void *hook_args[HASH_MAX_HOOKS];
+    int nhooks;
 } hashtable_t;
 /*---------------------------------------------------------------------------*/
 /**
@@ -37,9 +114,10 @@ typedef struct hashtable_t
 int hash(const char *key, size_t hash_size);
 /*---------------------------------------------------------------------------*/
 /**
- * initializes a hash table
+ * initializes a hash table.
+ * flags is a bitwise OR of HASH_* flags, or 0.
  */
-hashtable_t *hash_init(size_t hash_size, int delay);
+hashtable_t *hash_init(size_t hash_size, int delay, int flags);
 /*---------------------------------------------------------------------------*/
 /**
  * destroys a hash table
@@ -54,14 +132,64 @@ int hash_destroy(hashtable_t *table);
  */
 int hash_insert(hashtable_t *table, const char *key, const char *value);
 /*---------------------------------------------------------------------------*/
+/**
+ * same as hash_insert(), but takes a heap-allocated value of value_size
+ * bytes (null-terminated at value_size) and adopts it without copying.
+ * flags is NODE_COMPRESSED for a value made by hash_compress(), or 0.
+ * the caller keeps ownership of value unless 1 is returned.
+ */
+int hash_insert_owned(hashtable_t *table, const char *key,
+                      char *value, size_t value_size, int flags);
+/*---------------------------------------------------------------------------*/
 /**
  * searches a key-value pair in the hash table,
- * and modify the given value pointer to point found value.
+ * and modify the given value pointer to point found value,
+ * value_size to its stored length, and flags to its NODE_* flags.
+ * a NODE_COMPRESSED value must be passed to hash_decompress() before use.
+ * the bucket is released on return, so another thread may change or free
+ * the value at any time: servers copy it out with hash_search_copy() or
+ * hash_search_batch() instead.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully found.
+ * returns 0 when there is no such key found.
+ */
+int hash_search(hashtable_t *table, const char *key,
+                const char **value, size_t *value_size, int *flags);
+/*---------------------------------------------------------------------------*/
+/**
+ * same as hash_search(), but copies the value as stored into buf (at most
+ * len bytes, including the null terminator), so it stays valid once the
+ * bucket is released. value_size and flags are set as by hash_search(),
+ * and also when the value does not fit.
+ * a short value stored inline is copied optimistically: without the
+ * bucket lock, then kept only if the sequence of the bucket did not move
+ * meanwhile, so the reader writes no shared memory. other values are
+ * copied under the bucket read lock, as are short ones after
+ * HASH_SEQ_RETRIES passes that collided with writers.
  * returns -1 when any internal errors occur.
  * returns 1 when successfully found.
  * returns 0 when there is no such key found.
+ * returns 2 when the value does not fit in len bytes.
+ */
+int hash_search_copy(hashtable_t *table, const char *key, char *buf,
+                     size_t len, size_t *value_size, int *flags);
+/*---------------------------------------------------------------------------*/
+/**
+ * searches n keys, calling fn for each of them in order.
+ * keys are taken HASH_BATCH at a time: all of them are hashed and their
+ * buckets prefetched first, then the first node of every bucket, and
+ * only then is each bucket locked and searched.
+ * returns -1 when any internal errors occur, or fn fails.
+ * returns the number of keys found on success.
  */
-int hash_search(hashtable_t *table, const char *key, const char **value);
+int hash_search_batch(hashtable_t *table, const char **keys, int n,
+                      hash_batch_fn fn, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * prefetches the buckets of up to HASH_BATCH keys, which are about to be
+ * searched one by one.
+ */
+void hash_prefetch(hashtable_t *table, const char **keys, int n);
 /*---------------------------------------------------------------------------*/
 /**
  * updates a key-value pair in the hash table.
@@ -71,6 +199,14 @@ int hash_search(hashtable_t *table, const char *key, const char **value);
  */
 int hash_update(hashtable_t *table, const char *key, const char *value);
 /*---------------------------------------------------------------------------*/
+/**
+ * same as hash_update(), but adopts a heap-allocated value like
+ * hash_insert_owned() does.
+ * the caller keeps ownership of value unless 1 is returned.
+ */
+int hash_update_owned(hashtable_t *table, const char *key,
+                      char *value, size_t value_size, int flags);
+/*---------------------------------------------------------------------------*/
 /**
  * deletes a key-value pair from the hash table.
  * returns -1 when any internal errors occur.
@@ -79,6 +215,161 @@ int hash_update(hashtable_t *table, const char *key, const char *value);
  */
 int hash_delete(hashtable_t *table, const char *key);
 /*---------------------------------------------------------------------------*/
+/**
+ * stores a key-value pair as given, creating or replacing it, with the
+ * value adopted like hash_insert_owned() does and version kept as is.
+ * used to load entries exported or replicated from another table.
+ * the caller keeps ownership of value unless 1 is returned.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully stored.
+ */
+int hash_restore_owned(hashtable_t *table, const char *key, char *value,
+                       size_t value_size, int flags, uint64_t version);
+/*---------------------------------------------------------------------------*/
+/**
+ * deletes all key-value pairs, one bucket at a time, reporting each
+ * to the mutation hooks as a deletion.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int hash_clear(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * adds a mutation hook to the table, called after those added before.
+ * must be called before the table is shared between threads.
+ * returns -1 when HASH_MAX_HOOKS hooks are already set.
+ * returns 0 on success.
+ */
+int hash_add_hook(hashtable_t *table, hash_hook_fn fn, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * removes the mutation hook added with fn and arg, if any.
+ * must be called when no other thread uses the table.
+ */
+void hash_remove_hook(hashtable_t *table, hash_hook_fn fn, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * sums the wait statistics of the bucket locks into stats.
+ */
+void hash_lock_stats(hashtable_t *table, struct rwlock_stats *stats);
+/*---------------------------------------------------------------------------*/
+/**
+ * copies the value of a key-value pair into buf (at most len bytes,
+ * including the null terminator) and its version into the given pointer,
+ * both from the same state of the bucket, optimistically for short values
+ * like hash_search_copy() does.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully found.
+ * returns 0 when there is no such key found.
+ * returns 2 when the value does not fit in len bytes.
+ */
+int hash_gets(hashtable_t *table, const char *key,
+              char *buf, size_t len, uint64_t *version);
+/*---------------------------------------------------------------------------*/
+/**
+ * updates a key-value pair only if its current version equals version.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully updated.
+ * returns 0 when there is no such key found.
+ * returns 2 when the version does not match.
+ */
+int hash_cas(hashtable_t *table, const char *key,
+             const char *value, uint64_t version);
+/*---------------------------------------------------------------------------*/
+/**
+ * adds delta to a value holding a decimal integer,
+ * and stores the new integer to the given pointer.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully updated.
+ * returns 0 when there is no such key found.
+ * returns 2 when the value is not an integer, or the result overflows.
+ */
+int hash_incr(hashtable_t *table, const char *key,
+              long long delta, long long *result);
+/*---------------------------------------------------------------------------*/
+/**
+ * appends value to the end of an existing value.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully appended.
+ * returns 0 when there is no such key found.
+ * returns 2 when the resulting value would exceed max_len bytes.
+ */
+int hash_append(hashtable_t *table, const char *key,
+                const char *value, size_t max_len);
+/*---------------------------------------------------------------------------*/
+/**
+ * opens a transaction of this thread over n keys (at most HASH_TXN_MAX,
+ * repeats allowed): write-locks their buckets in ascending order, and
+ * keeps them locked until hash_txn_end(). meanwhile the point operations
+ * of this thread (insert, search, update, delete, gets, cas, incr and
+ * append) run under those locks, so no other thread sees any of them
+ * before all are done; one on a key that was not declared fails with -1.
+ * nothing is rolled back, an operation that fails leaves the others be.
+ * returns -1 when any internal errors occur, or a transaction is open.
+ * returns 0 on success.
+ */
+int hash_txn_begin(hashtable_t *table, const char **keys, int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * releases the buckets of the transaction of this thread.
+ */
+void hash_txn_end(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * calls fn for every key not less than start (from the smallest key when
+ * start is NULL) in ascending order, until fn returns nonzero.
+ * the scan takes no locks, so neither point operations nor inserts and
+ * deletes wait for it.
+ * returns -1 when the table has no ordered index.
+ * returns the nonzero value returned by fn, or 0 when all keys are visited.
+ */
+int hash_range(hashtable_t *table, const char *start,
+               skiplist_fn fn, void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * copies keys into buf as " key1 key2 ...", one whole bucket at a time,
+ * starting from the bucket at *cursor (0 starts a new scan).
+ * buckets are visited in reverse-binary order of their index, so a cursor
+ * stays valid if the number of buckets changes between calls.
+ * stops once count keys are copied, 10 * count buckets are visited,
+ * or the next bucket does not fit in len bytes. a bucket that does not fit
+ * even on its own is split, and the cursor resumes inside it.
+ * each bucket is read-locked only while its keys are copied.
+ * sets *cursor to where the scan continues, or 0 when it is complete.
+ * returns -1 when any internal errors occur.
+ * returns the number of bytes written to buf (null-terminated) on success.
+ */
+ssize_t hash_scan(hashtable_t *table, size_t *cursor, size_t count,
+                  char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes all entries to fd in the hash_export() stream format.
+ * the bucket range is split across nthreads threads, each serializing
+ * into its own large buffer and writing it out as a whole.
+ * buckets are read-locked one at a time and never across a write,
+ * so the table keeps serving requests during the export.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int hash_export(hashtable_t *table, int fd, int nthreads);
+/*---------------------------------------------------------------------------*/
+/**
+ * compresses value_size bytes of value into a new heap buffer suitable
+ * for the *_owned() functions with NODE_COMPRESSED.
+ * returns NULL when allocation fails, or when compression would not save
+ * at least an eighth of the size (the value is better stored as is).
+ */
+char *hash_compress(const char *value, size_t value_size, size_t *out_size);
+/*---------------------------------------------------------------------------*/
+/**
+ * decompresses a NODE_COMPRESSED value of value_size bytes into buf
+ * (at most len bytes, including the null terminator).
+ * returns -1 when the value is malformed or does not fit in len bytes.
+ * returns the uncompressed size on success.
+ */
+long hash_decompress(const char *value, size_t value_size,
+                     char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
 /**
  * dump the hash table
  */
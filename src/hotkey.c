@@ -0,0 +1,311 @@
+/*---------------------------------------------------------------------------*/
+/* hotkey.c                                                                  */
+/*---------------------------------------------------------------------------*/
+#include "hotkey.h"
+/*---------------------------------------------------------------------------*/
+#define HOT_HITS_BATCH 64 // cache hits a thread counts before adding them up
+/*---------------------------------------------------------------------------*/
+/* a cached copy of a value */
+struct hot_entry
+{
+    char key[MAX_KEY_LEN + 1];
+    char *value; // HOT_CACHE_VALUE_MAX + 1 bytes, NULL when unused
+    size_t size;
+    uint64_t hash;
+    uint64_t gen; // counter of the slot before the value was read
+};
+/*---------------------------------------------------------------------------*/
+static __thread struct hot_entry *t_cache; // HOT_CACHE_SIZE entries
+static __thread uint32_t t_tick;           // reads, for sampling
+static __thread uint32_t t_hits;           // hits not added up yet
+static __thread struct hotkeys *t_owner;   // where t_hits belong
+/*---------------------------------------------------------------------------*/
+/* 64-bit FNV-1a */
+static inline uint64_t
+key_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+static inline uint64_t *
+gen_of(struct hotkeys *h, uint64_t hash)
+{
+    return &h->gens[(hash >> 32) % HOT_GEN_SLOTS];
+}
+/*---------------------------------------------------------------------------*/
+/* the mutation hook, invalidates cached copies of the changed key */
+static void
+hot_invalidate(void *arg, int op, const node_t *node)
+{
+    struct hotkeys *h = arg;
+
+    if (h->cache)
+    {
+        __atomic_add_fetch(gen_of(h, key_hash(node->key)), 1,
+                           __ATOMIC_RELEASE);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* smallest count of a full top list; caller holds h->lock */
+static void
+update_floor(struct hotkeys *h)
+{
+    uint32_t floor = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < h->ntop; i++)
+    {
+        if (h->top[i].count < floor)
+        {
+            floor = h->top[i].count;
+        }
+    }
+    __atomic_store_n(&h->floor, h->ntop < HOT_TOP_K ? 0 : floor,
+                     __ATOMIC_RELAXED);
+}
+/*---------------------------------------------------------------------------*/
+/* halves every count, so that old reads fade out */
+static void
+decay(struct hotkeys *h)
+{
+    uint32_t *c;
+    int i;
+
+    pthread_mutex_lock(&h->lock);
+    for (c = &h->sketch[0][0];
+         c < &h->sketch[0][0] + HOT_SKETCH_DEPTH * HOT_SKETCH_WIDTH; c++)
+    {
+        /* a concurrent increment may be lost, which is fine for a sketch */
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) / 2,
+                         __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < h->ntop; i++)
+    {
+        h->top[i].count /= 2;
+    }
+    update_floor(h);
+    pthread_mutex_unlock(&h->lock);
+}
+/*---------------------------------------------------------------------------*/
+/* counts a sampled read of key.
+ * returns 1 when key is in the top list, 0 otherwise. */
+static int
+count(struct hotkeys *h, const char *key, uint64_t hash)
+{
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1, est = UINT32_MAX, c;
+    int i, min = 0, hot = 0;
+
+    for (i = 0; i < HOT_SKETCH_DEPTH; i++)
+    {
+        c = __atomic_add_fetch(&h->sketch[i][(h1 + i * h2) % HOT_SKETCH_WIDTH],
+                               1, __ATOMIC_RELAXED);
+        est = c < est ? c : est;
+    }
+    if (__atomic_add_fetch(&h->samples, 1, __ATOMIC_RELAXED) % HOT_DECAY == 0)
+    {
+        decay(h);
+    }
+    if (est <= __atomic_load_n(&h->floor, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    /* space-saving: the key takes the place of the coldest one */
+    pthread_mutex_lock(&h->lock);
+    for (i = 0; i < h->ntop; i++)
+    {
+        if (strcmp(h->top[i].key, key) == 0)
+        {
+            break;
+        }
+        if (h->top[i].count < h->top[min].count)
+        {
+            min = i;
+        }
+    }
+    if (i == h->ntop && h->ntop < HOT_TOP_K)
+    {
+        h->ntop++;
+    }
+    else if (i == h->ntop)
+    {
+        i = est > h->top[min].count ? min : -1;
+    }
+    if (i >= 0)
+    {
+        strncpy(h->top[i].key, key, MAX_KEY_LEN);
+        h->top[i].key[MAX_KEY_LEN] = '\0';
+        h->top[i].count = est;
+        update_floor(h);
+        hot = 1;
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    return hot;
+}
+/*---------------------------------------------------------------------------*/
+struct hotkeys *hot_init(hashtable_t *table)
+{
+    TRACE_PRINT();
+    struct hotkeys *h = calloc(1, sizeof(struct hotkeys));
+
+    if (h == NULL)
+    {
+        return NULL;
+    }
+    h->table = table;
+    if (pthread_mutex_init(&h->lock, NULL) != 0)
+    {
+        free(h);
+        return NULL;
+    }
+    if (hash_add_hook(table, hot_invalidate, h) < 0)
+    {
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+        return NULL;
+    }
+
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+void hot_destroy(struct hotkeys *h)
+{
+    TRACE_PRINT();
+    hash_remove_hook(h->table, hot_invalidate, h);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+/*---------------------------------------------------------------------------*/
+int hot_lookup(struct hotkeys *h, const char *key, struct hot_ticket *t,
+               const char **value, size_t *size)
+{
+    struct hot_entry *e;
+
+    t->hash = key_hash(key);
+    t->hot = ++t_tick % HOT_SAMPLE == 0 && count(h, key, t->hash);
+    if (!h->cache)
+    {
+        return 0;
+    }
+
+    t->gen = __atomic_load_n(gen_of(h, t->hash), __ATOMIC_ACQUIRE);
+    e = t_cache ? &t_cache[t->hash % HOT_CACHE_SIZE] : NULL;
+    if (e == NULL || e->value == NULL || e->hash != t->hash ||
+        e->gen != t->gen || strcmp(e->key, key) != 0)
+    {
+        return 0;
+    }
+
+    *value = e->value;
+    *size = e->size;
+    t_owner = h;
+    if (++t_hits == HOT_HITS_BATCH)
+    {
+        __atomic_add_fetch(&h->hits, t_hits, __ATOMIC_RELAXED);
+        t_hits = 0;
+    }
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+void hot_fill(struct hotkeys *h, const struct hot_ticket *t,
+              const char *key, const char *value, size_t size)
+{
+    struct hot_entry *e;
+
+    if (!h->cache || !t->hot || size > HOT_CACHE_VALUE_MAX)
+    {
+        return;
+    }
+    if (t_cache == NULL)
+    {
+        t_cache = calloc(HOT_CACHE_SIZE, sizeof(struct hot_entry));
+        if (t_cache == NULL)
+        {
+            return;
+        }
+    }
+
+    e = &t_cache[t->hash % HOT_CACHE_SIZE];
+    if (e->value == NULL)
+    {
+        e->value = malloc(HOT_CACHE_VALUE_MAX + 1);
+        if (e->value == NULL)
+        {
+            return;
+        }
+    }
+    strcpy(e->key, key);
+    memcpy(e->value, value, size);
+    e->value[size] = '\0';
+    e->size = size;
+    e->hash = t->hash;
+    e->gen = t->gen;
+}
+/*---------------------------------------------------------------------------*/
+static int
+by_count(const void *a, const void *b)
+{
+    const struct hot_key *x = a, *y = b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+/*---------------------------------------------------------------------------*/
+int hot_stats(struct hotkeys *h, char *buf, size_t len)
+{
+    struct hot_key top[HOT_TOP_K];
+    size_t n = 0;
+    int i, ntop;
+
+    pthread_mutex_lock(&h->lock);
+    ntop = h->ntop;
+    memcpy(top, h->top, sizeof(top));
+    pthread_mutex_unlock(&h->lock);
+    qsort(top, ntop, sizeof(struct hot_key), by_count);
+
+    n += snprintf(buf + n, len - n, " hot=");
+    for (i = 0; i < ntop && i < HOT_REPORT && n < len; i++)
+    {
+        n += snprintf(buf + n, len - n, "%s%s:%" PRIu64, i ? "," : "",
+                      top[i].key, (uint64_t)top[i].count * HOT_SAMPLE);
+    }
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n, "%s hot_hits=%" PRIu64,
+                      ntop ? "" : "-",
+                      __atomic_load_n(&h->hits, __ATOMIC_RELAXED));
+    }
+
+    return n < len ? n : len - 1;
+}
+/*---------------------------------------------------------------------------*/
+void hot_thread_exit(void)
+{
+    int i;
+
+    if (t_owner)
+    {
+        __atomic_add_fetch(&t_owner->hits, t_hits, __ATOMIC_RELAXED);
+        t_owner = NULL;
+        t_hits = 0;
+    }
+    if (t_cache)
+    {
+        for (i = 0; i < HOT_CACHE_SIZE; i++)
+        {
+            free(t_cache[i].value);
+        }
+        free(t_cache);
+        t_cache = NULL;
+    }
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,109 @@
+/*---------------------------------------------------------------------------*/
+/* hotkey.h                                                                  */
+/*---------------------------------------------------------------------------*/
+#ifndef _HOTKEY_H
+#define _HOTKEY_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "hashtable.h"
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* READ frequencies are estimated with a Count-Min sketch fed by a sample of
+ * the reads, and the most frequent keys are kept in a space-saving top-K
+ * list. counts are halved every HOT_DECAY samples, so the list follows the
+ * workload as it shifts.
+ *
+ * when caching is on, each thread also keeps copies of hot values it read.
+ * a copy is served without touching the bucket lock for as long as the
+ * invalidation counter of its slot is unchanged. the mutation hook bumps
+ * the counter of the key's slot under the bucket write lock, and a copy
+ * takes the counter value from before the table was read, so a copy never
+ * outlives a later change of its key. */
+#define HOT_TOP_K 16             // keys in the top list
+#define HOT_REPORT 8             // keys STATS shows
+#define HOT_SKETCH_DEPTH 4
+#define HOT_SKETCH_WIDTH 4096    // counters per sketch row
+#define HOT_SAMPLE 16            // one read in HOT_SAMPLE is counted
+#define HOT_DECAY (1 << 16)      // samples between halvings
+#define HOT_GEN_SLOTS 4096       // invalidation counters
+#define HOT_CACHE_SIZE 64        // cached values per thread
+#define HOT_CACHE_VALUE_MAX 1024 // largest value cached
+/*---------------------------------------------------------------------------*/
+struct hot_key
+{
+    char key[MAX_KEY_LEN + 1];
+    uint32_t count; // sampled reads, as estimated by the sketch
+};
+/*---------------------------------------------------------------------------*/
+struct hotkeys
+{
+    hashtable_t *table;
+    int cache; // per-thread read caches, set before serving starts
+
+    uint32_t sketch[HOT_SKETCH_DEPTH][HOT_SKETCH_WIDTH];
+    uint64_t samples;
+
+    pthread_mutex_t lock; // protects top
+    struct hot_key top[HOT_TOP_K];
+    int ntop;
+    uint32_t floor; // smallest count in a full top list, 0 otherwise
+
+    uint64_t gens[HOT_GEN_SLOTS];
+    uint64_t hits; // cache hits, added up from threads in batches
+};
+/*---------------------------------------------------------------------------*/
+/* what hot_lookup() learned about a key, for hot_fill() */
+struct hot_ticket
+{
+    uint64_t hash;
+    uint64_t gen;
+    int hot;
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * initializes hot-key tracking of table, and hooks it to the table so
+ * that cached values are invalidated.
+ * returns NULL when any internal errors occur.
+ */
+struct hotkeys *hot_init(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * unhooks and frees the state. caches of threads still alive are freed
+ * by hot_thread_exit().
+ */
+void hot_destroy(struct hotkeys *h);
+/*---------------------------------------------------------------------------*/
+/**
+ * counts a read of key, and looks it up in the calling thread's cache.
+ * on a miss, t is filled for hot_fill().
+ * returns 1 with the cached value in value and size on a hit.
+ * returns 0 otherwise.
+ */
+int hot_lookup(struct hotkeys *h, const char *key, struct hot_ticket *t,
+               const char **value, size_t *size);
+/*---------------------------------------------------------------------------*/
+/**
+ * caches a copy of the value of key that was read from the table after
+ * hot_lookup() filled t, when key is hot and the value is small enough.
+ */
+void hot_fill(struct hotkeys *h, const struct hot_ticket *t,
+              const char *key, const char *value, size_t size);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes the hottest keys as " hot=key:reads,..." and the cache hits as
+ * " hot_hits=n" into buf, where reads is an estimate of recent reads.
+ * returns the number of bytes written (null-terminated).
+ */
+int hot_stats(struct hotkeys *h, char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * frees the calling thread's cache.
+ */
+void hot_thread_exit(void);
+/*---------------------------------------------------------------------------*/
+#endif // _HOTKEY_H
@@ -0,0 +1,222 @@
+/*---------------------------------------------------------------------------*/
+/* lz.c                                                                      */
+/*---------------------------------------------------------------------------*/
+#include "lz.h"
+/*---------------------------------------------------------------------------*/
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the block always ends with this many literals
+#define LZ_MF_LIMIT 12     // no match may start within this many of the end
+/*---------------------------------------------------------------------------*/
+static inline uint32_t
+read32(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+/*---------------------------------------------------------------------------*/
+static inline uint32_t
+hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+/*---------------------------------------------------------------------------*/
+/* writes a length continuation (runs of 255 and a remainder) */
+static inline int
+put_len(char **op, char *end, size_t len)
+{
+    while (len >= 255)
+    {
+        if (*op >= end)
+        {
+            return -1;
+        }
+        *(*op)++ = (char)255;
+        len -= 255;
+    }
+    if (*op >= end)
+    {
+        return -1;
+    }
+    *(*op)++ = (char)len;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* emits literals [lit, lit + lit_len) followed by a match, or by nothing
+ * when match_len is 0 (the last sequence) */
+static inline int
+put_sequence(char **op, char *end, const char *lit, size_t lit_len,
+             size_t offset, size_t match_len)
+{
+    char *token = *op;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if (*op >= end)
+    {
+        return -1;
+    }
+    (*op)++;
+    *token = (char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if (lit_len >= 15 && put_len(op, end, lit_len - 15) < 0)
+    {
+        return -1;
+    }
+    if (end - *op < lit_len)
+    {
+        return -1;
+    }
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+
+    if (match_len == 0)
+    {
+        return 0;
+    }
+    if (end - *op < 2)
+    {
+        return -1;
+    }
+    *(*op)++ = (char)(offset & 0xff);
+    *(*op)++ = (char)(offset >> 8);
+    if (ml >= 15 && put_len(op, end, ml - 15) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const char *ip = src, *anchor = src, *ref;
+    const char *mf_limit = src + n - LZ_MF_LIMIT;
+    const char *match_limit = src + n - LZ_LAST_LITERALS;
+    char *op = dst, *end = dst + cap;
+    size_t len;
+    uint32_t h;
+
+    if (n >= LZ_MF_LIMIT + 1)
+    {
+        memset(table, 0, sizeof(table));
+        while (ip < mf_limit)
+        {
+            h = hash32(read32(ip));
+            ref = src + table[h];
+            table[h] = ip - src;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+                read32(ref) != read32(ip))
+            {
+                ip++;
+                continue;
+            }
+
+            len = LZ_MIN_MATCH;
+            while (ip + len < match_limit && ref[len] == ip[len])
+            {
+                len++;
+            }
+            if (put_sequence(&op, end, anchor, ip - anchor,
+                             ip - ref, len) < 0)
+            {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    if (put_sequence(&op, end, anchor, src + n - anchor, 0, 0) < 0)
+    {
+        return 0;
+    }
+
+    return op - dst;
+}
+/*---------------------------------------------------------------------------*/
+/* reads a length continuation */
+static inline int
+get_len(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*ip >= end)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+long lz_decompress(const char *src, size_t n, char *dst, size_t cap)
+{
+    const unsigned char *ip = (const unsigned char *)src, *end = ip + n;
+    char *op = dst, *out_end = dst + cap;
+    size_t lit, ml, offset;
+    unsigned char token;
+
+    while (ip < end)
+    {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15 && get_len(&ip, end, &lit) < 0)
+        {
+            return -1;
+        }
+        if (end - ip < lit || out_end - op < lit)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == end)
+        {
+            /* the last sequence has literals only */
+            break;
+        }
+
+        if (end - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+        {
+            return -1;
+        }
+
+        ml = token & 15;
+        if (ml == 15 && get_len(&ip, end, &ml) < 0)
+        {
+            return -1;
+        }
+        ml += LZ_MIN_MATCH;
+        if (out_end - op < ml)
+        {
+            return -1;
+        }
+        /* byte by byte, the match may overlap its own output */
+        for (; ml > 0; ml--, op++)
+        {
+            *op = op[-offset];
+        }
+    }
+
+    return op - dst;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,31 @@
+/*---------------------------------------------------------------------------*/
+/* lz.h                                                                      */
+/*---------------------------------------------------------------------------*/
+#ifndef _LZ_H
+#define _LZ_H
+/*---------------------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+/*---------------------------------------------------------------------------*/
+/* a fast LZ77 codec producing LZ4 block format (no frame, no checksum) */
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the largest compressed size of n input bytes.
+ */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+/*---------------------------------------------------------------------------*/
+/**
+ * compresses n bytes of src into dst of cap bytes.
+ * returns the compressed size, or 0 when it does not fit in cap.
+ */
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+/*---------------------------------------------------------------------------*/
+/**
+ * decompresses n bytes of src into dst of cap bytes.
+ * returns the decompressed size, or -1 when src is malformed or
+ * the output does not fit in cap.
+ */
+long lz_decompress(const char *src, size_t n, char *dst, size_t cap);
+/*---------------------------------------------------------------------------*/
+#endif // _LZ_H
@@ -0,0 +1,440 @@
+/*---------------------------------------------------------------------------*/
+/* pool.c                                                                    */
+/*---------------------------------------------------------------------------*/
+#include "pool.h"
+/*---------------------------------------------------------------------------*/
+/* the slot of the calling worker, NULL outside the pool or once detached */
+static __thread struct pool_deque *t_deque;
+/*---------------------------------------------------------------------------*/
+/* appends task to d.
+ * returns -1 when d has no worker, or it cannot grow. */
+static int
+deque_push(struct pool_deque *d, void *task)
+{
+    void **tasks;
+    int i;
+
+    pthread_mutex_lock(&d->lock);
+    if (!d->live)
+    {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    if (d->len == d->cap)
+    {
+        tasks = malloc(sizeof(void *) * d->cap * 2);
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+        for (i = 0; i < d->len; i++)
+        {
+            tasks[i] = d->tasks[(d->head + i) % d->cap];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap *= 2;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->len) % d->cap] = task;
+    d->len++;
+    pthread_mutex_unlock(&d->lock);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* takes the oldest task of d, or returns NULL when it has none */
+static void *
+deque_pop(struct pool_deque *d)
+{
+    void *task = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->len > 0)
+    {
+        task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->cap;
+        d->len--;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return task;
+}
+/*---------------------------------------------------------------------------*/
+/* takes the oldest task of the first other slot that has one */
+static void *
+pool_steal(struct pool *pool, int self)
+{
+    void *task;
+    int i;
+
+    for (i = 1; i < pool->max; i++)
+    {
+        task = deque_pop(&pool->deques[(self + i) % pool->max]);
+        if (task)
+        {
+            __atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static int pool_spawn(struct pool *pool);
+/*---------------------------------------------------------------------------*/
+/* gives up the slot d, handing its tasks to the other workers, and starts
+ * another worker when the pool falls below min; called by its worker,
+ * without the pool lock */
+static void
+pool_leave(struct pool *pool, struct pool_deque *d)
+{
+    void *task;
+
+    pthread_mutex_lock(&d->lock);
+    d->live = 0;
+    pthread_mutex_unlock(&d->lock);
+    t_deque = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    if (pool->live < pool->min && !pool->closing && pool_spawn(pool) == 0)
+    {
+        pool->spawned++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while ((task = deque_pop(d)) != NULL)
+    {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        if (pool_submit(pool, task, -1) < 0)
+        {
+            /* nobody left to take it, so run it here */
+            pool->run(pool->arg, task);
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* returns 1 when d, a slot the pool lock holder may retire, has no task,
+ * and marks it without a worker, 0 otherwise */
+static int
+deque_retire(struct pool_deque *d)
+{
+    int empty;
+
+    pthread_mutex_lock(&d->lock);
+    empty = d->len == 0;
+    if (empty)
+    {
+        d->live = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return empty;
+}
+/*---------------------------------------------------------------------------*/
+static void *
+pool_worker(void *arg)
+{
+    struct pool_deque *d = arg;
+    struct pool *pool = d->pool;
+    struct timespec ts;
+    void *task;
+    int idx = d->idx, ret;
+
+    t_deque = d;
+    if (pool->thread)
+    {
+        pool->thread(pool->arg, idx, 1);
+    }
+
+    while (t_deque)
+    {
+        task = deque_pop(d);
+        if (!task && __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) > 0)
+        {
+            task = pool_steal(pool, idx);
+        }
+        if (task)
+        {
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            pool->run(pool->arg, task);
+            continue;
+        }
+
+        /* nothing anywhere: wait for a task, or retire when idle for long.
+         * pending and idle are checked crosswise with pool_submit(), so
+         * either it sees this worker idle or this worker sees its task */
+        pthread_mutex_lock(&pool->lock);
+        if (pool->closing &&
+            __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        ret = 0;
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 &&
+            !pool->closing)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += POOL_IDLE_MS / 1000;
+            ts.tv_nsec += (POOL_IDLE_MS % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            ret = pthread_cond_timedwait(&pool->work, &pool->lock, &ts);
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        if (ret == ETIMEDOUT && !pool->closing && pool->live > pool->min &&
+            deque_retire(d))
+        {
+            __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+            pool->retired++;
+            t_deque = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (t_deque)
+    {
+        /* the pool closes */
+        pthread_mutex_lock(&d->lock);
+        d->live = 0;
+        pthread_mutex_unlock(&d->lock);
+        pthread_mutex_lock(&pool->lock);
+        __atomic_sub_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->lock);
+        t_deque = NULL;
+    }
+    if (pool->thread)
+    {
+        pool->thread(pool->arg, idx, 0);
+    }
+
+    /* the pool may be freed as soon as the lock goes */
+    pthread_mutex_lock(&pool->lock);
+    pool->threads--;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* starts a worker on a free slot; caller holds the pool lock.
+ * returns -1 when there is no free slot, or the thread cannot start. */
+static int
+pool_spawn(struct pool *pool)
+{
+    struct pool_deque *d = NULL;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i, ret;
+
+    for (i = 0; i < pool->max && !d; i++)
+    {
+        pthread_mutex_lock(&pool->deques[i].lock);
+        if (!pool->deques[i].live)
+        {
+            d = &pool->deques[i];
+            d->live = 1;
+        }
+        pthread_mutex_unlock(&pool->deques[i].lock);
+    }
+    if (d == NULL)
+    {
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, pool_worker, d);
+    pthread_attr_destroy(&attr);
+    if (ret != 0)
+    {
+        pthread_mutex_lock(&d->lock);
+        d->live = 0;
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    __atomic_add_fetch(&pool->live, 1, __ATOMIC_RELAXED);
+    pool->threads++;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+struct pool *pool_init(int min, int max, pool_fn run, pool_thread_fn thread,
+                       void *arg)
+{
+    TRACE_PRINT();
+    struct pool *pool;
+    int i;
+
+    if (min < 1)
+    {
+        min = 1;
+    }
+    if (max < min)
+    {
+        max = min;
+    }
+
+    pool = calloc(1, sizeof(struct pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->deques = calloc(max, sizeof(struct pool_deque));
+    if (pool->deques == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->min = min;
+    pool->max = max;
+    pool->run = run;
+    pool->thread = thread;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 0; i < max; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].idx = i;
+        pool->deques[i].pool = pool;
+        pool->deques[i].cap = POOL_DEQUE_INIT;
+        pool->deques[i].tasks = malloc(sizeof(void *) * POOL_DEQUE_INIT);
+        if (pool->deques[i].tasks == NULL)
+        {
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < min; i++)
+    {
+        if (pool_spawn(pool) < 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (i < min)
+    {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+/*---------------------------------------------------------------------------*/
+void pool_destroy(struct pool *pool)
+{
+    TRACE_PRINT();
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->threads > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->max; i++)
+    {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool);
+}
+/*---------------------------------------------------------------------------*/
+int pool_submit(struct pool *pool, void *task, int idx)
+{
+    int i, start;
+
+    if (idx < 0 || idx >= pool->max)
+    {
+        idx = t_deque ? t_deque->idx
+                      : (int)(__atomic_fetch_add(&pool->next, 1,
+                                                 __ATOMIC_RELAXED) %
+                              pool->max);
+    }
+
+    /* the slot asked for, or the next one with a worker */
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    for (i = 0, start = idx; i < pool->max; i++)
+    {
+        if (deque_push(&pool->deques[(start + i) % pool->max], task) == 0)
+        {
+            break;
+        }
+    }
+    if (i == pool->max)
+    {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    else if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) >
+             __atomic_load_n(&pool->live, __ATOMIC_RELAXED))
+    {
+        /* more waiting than there are workers to take it */
+        pthread_mutex_lock(&pool->lock);
+        if (pool->live < pool->max && !pool->closing &&
+            pool_spawn(pool) == 0)
+        {
+            pool->spawned++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int pool_self(void)
+{
+    return t_deque ? t_deque->idx : -1;
+}
+/*---------------------------------------------------------------------------*/
+void pool_detach(struct pool *pool)
+{
+    if (t_deque)
+    {
+        pool_leave(pool, t_deque);
+    }
+}
+/*---------------------------------------------------------------------------*/
+int pool_stats(struct pool *pool, char *buf, size_t len)
+{
+    int n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = snprintf(buf, len,
+                 " workers=%d/%d idle_workers=%d steals=%" PRIu64
+                 " spawned=%" PRIu64 " retired=%" PRIu64,
+                 pool->live, pool->max,
+                 __atomic_load_n(&pool->idle, __ATOMIC_RELAXED),
+                 __atomic_load_n(&pool->steals, __ATOMIC_RELAXED),
+                 pool->spawned, pool->retired);
+    pthread_mutex_unlock(&pool->lock);
+
+    return n < len ? n : len - 1;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,108 @@
+/*---------------------------------------------------------------------------*/
+/* pool.h                                                                    */
+/*---------------------------------------------------------------------------*/
+#ifndef _POOL_H
+#define _POOL_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* a pool of worker threads running tasks, with a deque of tasks per
+ * worker. a task goes to the deque of the worker it is meant for, a
+ * worker runs the tasks of its own deque oldest first, and one with
+ * none left steals the oldest task of another, so that an uneven load
+ * spreads over the idle workers.
+ *
+ * the pool keeps at least min workers. it adds one, up to max, when more
+ * tasks wait than there are workers, and a worker beyond min that found
+ * nothing to do for POOL_IDLE_MS retires. */
+#define POOL_IDLE_MS 2000
+#define POOL_DEQUE_INIT 16 // tasks a deque holds before it grows
+/*---------------------------------------------------------------------------*/
+/* runs a task on a worker thread */
+typedef void (*pool_fn)(void *arg, void *task);
+/* called on a worker thread as it starts (start is 1), and as it exits
+ * (start is 0); idx is its slot, which a later worker may take again */
+typedef void (*pool_thread_fn)(void *arg, int idx, int start);
+/*---------------------------------------------------------------------------*/
+struct pool;
+struct pool_deque
+{
+    pthread_mutex_t lock;
+    void **tasks; // ring of cap tasks, len of them from head
+    int cap, head, len;
+    int live;     // a worker owns this slot
+    int idx;
+    struct pool *pool;
+};
+/*---------------------------------------------------------------------------*/
+struct pool
+{
+    pthread_mutex_t lock; // guards live, threads, closing, and the waits
+    pthread_cond_t work;  // a task was submitted, or the pool closes
+    pthread_cond_t done;  // a thread exited
+    struct pool_deque *deques; // max slots
+    int min, max;
+    int live;         // workers on a slot
+    int threads;      // threads running, detached ones included
+    int idle;         // workers waiting for a task
+    int pending;      // tasks submitted and not taken yet
+    int closing;
+    unsigned int next; // slot the next task from outside goes to
+    uint64_t steals;   // tasks run by a worker other than their own
+    uint64_t spawned;  // workers started beyond the first min
+    uint64_t retired;  // workers retired for being idle
+    pool_fn run;
+    pool_thread_fn thread;
+    void *arg;
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * starts a pool of min workers (at least 1) that may grow to max,
+ * running tasks with run(arg, task).
+ * thread may be NULL.
+ * returns NULL when any internal errors occur.
+ */
+struct pool *pool_init(int min, int max, pool_fn run, pool_thread_fn thread,
+                       void *arg);
+/*---------------------------------------------------------------------------*/
+/**
+ * runs the tasks still queued, waits for every worker to exit, and frees
+ * the pool. no task may be submitted from outside the pool meanwhile.
+ */
+void pool_destroy(struct pool *pool);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues task for the worker on slot idx, or when idx is -1 or that slot
+ * has no worker, for the calling worker or else the next worker in turn.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int pool_submit(struct pool *pool, void *task, int idx);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the slot of the calling worker, or -1 when it is not one.
+ */
+int pool_self(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * takes the calling worker out of the pool for good, before it blocks for
+ * long in its task: its queued tasks go to the others, and another worker
+ * may take its place. the thread exits once the task returns.
+ */
+void pool_detach(struct pool *pool);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes pool status as " key=value" pairs into buf.
+ * returns the number of bytes written (null-terminated).
+ */
+int pool_stats(struct pool *pool, char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
+#endif // _POOL_H
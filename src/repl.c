@@ -0,0 +1,540 @@
+/*---------------------------------------------------------------------------*/
+/* repl.c                                                                    */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "repl.h"
+/*---------------------------------------------------------------------------*/
+#define REPL_READ_BUF (64 << 10)
+#define REPL_TIMEOUT_MS 5000 // silence after which the link is dropped
+/*---------------------------------------------------------------------------*/
+/* buffered reader of the replication stream */
+struct repl_reader
+{
+    struct repl *r;
+    int fd;
+    size_t pos, len;
+    char buf[REPL_READ_BUF];
+};
+/*---------------------------------------------------------------------------*/
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*---------------------------------------------------------------------------*/
+static int
+write_full(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* appends n bytes to the log ring; caller holds r->lock */
+static void
+ring_put(struct repl *r, const void *src, size_t n)
+{
+    size_t off = r->head % REPL_LOG_SIZE;
+    size_t first = n < REPL_LOG_SIZE - off ? n : REPL_LOG_SIZE - off;
+
+    memcpy(r->ring + off, src, first);
+    memcpy(r->ring, (const char *)src + first, n - first);
+    r->head += n;
+}
+/*---------------------------------------------------------------------------*/
+/* copies n log bytes starting at pos; caller holds r->lock */
+static void
+ring_get(struct repl *r, uint64_t pos, char *dst, size_t n)
+{
+    size_t off = pos % REPL_LOG_SIZE;
+    size_t first = n < REPL_LOG_SIZE - off ? n : REPL_LOG_SIZE - off;
+
+    memcpy(dst, r->ring + off, first);
+    memcpy(dst + first, r->ring, n - first);
+}
+/*---------------------------------------------------------------------------*/
+/* the mutation hook of the table, logs the change for streaming replicas */
+static void
+repl_log(void *arg, int op, const node_t *node)
+{
+    struct repl *r = arg;
+    uint16_t hdr[2];
+    uint32_t value_size;
+    size_t len;
+
+    if (__atomic_load_n(&r->replicas, __ATOMIC_ACQUIRE) == 0)
+    {
+        return;
+    }
+
+    hdr[0] = node->key_size;
+    hdr[1] = node->flags | (op == HASH_OP_DELETE ? REPL_DELETE : 0);
+    value_size = op == HASH_OP_DELETE ? 0 : node->value_size;
+    len = 16 + node->key_size + value_size;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->replicas > 0)
+    {
+        if (len > REPL_LOG_SIZE)
+        {
+            /* cannot be logged, every replica falls behind and resyncs */
+            r->head += len;
+        }
+        else
+        {
+            ring_put(r, hdr, 4);
+            ring_put(r, &value_size, 4);
+            ring_put(r, &node->version, 8);
+            ring_put(r, node->key, node->key_size);
+            ring_put(r, node->value, value_size);
+        }
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+/*---------------------------------------------------------------------------*/
+struct repl *
+repl_init(hashtable_t *table)
+{
+    TRACE_PRINT();
+    struct repl *r = calloc(1, sizeof(struct repl));
+    pthread_condattr_t attr;
+
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    r->table = table;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&r->lock, NULL) != 0 ||
+        pthread_cond_init(&r->cond, &attr) != 0)
+    {
+        pthread_condattr_destroy(&attr);
+        free(r);
+        return NULL;
+    }
+    pthread_condattr_destroy(&attr);
+
+    if (hash_add_hook(table, repl_log, r) < 0)
+    {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+/*---------------------------------------------------------------------------*/
+void repl_destroy(struct repl *r)
+{
+    TRACE_PRINT();
+    if (r->following)
+    {
+        r->stop = 1;
+        pthread_join(r->thread, NULL);
+    }
+    hash_remove_hook(r->table, repl_log, r);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->ring);
+    free(r);
+}
+/*---------------------------------------------------------------------------*/
+int repl_sync(struct repl *r, int fd, volatile sig_atomic_t *stop)
+{
+    TRACE_PRINT();
+    char *buf = malloc(REPL_BATCH_SIZE + 16);
+    uint64_t pos, version, pending;
+    struct timespec ts;
+    size_t n;
+    uint32_t left;
+
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    /* start logging before the snapshot, so no mutation falls in between;
+     * one made during the snapshot may be in both, which is harmless
+     * because log records carry whole values */
+    pthread_mutex_lock(&r->lock);
+    if (r->ring == NULL)
+    {
+        r->ring = malloc(REPL_LOG_SIZE);
+        if (r->ring == NULL)
+        {
+            pthread_mutex_unlock(&r->lock);
+            free(buf);
+            return -1;
+        }
+    }
+    __atomic_add_fetch(&r->replicas, 1, __ATOMIC_RELEASE);
+    pos = r->head;
+    pthread_mutex_unlock(&r->lock);
+
+    if (hash_export(r->table, fd, REPL_SNAPSHOT_THREADS) < 0)
+    {
+        goto out;
+    }
+
+    while (!*stop)
+    {
+        pthread_mutex_lock(&r->lock);
+        if (r->head == pos)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+        }
+        if (r->head - pos > REPL_LOG_SIZE)
+        {
+            pthread_mutex_unlock(&r->lock);
+            DEBUG_PRINT("Replica fell behind the mutation log");
+            goto out;
+        }
+        n = r->head - pos < REPL_BATCH_SIZE ? r->head - pos
+                                             : REPL_BATCH_SIZE;
+        ring_get(r, pos, buf, n);
+        pos += n;
+        pending = r->head - pos;
+        version = __atomic_load_n(&r->table->version_seq, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->lock);
+
+        /* a heartbeat follows every batch, or a second of silence */
+        left = pending < UINT32_MAX ? pending : UINT32_MAX;
+        memset(buf + n, 0, 4);
+        memcpy(buf + n + 4, &left, 4);
+        memcpy(buf + n + 8, &version, 8);
+        if (write_full(fd, buf, n + 16) < 0)
+        {
+            goto out;
+        }
+    }
+
+out:
+    pthread_mutex_lock(&r->lock);
+    __atomic_sub_fetch(&r->replicas, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->lock);
+    free(buf);
+
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
+/* reads exactly n bytes from the primary */
+static int
+reader_read(struct repl_reader *rd, void *dst, size_t n)
+{
+    size_t m;
+    ssize_t ret;
+
+    while (n > 0)
+    {
+        if (rd->pos == rd->len)
+        {
+            ret = read(rd->fd, rd->buf, sizeof(rd->buf));
+            if (ret > 0)
+            {
+                rd->pos = 0;
+                rd->len = ret;
+                rd->r->last_heard_ms = now_ms();
+                continue;
+            }
+            if (ret == 0 || rd->r->stop ||
+                (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ||
+                now_ms() - rd->r->last_heard_ms > REPL_TIMEOUT_MS)
+            {
+                return -1;
+            }
+            continue;
+        }
+        m = rd->len - rd->pos < n ? rd->len - rd->pos : n;
+        memcpy(dst, rd->buf + rd->pos, m);
+        rd->pos += m;
+        dst = (char *)dst + m;
+        n -= m;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* reads one record and applies it to the table.
+ * returns -1 on errors, 1 when a mutation was applied, and 0 for a record
+ * with key_size 0, whose value_size and version are given back. */
+static int
+repl_apply(struct repl_reader *rd, uint32_t *value_size, uint64_t *version)
+{
+    struct repl *r = rd->r;
+    char key[MAX_KEY_LEN + 1], *value;
+    uint16_t hdr[2];
+
+    if (reader_read(rd, hdr, 4) < 0 ||
+        reader_read(rd, value_size, 4) < 0 ||
+        reader_read(rd, version, 8) < 0)
+    {
+        return -1;
+    }
+    if (hdr[0] == 0)
+    {
+        return 0;
+    }
+    if (hdr[0] > MAX_KEY_LEN || *value_size > MAX_BODY_LEN + COMPRESSED_HDR ||
+        reader_read(rd, key, hdr[0]) < 0)
+    {
+        return -1;
+    }
+    key[hdr[0]] = '\0';
+
+    if (hdr[1] & REPL_DELETE)
+    {
+        if (hash_delete(r->table, key) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        value = malloc(*value_size + 1);
+        if (value == NULL || reader_read(rd, value, *value_size) < 0)
+        {
+            free(value);
+            return -1;
+        }
+        value[*value_size] = '\0';
+        if (hash_restore_owned(r->table, key, value, *value_size,
+                               hdr[1], *version) != 1)
+        {
+            free(value);
+            return -1;
+        }
+    }
+    if (*version > r->applied_version)
+    {
+        r->applied_version = *version;
+    }
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* loads a snapshot from the primary on fd, then applies its log */
+static void
+repl_stream(struct repl *r, struct repl_reader *rd)
+{
+    struct timeval tv = {1, 0};
+    uint32_t header[2], value_size;
+    uint64_t version;
+    int ret = 0;
+
+    setsockopt(rd->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    rd->pos = rd->len = 0;
+    r->last_heard_ms = now_ms();
+
+    if (write_full(rd->fd, "SYNC\n", 5) < 0 ||
+        reader_read(rd, header, sizeof(header)) < 0 ||
+        memcmp(&header[0], HASH_EXPORT_MAGIC, 4) != 0 ||
+        header[1] != HASH_EXPORT_FORMAT)
+    {
+        return;
+    }
+
+    /* start over from the snapshot */
+    if (hash_clear(r->table) < 0)
+    {
+        return;
+    }
+    r->applied_version = 0;
+    r->syncs++;
+    while (!r->stop && (ret = repl_apply(rd, &value_size, &version)) > 0)
+        ;
+    if (r->stop || ret < 0)
+    {
+        return;
+    }
+
+    r->link_up = 1;
+    while (!r->stop && (ret = repl_apply(rd, &value_size, &version)) >= 0)
+    {
+        if (ret == 0)
+        {
+            /* heartbeat: value_size is the log not sent yet */
+            r->primary_version = version;
+            if (value_size == 0)
+            {
+                r->applied_version = version;
+            }
+        }
+    }
+    r->link_up = 0;
+}
+/*---------------------------------------------------------------------------*/
+int repl_load(struct repl *r, int fd)
+{
+    TRACE_PRINT();
+    struct repl_reader *rd = malloc(sizeof(struct repl_reader));
+    uint32_t header[2], value_size;
+    uint64_t version;
+    int ret;
+
+    if (rd == NULL)
+    {
+        return -1;
+    }
+    rd->r = r;
+    rd->fd = fd;
+    rd->pos = rd->len = 0;
+    r->last_heard_ms = now_ms();
+
+    ret = -1;
+    if (reader_read(rd, header, sizeof(header)) == 0 &&
+        memcmp(&header[0], HASH_EXPORT_MAGIC, 4) == 0 &&
+        header[1] == HASH_EXPORT_FORMAT)
+    {
+        while ((ret = repl_apply(rd, &value_size, &version)) > 0)
+            ;
+    }
+    /* the stream must end with the snapshot */
+    if (ret == 0 && rd->pos != rd->len)
+    {
+        ret = -1;
+    }
+    free(rd);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+static int
+repl_connect(const char *host, int port)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[16];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+/*---------------------------------------------------------------------------*/
+static void *
+repl_follower(void *arg)
+{
+    TRACE_PRINT();
+    struct repl *r = arg;
+    struct repl_reader *rd = malloc(sizeof(struct repl_reader));
+    struct timespec tick = {0, 100000000};
+    int i;
+
+    if (rd == NULL)
+    {
+        return NULL;
+    }
+    rd->r = r;
+
+    while (!r->stop)
+    {
+        rd->fd = repl_connect(r->host, r->port);
+        if (rd->fd >= 0)
+        {
+            repl_stream(r, rd);
+            close(rd->fd);
+        }
+        for (i = 0; i < REPL_RETRY_SEC * 10 && !r->stop; i++)
+        {
+            nanosleep(&tick, NULL);
+        }
+    }
+
+    free(rd);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+int repl_follow(struct repl *r, const char *host, int port)
+{
+    TRACE_PRINT();
+    if (snprintf(r->host, sizeof(r->host), "%s", host) >= sizeof(r->host))
+    {
+        return -1;
+    }
+    r->port = port;
+    r->stop = 0;
+    r->last_heard_ms = now_ms();
+    if (pthread_create(&r->thread, NULL, repl_follower, r) != 0)
+    {
+        return -1;
+    }
+    r->following = 1;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int repl_stats(struct repl *r, char *buf, size_t len)
+{
+    uint64_t applied = r->applied_version, primary = r->primary_version;
+    int n;
+
+    if (!r->following)
+    {
+        pthread_mutex_lock(&r->lock);
+        n = snprintf(buf, len, " role=primary replicas=%d log_bytes=%" PRIu64,
+                     r->replicas, r->head);
+        pthread_mutex_unlock(&r->lock);
+    }
+    else
+    {
+        n = snprintf(buf, len,
+                     " role=replica primary=%s:%d link=%s syncs=%" PRIu64
+                     " applied=%" PRIu64 " lag=%" PRIu64
+                     " last_heard_ms=%" PRIu64,
+                     r->host, r->port, r->link_up ? "up" : "down", r->syncs,
+                     applied, primary > applied ? primary - applied : 0,
+                     now_ms() - r->last_heard_ms);
+    }
+
+    return n < len ? n : len - 1;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,95 @@
+/*---------------------------------------------------------------------------*/
+/* repl.h                                                                    */
+/*---------------------------------------------------------------------------*/
+#ifndef _REPL_H
+#define _REPL_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include "hashtable.h"
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* a replica sends "SYNC\n" to the primary, which answers with a snapshot in
+ * the hash_export() stream format, then streams the mutation log forever.
+ * log records use the export record layout; REPL_DELETE in the flags marks
+ * a deletion (no value), and a record with key_size 0 is a heartbeat whose
+ * version is the latest version the primary has logged. */
+#define REPL_DELETE 0x8000
+#define REPL_LOG_SIZE (16 << 20)      // ring of the primary's mutation log
+#define REPL_BATCH_SIZE (256 << 10)   // most log bytes sent in one write
+#define REPL_SNAPSHOT_THREADS 4
+#define REPL_RETRY_SEC 1              // pause before a replica reconnects
+/*---------------------------------------------------------------------------*/
+struct repl
+{
+    /* primary side: the mutation log, kept only while replicas stream */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *ring;            // REPL_LOG_SIZE bytes, allocated on first SYNC
+    uint64_t head;         // log bytes ever appended
+    uint64_t last_version; // version of the latest logged mutation
+    int replicas;          // number of replicas streaming
+
+    /* replica side */
+    hashtable_t *table;
+    char host[256];
+    int port;
+    pthread_t thread;
+    int following;
+    volatile sig_atomic_t stop;
+    int link_up;              // snapshot loaded and log streaming
+    uint64_t applied_version; // version of the latest record applied
+    uint64_t primary_version; // latest version the primary announced
+    uint64_t last_heard_ms;   // when the primary was last heard from
+    uint64_t syncs;           // number of full resyncs
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * initializes replication state, and hooks it to table so that
+ * mutations are logged while replicas are attached.
+ * returns NULL when any internal errors occur.
+ */
+struct repl *repl_init(hashtable_t *table);
+/*---------------------------------------------------------------------------*/
+/**
+ * stops following the primary, if started, and frees the state.
+ */
+void repl_destroy(struct repl *r);
+/*---------------------------------------------------------------------------*/
+/**
+ * serves a replica that sent SYNC on fd: sends a snapshot of the table,
+ * then the mutation log in batches, until the replica goes away,
+ * falls more than REPL_LOG_SIZE bytes behind, or *stop is set.
+ * returns -1 when the stream ends for any reason.
+ */
+int repl_sync(struct repl *r, int fd, volatile sig_atomic_t *stop);
+/*---------------------------------------------------------------------------*/
+/**
+ * loads one snapshot in the hash_export() stream format from fd into the
+ * table, on top of what it holds. the peer must send nothing after the
+ * snapshot until it is answered, since the stream is read ahead.
+ * returns -1 when any internal errors occur, or the stream is malformed.
+ * returns 0 on success.
+ */
+int repl_load(struct repl *r, int fd);
+/*---------------------------------------------------------------------------*/
+/**
+ * starts a thread that keeps the table a replica of the primary at
+ * host:port, resyncing from scratch whenever the link breaks.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int repl_follow(struct repl *r, const char *host, int port);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes replication status as " key=value" pairs into buf.
+ * returns the number of bytes written (null-terminated).
+ */
+int repl_stats(struct repl *r, char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
+#endif // _REPL_H
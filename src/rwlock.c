@@ -4,25 +4,58 @@
 /* Modified by: Jerome Goh Zhi Sheng                                               */
 /*---------------------------------------------------------------------------*/
 #include "rwlock.h"
+#include "trace.h"
 /*---------------------------------------------------------------------------*/
-int rwlock_init(rwlock_t *rw, int delay)
+const char *g_rwlock_policies[RWLOCK_POLICIES] = {
+    "reader",
+    "writer",
+    "fair",
+};
+/*---------------------------------------------------------------------------*/
+static inline uint64_t
+now_ns(void)
 {
-    TRACE_PRINT();
-    int ret, destroy_ret;
-    rw->read_count = 0;
-    rw->write_count = 0;
-    rw->writer_ring_head = 0;
-    rw->writer_ring_tail = 0;
-    rw->delay = delay;
-    if (rw->writer_ring)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+/* writers that took a ticket and are not in yet */
+static inline unsigned int
+writers_waiting(rwlock_t *rw)
+{
+    return rw->write_ticket - rw->write_serving;
+}
+/*---------------------------------------------------------------------------*/
+/* accounts a wait that began at start; caller holds rw->lock */
+static inline void
+account_wait(uint64_t *waits, uint64_t *total, uint64_t *max,
+             uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+
+    (*waits)++;
+    *total += ns;
+    if (ns > *max)
     {
-        free(rw->writer_ring);
+        *max = ns;
     }
-    rw->writer_ring = calloc(WRITER_RING_SIZE, sizeof(pthread_t));
-    if (!rw->writer_ring)
+}
+/*---------------------------------------------------------------------------*/
+int rwlock_init(rwlock_t *rw, int delay, int policy)
+{
+    TRACE_PRINT();
+    int ret, destroy_ret;
+
+    if (policy < 0 || policy >= RWLOCK_POLICIES)
     {
+        errno = EINVAL;
         return -1;
     }
+    memset(rw, 0, sizeof(*rw));
+    rw->policy = policy;
+    rw->delay = delay;
 
     ret = pthread_mutex_init(&rw->lock, NULL);
     if (ret != 0)
@@ -82,7 +115,9 @@ int rwlock_read_lock(rwlock_t *rw)
     TRACE_PRINT();
     /*---------------------------------------------------------------------------*/
     /* edit here */
-    int ret;
+    int ret, waited = 0;
+    unsigned int phase;
+    uint64_t start = trace_begin(), wait_start = 0;
 
     ret = pthread_mutex_lock(&rw->lock);
     if (ret != 0)
@@ -90,30 +125,73 @@ int rwlock_read_lock(rwlock_t *rw)
         return -1;
     }
 
-    while (rw->write_count > 0)
+    if (rw->policy == RWLOCK_PHASE_FAIR)
     {
-        ret = pthread_cond_wait(&rw->readers, &rw->lock);
-        if (ret != 0)
+        /* wait out the write phase under way or due, then go in with the
+         * other readers it held up, even if more writers wait by then */
+        if (rw->write_count > 0 || writers_waiting(rw) > 0)
         {
-            pthread_mutex_unlock(&rw->lock);
-            return -1;
+            waited = 1;
+            wait_start = now_ns();
+            phase = rw->write_phases;
+            rw->read_waiting++;
+            while (rw->write_phases == phase)
+            {
+                ret = pthread_cond_wait(&rw->readers, &rw->lock);
+                if (ret != 0)
+                {
+                    rw->read_waiting--;
+                    pthread_mutex_unlock(&rw->lock);
+                    return -1;
+                }
+            }
+            rw->read_waiting--;
+            rw->read_admitted--;
+        }
+    }
+    else
+    {
+        while (rw->write_count > 0 ||
+               (rw->policy == RWLOCK_WRITER_PREF && writers_waiting(rw) > 0))
+        {
+            if (!waited)
+            {
+                waited = 1;
+                wait_start = now_ns();
+            }
+            ret = pthread_cond_wait(&rw->readers, &rw->lock);
+            if (ret != 0)
+            {
+                pthread_mutex_unlock(&rw->lock);
+                return -1;
+            }
         }
     }
 
     rw->read_count++;
+    if (waited)
+    {
+        account_wait(&rw->stats.read_waits, &rw->stats.read_wait_ns,
+                     &rw->stats.read_wait_max_ns, wait_start);
+    }
 
     ret = pthread_mutex_unlock(&rw->lock);
     if (ret != 0)
     {
         return -1;
     }
+    if (waited)
+    {
+        trace_end(TRACE_EV_LOCK, "read lock wait", NULL, start);
+    }
     /*---------------------------------------------------------------------------*/
     return 0;
 }
 /*---------------------------------------------------------------------------*/
 int rwlock_read_unlock(rwlock_t *rw)
 {
-    sleep(rw->delay);
+    if (rw->delay > 0)
+        sleep(rw->delay); // sleep(0) would still cost a system call
     TRACE_PRINT();
     /*---------------------------------------------------------------------------*/
     /* edit here */
@@ -128,10 +206,11 @@ int rwlock_read_unlock(rwlock_t *rw)
     rw->read_count--;
 
     // If this is the last reader and there are waiting writers
-    if (rw->read_count == 0 &&
-        rw->writer_ring_head != rw->writer_ring_tail)
+    if (rw->read_count == 0 && writers_waiting(rw) > 0)
     {
-        ret = pthread_cond_signal(&rw->writers);
+        /* only the writer holding the next ticket may proceed, and a
+         * single wakeup could go to another one, so wake them all */
+        ret = pthread_cond_broadcast(&rw->writers);
         if (ret != 0)
         {
             pthread_mutex_unlock(&rw->lock);
@@ -153,7 +232,9 @@ int rwlock_write_lock(rwlock_t *rw)
     TRACE_PRINT();
     /*---------------------------------------------------------------------------*/
     /* edit here */
-    int ret;
+    int ret, waited = 0;
+    unsigned int ticket;
+    uint64_t start = trace_begin(), wait_start = 0;
 
     ret = pthread_mutex_lock(&rw->lock);
     if (ret != 0)
@@ -161,13 +242,17 @@ int rwlock_write_lock(rwlock_t *rw)
         return -1;
     }
 
-    // Add ourselves to the writer queue
-    rw->writer_ring[rw->writer_ring_tail] = pthread_self();
-    rw->writer_ring_tail = (rw->writer_ring_tail + 1) % WRITER_RING_SIZE;
+    // Take a ticket, writers go in in the order they came
+    ticket = rw->write_ticket++;
 
     while (rw->read_count > 0 || rw->write_count > 0 ||
-           pthread_self() != rw->writer_ring[rw->writer_ring_head])
+           ticket != rw->write_serving || rw->read_admitted > 0)
     {
+        if (!waited)
+        {
+            waited = 1;
+            wait_start = now_ns();
+        }
         ret = pthread_cond_wait(&rw->writers, &rw->lock);
         if (ret != 0)
         {
@@ -177,20 +262,30 @@ int rwlock_write_lock(rwlock_t *rw)
     }
 
     rw->write_count++;
-    rw->writer_ring_head = (rw->writer_ring_head + 1) % WRITER_RING_SIZE;
+    rw->write_serving++;
+    if (waited)
+    {
+        account_wait(&rw->stats.write_waits, &rw->stats.write_wait_ns,
+                     &rw->stats.write_wait_max_ns, wait_start);
+    }
 
     ret = pthread_mutex_unlock(&rw->lock);
     if (ret != 0)
     {
         return -1;
     }
+    if (waited)
+    {
+        trace_end(TRACE_EV_LOCK, "write lock wait", NULL, start);
+    }
     /*---------------------------------------------------------------------------*/
     return 0;
 }
 /*---------------------------------------------------------------------------*/
 int rwlock_write_unlock(rwlock_t *rw)
 {
-    sleep(rw->delay);
+    if (rw->delay > 0)
+        sleep(rw->delay); // sleep(0) would still cost a system call
     TRACE_PRINT();
     /*---------------------------------------------------------------------------*/
     /* edit here */
@@ -204,24 +299,33 @@ int rwlock_write_unlock(rwlock_t *rw)
 
     rw->write_count--;
 
-    // Wake up all waiting readers first (reader priority)
-    ret = pthread_cond_broadcast(&rw->readers);
-    if (ret != 0)
+    if (rw->policy == RWLOCK_PHASE_FAIR)
     {
-        pthread_mutex_unlock(&rw->lock);
-        return -1;
+        /* the write phase ends: the readers it held up go in first */
+        rw->write_phases++;
+        rw->read_admitted = rw->read_waiting;
     }
 
-    // If no readers are waiting, wake up the next writer
-    if (rw->writer_ring_head != rw->writer_ring_tail)
+    if (rw->policy == RWLOCK_WRITER_PREF && writers_waiting(rw) > 0)
     {
-        ret = pthread_cond_signal(&rw->writers);
-        if (ret != 0)
+        // Readers keep waiting while writers do, wake only the writers
+        ret = pthread_cond_broadcast(&rw->writers);
+    }
+    else
+    {
+        // Wake up all waiting readers, and the writers (all of them, the
+        // one holding the next ticket proceeds once the readers are done)
+        ret = pthread_cond_broadcast(&rw->readers);
+        if (ret == 0 && writers_waiting(rw) > 0)
         {
-            pthread_mutex_unlock(&rw->lock);
-            return -1;
+            ret = pthread_cond_broadcast(&rw->writers);
         }
     }
+    if (ret != 0)
+    {
+        pthread_mutex_unlock(&rw->lock);
+        return -1;
+    }
 
     ret = pthread_mutex_unlock(&rw->lock);
     if (ret != 0)
@@ -233,6 +337,24 @@ int rwlock_write_unlock(rwlock_t *rw)
     return 0;
 }
 /*---------------------------------------------------------------------------*/
+void rwlock_stats(rwlock_t *rw, struct rwlock_stats *stats)
+{
+    pthread_mutex_lock(&rw->lock);
+    stats->read_waits += rw->stats.read_waits;
+    stats->write_waits += rw->stats.write_waits;
+    stats->read_wait_ns += rw->stats.read_wait_ns;
+    stats->write_wait_ns += rw->stats.write_wait_ns;
+    if (rw->stats.read_wait_max_ns > stats->read_wait_max_ns)
+    {
+        stats->read_wait_max_ns = rw->stats.read_wait_max_ns;
+    }
+    if (rw->stats.write_wait_max_ns > stats->write_wait_max_ns)
+    {
+        stats->write_wait_max_ns = rw->stats.write_wait_max_ns;
+    }
+    pthread_mutex_unlock(&rw->lock);
+}
+/*---------------------------------------------------------------------------*/
 int rwlock_destroy(rwlock_t *rw)
 {
     TRACE_PRINT();
@@ -262,11 +384,5 @@ int rwlock_destroy(rwlock_t *rw)
         return -1;
     }
 
-    if (rw->writer_ring)
-    {
-        free(rw->writer_ring);
-        rw->writer_ring = NULL;
-    }
-
     return 0;
 }
\ No newline at end of file
@@ -10,32 +10,58 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include "common.h"
-#define WRITER_RING_SIZE NUM_THREADS
+/*---------------------------------------------------------------------------*/
+/* fairness policies */
+enum RWLOCK_POLICY
+{
+    RWLOCK_READER_PREF, // readers enter whenever no writer holds the lock
+    RWLOCK_WRITER_PREF, // readers also wait while a writer waits
+    RWLOCK_PHASE_FAIR,  // read and write phases alternate: the readers a
+                        // writer held up go in before the next writer
+    RWLOCK_POLICIES
+};
+extern const char *g_rwlock_policies[RWLOCK_POLICIES];
+/*---------------------------------------------------------------------------*/
+/* waits for the lock, counted only when a thread had to block */
+struct rwlock_stats
+{
+    uint64_t read_waits, write_waits;
+    uint64_t read_wait_ns, write_wait_ns; // in total
+    uint64_t read_wait_max_ns, write_wait_max_ns;
+};
 /*---------------------------------------------------------------------------*/
 typedef struct
 {
-    int read_count;         // number of current/pending read threads
+    int read_count;         // number of current read threads
     int write_count;        // number of write threads
     pthread_mutex_t lock;   // mutex lock for protection
     pthread_cond_t readers; // condvar for threads waiting read
     pthread_cond_t writers; // condvar for threads waiting write
 
-    /* pending writer ring */
-    pthread_t *writer_ring; // thread IDs array
-    int writer_ring_head;   // position to insert
-    int writer_ring_tail;   // position to evict
+    /* writers go in in arrival order, by ticket */
+    unsigned int write_ticket;  // next ticket to take
+    unsigned int write_serving; // ticket of the next writer to go in
+
+    /* phase-fair state */
+    unsigned int write_phases; // write phases ended so far
+    int read_waiting;          // readers waiting for a write phase to end
+    int read_admitted;         // of those, let in but not in yet
+
+    int policy; // RWLOCK_POLICY
+    struct rwlock_stats stats;
 
     /* delay for semantic test */
     int delay;
 } rwlock_t;
 /*---------------------------------------------------------------------------*/
 /**
- * initializes rwlock.
+ * initializes rwlock with a RWLOCK_POLICY.
  * returns -1 when any internal errors occur.
  * returns 0 on success.
  */
-int rwlock_init(rwlock_t *rw, int delay);
+int rwlock_init(rwlock_t *rw, int delay, int policy);
 /*---------------------------------------------------------------------------*/
 /**
  * acquires read lock.
@@ -65,6 +91,11 @@ int rwlock_write_lock(rwlock_t *rw);
  */
 int rwlock_write_unlock(rwlock_t *rw);
 /*---------------------------------------------------------------------------*/
+/**
+ * adds the wait statistics of rwlock to stats.
+ */
+void rwlock_stats(rwlock_t *rw, struct rwlock_stats *stats);
+/*---------------------------------------------------------------------------*/
 /**
  * destroys rwlock.
  * returns -1 when any internal errors occur.
@@ -13,10 +13,68 @@
 #include <errno.h>
 #include <getopt.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include "common.h"
 #include "skvslib.h"
+#include "handoff.h"
 #include "fcntl.h"
+/* a tcp and a unix domain socket */
+#define MAX_LISTENERS 2
+/* readiness events the poller takes in one wait */
+#define POLL_EVENTS 64
+/* reads one task of a connection makes before it queues itself again, so
+ * that a busy peer does not keep a worker to itself */
+#define CONN_ROUNDS 4
+/* bytes of responses batched per connection; wbuf grows beyond that only
+ * for a response that would not fit, until it is sent */
+#define CONN_WBUF (BUFFER_SIZE * 4)
+/*---------------------------------------------------------------------------*/
+/* per-connection state */
+struct conn
+{
+    int fd;
+    char rbuf[BUFFER_SIZE * 2]; // received bytes not served yet
+    size_t rlen;
+    char *wbuf; // responses not sent yet, from woff, in wcap bytes
+    size_t wlen, woff, wcap;
+    int inflight; // responses in wbuf, counted until it drains
+    int discard;  // skipping the rest of a line longer than BUFFER_SIZE
+    int framing;  // receiving the body of the framed request in header
+    char header[BUFFER_SIZE + 1];
+    size_t hlen;
+    char *body; // its body and newline so far, NULL when it is dropped
+    size_t body_len, body_got;
+    char body_last; // the last byte received of it
+    int home;     // slot of the worker that ran it last, and runs it next
+    int armed;    // waiting in the poller rather than on a worker
+    time_t stalled; // since when the peer leaves its responses unread, or 0
+    struct conn *prev, *next; // in the list of open connections
+};
+/*---------------------------------------------------------------------------*/
+/* the open connections and what serves them: the poller waits for those
+ * armed in epfd, and queues each that is ready as a task of the pool */
+struct server
+{
+    struct skvs_ctx *ctx;
+    struct pool *pool;
+    int epfd;
+    int delay;
+    int max_inflight; // unsent responses after which a connection is not
+                      // read any further
+    pthread_mutex_t lock; // guards conns, their armed flags, accepting and
+                          // handed
+    struct conn *conns;
+    int accepting;   // acceptors may still open connections
+    int min_workers; // workers started with the pool
+    int started;     // workers started so far
+    time_t deadline; // at a handoff, when unfinished connections are closed
+    int *handed;     // at a handoff, connections left to the next server
+    int nhanded;
+};
 /*---------------------------------------------------------------------------*/
 struct thread_args
 {
@@ -26,85 +84,790 @@ struct thread_args
 
     /*---------------------------------------------------------------------------*/
     /* free to use */
-    int delay;
+    struct server *srv;
+    int max_conns; // connections open at once, 0 for any
     /*---------------------------------------------------------------------------*/
 };
 /*---------------------------------------------------------------------------*/
 volatile static sig_atomic_t g_shutdown = 0;
+volatile static sig_atomic_t g_handoff = 0; // shutting down to hand over
+volatile static sig_atomic_t g_export = 0;
 /*---------------------------------------------------------------------------*/
-void *handle_client(void *arg)
+/* waits until fd is ready for events.
+ * returns -1 on shutdown, or when the peer made no progress for
+ * SEND_TIMEOUT seconds. */
+static int conn_wait(int fd, short events)
+{
+    struct pollfd pfd = {fd, events, 0};
+    int waited = 0, ret;
+
+    while (!g_shutdown && waited < SEND_TIMEOUT)
+    {
+        ret = poll(&pfd, 1, TIMEOUT * 1000);
+        if (ret > 0)
+            return 0;
+        if (ret == 0)
+            waited += TIMEOUT;
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
+/* moves *iov past n bytes written, dropping the iovecs sent whole */
+static void iov_advance(struct iovec **iov, int *cnt, size_t n)
+{
+    while (*cnt > 0 && n >= (*iov)->iov_len)
+    {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*cnt)--;
+    }
+    if (*cnt > 0)
+    {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* writes all iovecs, resuming after partial writes and waiting for the
+ * peer as needed; only for a connection that left the pool */
+static int conn_writev(int fd, struct iovec *iov, int cnt)
 {
-    TRACE_PRINT();
-    struct thread_args *args = (struct thread_args *)arg;
-    struct skvs_ctx *ctx = args->ctx;
-    int idx = args->idx;
-    int listenfd = args->listenfd;
-    /*---------------------------------------------------------------------------*/
-    /* free to declare any variables */
-    struct sockaddr_storage client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    int client_fd;
-    char rbuf[BUFFER_SIZE];
     ssize_t n;
-    const char *resp;
-    struct timeval tv;
-    /*---------------------------------------------------------------------------*/
+    uint64_t start;
 
-    printf("%dth worker ready\n", idx);
+    while (cnt > 0)
+    {
+        start = trace_begin();
+        n = writev(fd, iov, cnt);
+        trace_end(TRACE_EV_WRITE, NULL, NULL, start);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                conn_wait(fd, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        iov_advance(&iov, &cnt, n);
+    }
 
-    /*---------------------------------------------------------------------------*/
-    /* edit here */
-    while (!g_shutdown)
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* sends what the socket takes now without waiting, and gives back the room
+ * wbuf grew by once it is all sent */
+static int conn_drain(struct conn *c)
+{
+    ssize_t n;
+    uint64_t start;
+    char *wbuf;
+
+    while (c->woff < c->wlen)
     {
-        client_fd = accept(listenfd, (struct sockaddr *)&client_addr, &addr_size);
-        if (client_fd == -1)
+        start = trace_begin();
+        n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        trace_end(TRACE_EV_WRITE, NULL, NULL, start);
+        if (n < 0)
         {
-            if (errno == EINTR || errno == EINVAL || errno == EBADF)
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->woff += n;
+        c->stalled = 0; // the peer reads
+    }
+    c->wlen = c->woff = 0;
+    c->inflight = 0;
+    if (c->wcap > CONN_WBUF && (wbuf = realloc(c->wbuf, CONN_WBUF)))
+    {
+        c->wbuf = wbuf;
+        c->wcap = CONN_WBUF;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* sends everything queued, waiting for the peer as needed; only for a
+ * connection that left the pool */
+static int conn_flush(struct conn *c)
+{
+    struct iovec iov = {c->wbuf + c->woff, c->wlen - c->woff};
+
+    if (c->wlen == 0)
+        return 0;
+    c->wlen = c->woff = 0;
+    c->inflight = 0;
+
+    return conn_writev(c->fd, &iov, 1);
+}
+/*---------------------------------------------------------------------------*/
+/* makes room for len more bytes at the end of wbuf, moving the unsent ones
+ * to its front, and growing it when that is not enough */
+static int conn_reserve(struct conn *c, size_t len)
+{
+    size_t cap = c->wcap;
+    char *wbuf;
+
+    if (c->woff > 0)
+    {
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+    while (c->wlen + len > cap)
+        cap *= 2;
+    if (cap == c->wcap)
+        return 0;
+
+    wbuf = realloc(c->wbuf, cap);
+    if (!wbuf)
+        return -1;
+    c->wbuf = wbuf;
+    c->wcap = cap;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* returns 1 when c has enough unsent responses that its requests should
+ * wait (read-side backpressure), 0 otherwise */
+static int conn_full(struct conn *c, int max_inflight)
+{
+    return c->wlen > CONN_WBUF - BUFFER_SIZE ||
+           (max_inflight > 0 && c->inflight >= max_inflight);
+}
+/*---------------------------------------------------------------------------*/
+/* queues a response, batched in wbuf. one that does not fit is sent
+ * straight from where it is (e.g., the buffer it was copied to) as far as
+ * the socket takes it once wbuf is out, and the rest is kept in wbuf,
+ * grown for it, so the peer is never waited for. one that skvs_serve()
+ * already wrote at the end of wbuf is only taken in */
+static int conn_send(struct conn *c, struct iovec *iov, int cnt)
+{
+    size_t total = 0;
+    ssize_t n;
+    uint64_t start;
+    int i;
+
+    if (cnt == 1 && iov[0].iov_base == c->wbuf + c->wlen)
+    {
+        c->wlen += iov[0].iov_len;
+        c->inflight++;
+        return 0;
+    }
+
+    for (i = 0; i < cnt; i++)
+        total += iov[i].iov_len;
+
+    if (c->wlen + total > c->wcap)
+    {
+        if (conn_drain(c) < 0)
+            return -1;
+        while (c->wlen == 0 && cnt > 0)
+        {
+            start = trace_begin();
+            n = writev(c->fd, iov, cnt);
+            trace_end(TRACE_EV_WRITE, NULL, NULL, start);
+            if (n < 0)
             {
-                if (g_shutdown)
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
                     break;
-                continue;
+                return -1;
             }
-            perror("accept");
+            c->stalled = 0;
+            total -= n;
+            iov_advance(&iov, &cnt, n);
+        }
+        if (cnt == 0)
+            return 0;
+        if (c->wlen + total > c->wcap && conn_reserve(c, total) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < cnt; i++)
+    {
+        memcpy(c->wbuf + c->wlen, iov[i].iov_base, iov[i].iov_len);
+        c->wlen += iov[i].iov_len;
+    }
+    c->inflight++;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* takes what rbuf has from *start on of the framed body being received,
+ * and then of the newline after it.
+ * returns 1 once both are in, 0 while more is to come, -1 when the
+ * newline is missing and the framing is lost. */
+static int conn_body(struct conn *c, size_t *start)
+{
+    size_t n = c->rlen - *start;
+
+    if (n > c->body_len + 1 - c->body_got)
+        n = c->body_len + 1 - c->body_got;
+    if (n > 0)
+    {
+        if (c->body)
+            memcpy(c->body + c->body_got, c->rbuf + *start, n);
+        c->body_last = c->rbuf[*start + n - 1];
+        c->body_got += n;
+        *start += n;
+    }
+    if (c->body_got < c->body_len + 1)
+        return 0;
+    if (c->body_last != '\n')
+        return -1;
+    if (c->body)
+        c->body[c->body_len] = '\0';
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* serves one request and queues its response.
+ * returns -1 when the connection has to be closed, 0 otherwise. */
+static int conn_reply(struct conn *c, struct skvs_ctx *ctx, char *line,
+                      size_t linelen, char *body, ssize_t body_len,
+                      int delay)
+{
+    struct iovec iov[SKVS_RESP_IOV];
+    struct skvs_out out;
+    int cnt;
+
+    /* a READ reply is written right into wbuf when it fits */
+    out.buf = c->wbuf + c->wlen;
+    out.room = c->wcap - c->wlen;
+    cnt = skvs_serve(ctx, line, linelen, body, body_len, &out, iov);
+    if (cnt <= 0)
+        return 0;
+    if (conn_send(c, iov, cnt) < 0)
+        return -1;
+    if (delay > 0)
+    {
+        if (conn_drain(c) < 0)
+            return -1;
+        sleep(delay);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* serves the complete requests in rbuf until c is full. the body of a
+ * framed request is collected across calls, as it arrives.
+ * returns 1 when requests were left in rbuf because c is full, 0 when all
+ * were served, -1 when the connection has to be closed. */
+static int conn_process(struct conn *c, struct skvs_ctx *ctx, int delay,
+                        int max_inflight)
+{
+    struct iovec iov[SKVS_RESP_IOV];
+    size_t start = 0, linelen, blocklen;
+    ssize_t body_len;
+    char *line, *nl, *body;
+    int cnt, full, run, ret;
+
+    /* look the pipelined READs up together */
+    skvs_prefetch(ctx, c->rbuf, c->rlen);
+
+    while (!conn_full(c, max_inflight))
+    {
+        if (c->framing)
+        {
+            ret = conn_body(c, &start);
+            if (ret < 0)
+                return -1; // the connection cannot be trusted further
+            if (ret == 0)
+                break;
+            /* the table adopts the body */
+            body = c->body;
+            c->body = NULL;
+            c->framing = 0;
+            if (conn_reply(c, ctx, c->header, c->hlen, body, c->body_len,
+                           delay) < 0)
+                return -1;
+            continue;
+        }
+        if (start >= c->rlen)
+            break;
+
+        line = c->rbuf + start;
+        nl = memchr(line, '\n', c->rlen - start);
+        if (nl == NULL)
+        {
+            if (!c->discard && c->rlen - start >= BUFFER_SIZE)
+            {
+                /* no request is this long, reject it and skip to the next */
+                cnt = skvs_serve(ctx, line, c->rlen - start, NULL, 0, NULL,
+                                 iov);
+                if (cnt > 0 && conn_send(c, iov, cnt) < 0)
+                    return -1;
+                c->discard = 1;
+            }
+            if (c->discard)
+                start = c->rlen;
             break;
         }
+        linelen = nl - line + 1;
+        start += linelen;
+        if (c->discard)
+        {
+            c->discard = 0;
+            continue;
+        }
 
-        /* Set socket timeout */
-        tv.tv_sec = 1; // 1 second timeout
-        tv.tv_usec = 0;
-        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+        if (skvs_is_sync(line, linelen))
+        {
+            /* the connection now belongs to a replica until it ends, and
+             * its worker leaves the pool to it, free to wait */
+            pool_detach(ctx->pool);
+            if (conn_flush(c) < 0)
+                return -1;
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+            return skvs_sync(ctx, c->fd, &g_shutdown);
+        }
 
-        /* Handle client requests */
-        while (!g_shutdown)
+        if (skvs_is_multi(line, linelen))
         {
-            n = read(client_fd, rbuf, BUFFER_SIZE - 1);
+            /* a block is served as a whole, once its EXEC is in */
+            start -= linelen;
+            blocklen = skvs_multi_len(line, c->rlen - start);
+            if (blocklen == 0 && start == 0 && c->rlen == sizeof(c->rbuf))
+                return -1; // it can never be whole
+            if (blocklen == 0)
+                break;
+            start += blocklen;
+            cnt = skvs_serve_multi(ctx, line, blocklen, iov);
+            if (cnt < 0 || (cnt > 0 && conn_send(c, iov, cnt) < 0))
+                return -1;
+            continue;
+        }
 
-            if (n > 0)
+        run = delay > 0 ? 0 :
+              skvs_update_run(line, c->rlen - start + linelen, &blocklen);
+        if (run > 1)
+        {
+            /* UPDATEs of one key back to back: only the last one is
+             * applied, and its reply stands for them all */
+            start += blocklen - linelen;
+            line = memrchr(line, '\n', blocklen - 1) + 1;
+            cnt = skvs_serve(ctx, line, c->rbuf + start - line, NULL, 0,
+                             NULL, iov);
+            if (cnt <= 0)
+                continue;
+            __atomic_add_fetch(&ctx->coalesced_updates, run - 1,
+                               __ATOMIC_RELAXED);
+            while (run-- > 0)
+                if (conn_send(c, iov, cnt) < 0)
+                    return -1;
+            continue;
+        }
+
+        body_len = skvs_frame_len(line, linelen);
+        if (body_len >= 0 && linelen > BUFFER_SIZE)
+            return -1; // no valid header is this long, nor can its body
+                       // be told from the requests after it
+        if (body_len >= 0)
+        {
+            /* keep the header aside and collect the body into its own
+             * allocation, which the table then adopts; one too large is
+             * dropped as it arrives */
+            memcpy(c->header, line, linelen);
+            c->hlen = linelen;
+            c->body = NULL;
+            if (body_len <= MAX_BODY_LEN)
             {
-                rbuf[n] = '\0';
-                resp = skvs_serve(ctx, rbuf, n);
-                if (resp)
-                {
-                    write(client_fd, resp, strlen(resp));
-                    write(client_fd, "\n", 1);
+                c->body = malloc(body_len + 1);
+                if (c->body == NULL)
+                    return -1;
+            }
+            c->body_len = body_len;
+            c->body_got = 0;
+            c->framing = 1;
+            continue;
+        }
+
+        if (conn_reply(c, ctx, line, linelen, NULL, body_len, delay) < 0)
+            return -1;
+    }
+
+    full = (start < c->rlen ||
+            (c->framing && c->body_got == c->body_len + 1)) &&
+           conn_full(c, max_inflight);
+    memmove(c->rbuf, c->rbuf + start, c->rlen - start);
+    c->rlen -= start;
+
+    return full;
+}
+/*---------------------------------------------------------------------------*/
+/* returns 1 when c is between two requests, so that another server can go
+ * on serving it, 0 otherwise */
+static int conn_idle(struct conn *c)
+{
+    return c->rlen == 0 && c->wlen == 0 && !c->discard && !c->framing;
+}
+/*---------------------------------------------------------------------------*/
+/* returns 1 when c is to be read: it is not full, and at shutdown it is in
+ * the middle of a request, 0 otherwise */
+static int conn_readable(struct conn *c, int max_inflight)
+{
+    return !conn_full(c, max_inflight) && c->rlen < sizeof(c->rbuf) &&
+           (!g_shutdown || c->rlen > 0 || c->discard || c->framing);
+}
+/*---------------------------------------------------------------------------*/
+/* takes c off the open connections and frees it, leaving its socket to the
+ * next server when hand is set, or closing it; caller holds srv->lock */
+static void conn_free(struct server *srv, struct conn *c, int hand)
+{
+    int *handed;
+
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        srv->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    handed = hand ? realloc(srv->handed, sizeof(int) * (srv->nhanded + 1))
+                  : NULL;
+    if (handed)
+    {
+        srv->handed = handed;
+        srv->handed[srv->nhanded++] = c->fd;
+    }
+    else
+    {
+        printf("Connection closed by client\n");
+        close(c->fd);
+    }
+    __atomic_sub_fetch(&srv->ctx->conns, 1, __ATOMIC_RELAXED);
+    free(c->body);
+    free(c->wbuf);
+    free(c);
+}
+/*---------------------------------------------------------------------------*/
+/* opens a connection on the socket fd, for the poller to wait on.
+ * returns -1 when any internal errors occur. returns 0 on success. */
+static int conn_open(struct server *srv, int fd)
+{
+    struct epoll_event ev;
+    struct timeval tv;
+    struct conn *c;
+
+    c = malloc(sizeof(struct conn));
+    if (!c)
+        return -1;
+    c->wbuf = malloc(CONN_WBUF);
+    if (!c->wbuf)
+    {
+        free(c);
+        return -1;
+    }
+
+    /* Set socket timeout, used once the connection turns into a
+     * replication stream; requests are served non-blocking */
+    tv.tv_sec = 1; // 1 second timeout
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    c->fd = fd;
+    c->rlen = 0;
+    c->wlen = c->woff = 0;
+    c->wcap = CONN_WBUF;
+    c->inflight = 0;
+    c->discard = 0;
+    c->framing = 0;
+    c->body = NULL;
+    c->home = -1; // the next worker in turn
+    c->armed = 1;
+    c->stalled = 0;
+    c->prev = NULL;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
 
-                    if (args->delay > 0)
-                    {
-                        sleep(args->delay);
-                    }
+    /* linked before the poller can take it */
+    pthread_mutex_lock(&srv->lock);
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        pthread_mutex_unlock(&srv->lock);
+        free(c->wbuf);
+        free(c);
+        return -1;
+    }
+    c->next = srv->conns;
+    if (srv->conns)
+        srv->conns->prev = c;
+    srv->conns = c;
+    pthread_mutex_unlock(&srv->lock);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* hands c back to the poller until it is ready for events.
+ * returns -1 when any internal errors occur. returns 0 on success. */
+static int conn_arm(struct server *srv, struct conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    if ((events & EPOLLOUT) && c->stalled == 0)
+        c->stalled = time(NULL);
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = c;
+
+    /* under the lock, so the poller finds it armed as soon as it can take
+     * it */
+    pthread_mutex_lock(&srv->lock);
+    c->armed = 1;
+    ret = epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    if (ret < 0)
+        c->armed = 0;
+    pthread_mutex_unlock(&srv->lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* serves what c has ready: sends what the socket takes, reads while c is
+ * not full, so a peer that does not read its responses stops being served,
+ * and serves the complete requests, for up to CONN_ROUNDS reads.
+ * returns the events c waits for next, 0 when it has more to read at once,
+ * -1 when it has to be closed. */
+static int conn_step(struct server *srv, struct conn *c)
+{
+    ssize_t n = 0;
+    int round, full, events = 0;
+    uint64_t start;
+
+    for (round = 0; round < CONN_ROUNDS; round++)
+    {
+        if (c->wlen && conn_drain(c) < 0)
+            return -1;
+        n = -1;
+        if (conn_readable(c, srv->max_inflight))
+        {
+            start = trace_begin();
+            if (c->framing && c->body && c->rlen == 0 &&
+                c->body_got <= c->body_len)
+            {
+                /* the rest of a framed body goes right into place */
+                n = read(c->fd, c->body + c->body_got,
+                         c->body_len + 1 - c->body_got);
+                if (n > 0)
+                {
+                    c->body_got += n;
+                    c->body_last = c->body[c->body_got - 1];
                 }
             }
-            else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            else
             {
-                break;
+                n = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+                if (n > 0)
+                    c->rlen += n;
             }
+            trace_end(TRACE_EV_READ, NULL, NULL, start);
+            if (n == 0 ||
+                (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                 errno != EINTR))
+                return -1;
         }
 
-        printf("Connection closed by client\n");
-        close(client_fd);
+        /* serve what fits, including requests left over while c was
+         * full, and send the responses right away when possible. when
+         * they all went out, no event would bring the leftovers back, so
+         * serve them now. */
+        do
+        {
+            full = conn_process(c, srv->ctx, srv->delay, srv->max_inflight);
+            if (full < 0)
+            {
+                /* still deliver what the socket takes of the responses
+                 * served before the error */
+                conn_drain(c);
+                return -1;
+            }
+            if (conn_drain(c) < 0)
+                return -1;
+        } while (full && c->wlen == 0);
+        if (n <= 0)
+            break;
     }
-    /*---------------------------------------------------------------------------*/
+    if (n > 0)
+        return 0; // the peer likely sent more, after the other tasks
+
+    if (conn_readable(c, srv->max_inflight))
+        events |= EPOLLIN;
+    if (c->wlen)
+        events |= EPOLLOUT;
+
+    return events;
+}
+/*---------------------------------------------------------------------------*/
+/* runs c on a worker until it waits for its peer, then hands it back to
+ * the poller. at shutdown c is closed, or at a handoff left to the next
+ * server once it is between two requests, which it has until the deadline
+ * to get to. */
+static void conn_run(void *arg, void *task)
+{
+    struct server *srv = (struct server *)arg;
+    struct conn *c = (struct conn *)task;
+    int events = -1;
+
+    c->home = pool_self();
+    if (!g_shutdown || (g_handoff && time(NULL) < srv->deadline))
+        events = conn_step(srv, c);
+
+    if (events >= 0 && g_handoff && conn_idle(c))
+    {
+        pthread_mutex_lock(&srv->lock);
+        conn_free(srv, c, 1);
+        pthread_mutex_unlock(&srv->lock);
+        return;
+    }
+    if (events == 0 && pool_submit(srv->pool, c, c->home) == 0)
+        return;
+    if (events <= 0 || conn_arm(srv, c, events) < 0)
+    {
+        pthread_mutex_lock(&srv->lock);
+        conn_free(srv, c, 0);
+        pthread_mutex_unlock(&srv->lock);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* sets up and tears down the threads of the pool as it grows and shrinks */
+static void conn_worker(void *arg, int idx, int start)
+{
+    struct server *srv = (struct server *)arg;
+
+    if (start)
+    {
+        /* workers spawned later, as the pool grows, start quietly */
+        if (__atomic_fetch_add(&srv->started, 1, __ATOMIC_RELAXED) <
+            srv->min_workers)
+            printf("%dth worker ready\n", idx);
+        else
+            DEBUG_PRINT("%dth worker ready\n", idx);
+        trace_thread_start("worker", idx);
+        return;
+    }
+    skvs_thread_exit();
+    trace_thread_exit();
+}
+/*---------------------------------------------------------------------------*/
+/* waits for the armed connections and queues each that is ready as a task
+ * for the worker that ran it last. every second, and all along at
+ * shutdown, it closes those whose peer left responses unread for
+ * SEND_TIMEOUT seconds, and at shutdown those waiting, except at a handoff
+ * those between two requests, which it hands over. returns once the
+ * acceptors stopped and no connection is left. */
+void *poll_clients(void *arg)
+{
+    TRACE_PRINT();
+    struct server *srv = (struct server *)arg;
+    struct epoll_event evs[POLL_EVENTS];
+    struct conn *ready[POLL_EVENTS], *c, *next;
+    time_t now, swept = 0;
+    int n, i, done = 0;
+
+    trace_thread_start("poller", 0);
+    while (!done)
+    {
+        n = epoll_wait(srv->epfd, evs, POLL_EVENTS, TIMEOUT * 1000);
+        if (n < 0)
+            n = 0; // interrupted to see the shutdown
+        now = time(NULL);
+
+        pthread_mutex_lock(&srv->lock);
+        for (i = 0; i < n; i++)
+        {
+            ready[i] = (struct conn *)evs[i].data.ptr;
+            ready[i]->armed = 0;
+        }
+        for (c = srv->conns; c && (g_shutdown || now != swept); c = next)
+        {
+            next = c->next;
+            if (!c->armed)
+                continue; // a worker has it
+            if (g_handoff && conn_idle(c))
+                conn_free(srv, c, 1);
+            else if ((g_shutdown && (!g_handoff || now >= srv->deadline)) ||
+                     (c->stalled && now - c->stalled >= SEND_TIMEOUT))
+                conn_free(srv, c, 0);
+        }
+        swept = now;
+        done = g_shutdown && !srv->accepting && !srv->conns;
+        pthread_mutex_unlock(&srv->lock);
 
+        for (i = 0; i < n; i++)
+        {
+            if (pool_submit(srv->pool, ready[i], ready[i]->home) < 0)
+            {
+                pthread_mutex_lock(&srv->lock);
+                conn_free(srv, ready[i], 0);
+                pthread_mutex_unlock(&srv->lock);
+            }
+        }
+    }
+
+    trace_thread_exit();
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* accepts connections for the poller, refusing those over the limit with
+ * BUSY at once rather than leaving them to wait */
+void *accept_client(void *arg)
+{
+    TRACE_PRINT();
+    struct thread_args *args = (struct thread_args *)arg;
+    struct skvs_ctx *ctx = args->ctx;
+    struct sockaddr_storage client_addr;
+    socklen_t addr_size;
+    int client_fd, nconns;
+    char busy[32];
+    uint64_t start;
+
+    snprintf(busy, sizeof(busy), "%s\n", g_msgs[MSG_BUSY]);
+    trace_thread_start("acceptor", 0);
+    while (!g_shutdown)
+    {
+        addr_size = sizeof(client_addr);
+        client_fd = accept(args->listenfd, (struct sockaddr *)&client_addr,
+                           &addr_size);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == EINVAL || errno == EBADF ||
+                errno == ECONNABORTED)
+            {
+                if (g_shutdown)
+                    break;
+                continue;
+            }
+            perror("accept");
+            continue;
+        }
+        start = trace_begin();
+
+        nconns = __atomic_add_fetch(&ctx->conns, 1, __ATOMIC_RELAXED);
+        if ((args->max_conns > 0 && nconns > args->max_conns) ||
+            conn_open(args->srv, client_fd) < 0)
+        {
+            /* a fresh socket always has room for the reply */
+            __atomic_sub_fetch(&ctx->conns, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ctx->rejected, 1, __ATOMIC_RELAXED);
+            if (write(client_fd, busy, strlen(busy)) < 0)
+                DEBUG_PRINT("BUSY reply failed\n");
+            close(client_fd);
+            trace_end(TRACE_EV_ACCEPT, "accept busy", NULL, start);
+            continue;
+        }
+        trace_end(TRACE_EV_ACCEPT, NULL, NULL, start);
+    }
+
+    trace_thread_exit();
     return NULL;
 }
 /*---------------------------------------------------------------------------*/
@@ -116,34 +879,234 @@ void handle_sigint(int sig)
     g_shutdown = 1;
 }
 /*---------------------------------------------------------------------------*/
+/* Signal handler for SIGUSR1, exports the table from the main thread */
+void handle_sigusr1(int sig)
+{
+    TRACE_PRINT();
+    g_export = 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Signal handler for SIGUSR2, which only interrupts blocking calls */
+void handle_wakeup(int sig)
+{
+}
+/*---------------------------------------------------------------------------*/
+/* creates the listening socket on ip:port.
+ * returns -1 when any internal errors occur, with errno reported. */
+static int open_listener(const char *ip, int port)
+{
+    struct sockaddr_in server_addr;
+    int listenfd, yes = 1;
+
+    /* Create socket */
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0)
+    {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    /* Set socket options */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
+    {
+        perror("setsockopt");
+        close(listenfd);
+        return -1;
+    }
+
+    /* Configure server address */
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(ip);
+    server_addr.sin_port = htons(port);
+
+    /* Bind */
+    if (bind(listenfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("bind failed");
+        close(listenfd);
+        return -1;
+    }
+
+    /* Listen */
+    if (listen(listenfd, NUM_BACKLOG) < 0)
+    {
+        perror("listen failed");
+        close(listenfd);
+        return -1;
+    }
+
+    return listenfd;
+}
+/*---------------------------------------------------------------------------*/
+/* creates the listening socket on the unix domain socket path, replacing
+ * a stale one, or on "@name" in the abstract namespace.
+ * returns -1 when any internal errors occur, with errno reported. */
+static int open_unix_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    int listenfd, addr_len;
+
+    addr_len = unix_addr(&addr, path);
+    if (addr_len < 0)
+    {
+        perror("invalid unix socket path");
+        return -1;
+    }
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+    {
+        perror("socket creation failed");
+        return -1;
+    }
+    if (path[0] != UNIX_ABSTRACT)
+        unlink(path);
+
+    if (bind(listenfd, (struct sockaddr *)&addr, addr_len) < 0)
+    {
+        perror("bind failed");
+        close(listenfd);
+        return -1;
+    }
+    if (listen(listenfd, NUM_BACKLOG) < 0)
+    {
+        perror("listen failed");
+        close(listenfd);
+        return -1;
+    }
+
+    return listenfd;
+}
+/*---------------------------------------------------------------------------*/
+/* returns the address family of the listening socket fd, or -1 when fd is
+ * not one (a connection) */
+static int listener_family(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int listening = 0;
+    socklen_t opt_len = sizeof(listening);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &opt_len) < 0 ||
+        !listening ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+    {
+        return -1;
+    }
+
+    return addr.ss_family;
+}
+/*---------------------------------------------------------------------------*/
+/* removes the file of the unix domain socket listenfd, if it has one */
+static void unlink_listener(int listenfd)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(listenfd, (struct sockaddr *)&addr, &len) == 0 &&
+        addr.sun_family == AF_UNIX &&
+        len > offsetof(struct sockaddr_un, sun_path) &&
+        addr.sun_path[0] != '\0')
+    {
+        unlink(addr.sun_path);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* closes the listening sockets that were opened, removing unix socket files */
+static void close_listeners(int *listenfds, int nlisteners)
+{
+    int i;
+
+    for (i = 0; i < nlisteners; i++)
+    {
+        if (listenfds[i] < 0)
+            continue;
+        unlink_listener(listenfds[i]);
+        close(listenfds[i]);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* lets the poller return once no connection is left, and waits for it */
+static void stop_poller(struct server *srv, pthread_t poller)
+{
+    pthread_mutex_lock(&srv->lock);
+    srv->accepting = 0;
+    pthread_mutex_unlock(&srv->lock);
+    pthread_kill(poller, SIGUSR2); // cut an idle epoll_wait() short
+    pthread_join(poller, NULL);
+}
+/*---------------------------------------------------------------------------*/
+/* stops the acceptor without touching the listening socket, which another
+ * process may be sharing (shutdown() would stop it there as well) */
+static void stop_acceptor(pthread_t acceptor)
+{
+    struct timespec ts;
+
+    do
+    {
+        /* the signal may come just before accept(), so repeat it */
+        pthread_kill(acceptor, SIGUSR2);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    } while (pthread_timedjoin_np(acceptor, NULL, &ts) == ETIMEDOUT);
+}
+/*---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
 {
     size_t hash_size = DEFAULT_HASH_SIZE;
     char *ip = DEFAULT_ANY_IP;
     int port = DEFAULT_PORT, opt;
-    int num_threads = NUM_THREADS;
+    int num_threads = NUM_THREADS, min_threads = MIN_THREADS;
     int delay = RWLOCK_DELAY;
+    int hash_flags = 0;
+    char *export_path = NULL;
+    size_t compress_min = 0;
+    char *primary = NULL, *colon, *name;
+    int max_conns = 0, conns_per_worker = CONNS_PER_WORKER;
+    int max_inflight = MAX_INFLIGHT;
+    int hot_cache = 0, coalesce = 0;
+    char *trace_path = NULL;
+    char *handoff_path = NULL;
+    char *shm_name = NULL;
+    char *unix_path = NULL;
     /*---------------------------------------------------------------------------*/
     /* free to declare any variables */
-    int listenfd;
-    struct sockaddr_in server_addr;
-    pthread_t *workers;
+    int listenfds[MAX_LISTENERS], nlisteners = 0, ntaken = 0;
+    int has_tcp = 0, has_unix = 0, family;
+    pthread_t poller, acceptors[MAX_LISTENERS];
+    struct thread_args acceptor_args[MAX_LISTENERS];
+    struct server srv;
     struct skvs_ctx *ctx;
-    int i, yes = 1;
+    int i;
     pthread_mutex_t *io_mutex;
+    int handoff_lfd = -1, handoff_fd = -1, handed_over = 0;
+    int *fds = NULL, nfds = 0;
+    struct pollfd pfd;
     /*---------------------------------------------------------------------------*/
 
     /* parse command line options */
-    while ((opt = getopt(argc, argv, "p:t:s:d:h")) != -1)
+    while ((opt = getopt(argc, argv, "p:u:t:w:s:d:ol:e:z:r:c:q:f:kgT:H:m:h")) != -1)
     {
         switch (opt)
         {
         case 'p':
             port = atoi(optarg);
             break;
+        case 'u':
+            unix_path = optarg;
+            break;
         case 't':
             num_threads = atoi(optarg);
             break;
+        case 'w':
+            min_threads = atoi(optarg);
+            break;
         case 's':
             hash_size = atoi(optarg);
             if (hash_size <= 0)
@@ -155,30 +1118,195 @@ int main(int argc, char *argv[])
         case 'd':
             delay = atoi(optarg);
             break;
+        case 'o':
+            hash_flags |= HASH_ORDERED;
+            break;
+        case 'l':
+            if (strcmp(optarg, g_rwlock_policies[RWLOCK_WRITER_PREF]) == 0)
+                hash_flags |= HASH_LOCK_WRITER;
+            else if (strcmp(optarg,
+                            g_rwlock_policies[RWLOCK_PHASE_FAIR]) == 0)
+                hash_flags |= HASH_LOCK_FAIR;
+            else if (strcmp(optarg,
+                            g_rwlock_policies[RWLOCK_READER_PREF]) != 0)
+            {
+                fprintf(stderr, "Invalid lock policy %s, expected reader, "
+                                "writer or fair\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            export_path = optarg;
+            break;
+        case 'z':
+            compress_min = atoi(optarg);
+            break;
+        case 'r':
+            primary = optarg;
+            break;
+        case 'c':
+            max_conns = atoi(optarg);
+            break;
+        case 'q':
+            conns_per_worker = atoi(optarg);
+            if (conns_per_worker <= 0)
+            {
+                perror("Invalid connections per worker");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            max_inflight = atoi(optarg);
+            break;
+        case 'k':
+            hot_cache = 1;
+            break;
+        case 'g':
+            coalesce = 1;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
         case 'h':
         default:
-            printf("Usage: %s [-p port (%d)] "
-                   "[-t num_threads (%d)] "
+            printf("Usage: %s [-p port (%d), 0 for none] "
+                   "[-u unix_path|@name] "
+                   "[-t max_workers (%d)] "
+                   "[-w min_workers (%d)] "
                    "[-d rwlock_delay (%d)] "
-                   "[-s hash_size (%d)]\n",
+                   "[-s hash_size (%d)] "
+                   "[-o (ordered key index)] "
+                   "[-l reader|writer|fair (bucket lock policy, reader)] "
+                   "[-e export_path] "
+                   "[-z compress_min (off)] "
+                   "[-r primary_host:port] "
+                   "[-c max_conns (-q per max worker)] "
+                   "[-q conns_per_worker (%d)] "
+                   "[-f max_inflight_per_conn (%d)] "
+                   "[-k (per-thread caches of hot keys)] "
+                   "[-g (coalesce concurrent READs of a key)] "
+                   "[-T trace_path] "
+                   "[-H handoff_path] "
+                   "[-m shm_name[:size_mb (%d)]]\n",
                    argv[0],
                    DEFAULT_PORT,
                    NUM_THREADS,
+                   MIN_THREADS,
                    RWLOCK_DELAY,
-                   DEFAULT_HASH_SIZE);
+                   DEFAULT_HASH_SIZE,
+                   CONNS_PER_WORKER,
+                   MAX_INFLIGHT,
+                   SHM_DEFAULT_MB);
             exit(EXIT_FAILURE);
         }
     }
 
+    if (port <= 0 && !unix_path)
+    {
+        fprintf(stderr, "Nothing to listen on, give a port or -u\n");
+        exit(EXIT_FAILURE);
+    }
+
     /*---------------------------------------------------------------------------*/
     /* edit here */
     /* Initialize SKVS context */
-    ctx = skvs_init(hash_size, delay);
+    ctx = skvs_init(hash_size, delay, hash_flags);
     if (!ctx)
     {
         perror("skvs_init failed");
         exit(EXIT_FAILURE);
     }
+    ctx->export_path = export_path;
+    ctx->compress_min = compress_min;
+    ctx->hot->cache = hot_cache;
+    ctx->trace_path = trace_path;
+
+    /* Share one table lookup among the READs of a key that run at once */
+    if (coalesce && !(ctx->flights = flight_init()))
+    {
+        perror("flight_init failed");
+        skvs_destroy(ctx, 0);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Mirror the table in shared memory for local readers */
+    if (shm_name)
+    {
+        colon = strrchr(shm_name, ':');
+        if (colon && atoi(colon + 1) <= 0)
+        {
+            fprintf(stderr, "Invalid shared memory size %s\n", colon + 1);
+            skvs_destroy(ctx, 0);
+            exit(EXIT_FAILURE);
+        }
+        /* copy the name out, leaving the command line as it was */
+        name = strndup(shm_name, colon ? colon - shm_name : strlen(shm_name));
+        if (name)
+            ctx->shm = shm_create(ctx->table, name,
+                                  (size_t)(colon ? atoi(colon + 1)
+                                                 : SHM_DEFAULT_MB) << 20);
+        free(name);
+        if (!ctx->shm)
+        {
+            perror("shm_create failed");
+            skvs_destroy(ctx, 0);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Take over from the server at handoff_path, if one runs there: its
+     * table, listening sockets and client connections (the listening
+     * sockets come first) */
+    if (handoff_path && (handoff_fd = handoff_request(handoff_path)) >= 0)
+    {
+        if (skvs_restore(ctx, handoff_fd) < 0 ||
+            handoff_send_msg(handoff_fd, HANDOFF_ACK,
+                             strlen(HANDOFF_ACK)) < 0 ||
+            (nfds = handoff_recv_fds(handoff_fd, &fds)) < 1)
+        {
+            fprintf(stderr, "Handoff from %s failed\n", handoff_path);
+            close(handoff_fd);
+            skvs_destroy(ctx, 0);
+            exit(EXIT_FAILURE);
+        }
+        close(handoff_fd);
+        handoff_fd = -1;
+        while (ntaken < nfds && ntaken < MAX_LISTENERS &&
+               listener_family(fds[ntaken]) >= 0)
+            ntaken++;
+        printf("Took over %zu keys and %d connections\n",
+               ctx->table->total_entries, nfds - ntaken);
+    }
+
+    /* Follow the primary as a read-only replica */
+    if (primary)
+    {
+        colon = strrchr(primary, ':');
+        if (!colon || atoi(colon + 1) <= 0)
+        {
+            fprintf(stderr, "Invalid primary %s, expected host:port\n",
+                    primary);
+            skvs_destroy(ctx, 0);
+            exit(EXIT_FAILURE);
+        }
+        ctx->read_only = 1;
+        name = strndup(primary, colon - primary);
+        if (!name || repl_follow(ctx->repl, name, atoi(colon + 1)) < 0)
+        {
+            perror("repl_follow failed");
+            free(name);
+            skvs_destroy(ctx, 0);
+            exit(EXIT_FAILURE);
+        }
+        printf("Replicating from %s\n", primary);
+        free(name);
+    }
 
     /* Create IO mutex for synchronized printing */
     io_mutex = malloc(sizeof(pthread_mutex_t));
@@ -197,10 +1325,14 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* Block SIGINT initially */
+    /* A peer going away must not kill the server mid-write */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Block SIGINT and SIGUSR1 initially */
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
     if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
     {
         perror("sigprocmask");
@@ -210,99 +1342,173 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* Create socket */
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd < 0)
+    /* Listen on the sockets taken over, then on those asked for that were
+     * not among them */
+    for (i = 0; i < ntaken; i++)
     {
-        perror("socket creation failed");
-        pthread_mutex_destroy(io_mutex);
-        free(io_mutex);
-        skvs_destroy(ctx, 1);
-        exit(EXIT_FAILURE);
+        family = listener_family(fds[i]);
+        has_tcp |= family != AF_UNIX;
+        has_unix |= family == AF_UNIX;
+        listenfds[nlisteners++] = fds[i];
+        printf("Server listening on the %s socket taken over\n",
+               family == AF_UNIX ? "unix" : "tcp");
     }
-
-    /* Set socket options */
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
+    if (port > 0 && !has_tcp)
     {
-        perror("setsockopt");
+        listenfds[nlisteners] = open_listener(ip, port);
+        if (listenfds[nlisteners++] >= 0)
+            printf("Server listening on %s:%d\n", ip, port);
+    }
+    if (unix_path && !has_unix)
+    {
+        listenfds[nlisteners] = open_unix_listener(unix_path);
+        if (listenfds[nlisteners++] >= 0)
+            printf("Server listening on %s\n", unix_path);
+    }
+    for (i = 0; i < nlisteners && listenfds[i] >= 0; i++)
+        ;
+    if (i < nlisteners)
+    {
+        close_listeners(listenfds, nlisteners);
         pthread_mutex_destroy(io_mutex);
         free(io_mutex);
         skvs_destroy(ctx, 1);
         exit(EXIT_FAILURE);
     }
 
-    /* Configure server address */
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-    server_addr.sin_port = htons(port);
+    /* Wait for the next server to take over */
+    if (handoff_path)
+    {
+        handoff_lfd = handoff_listen(handoff_path);
+        if (handoff_lfd < 0)
+        {
+            perror("handoff_listen failed");
+            close_listeners(listenfds, nlisteners);
+            pthread_mutex_destroy(io_mutex);
+            free(io_mutex);
+            skvs_destroy(ctx, 1);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    /* Bind */
-    if (bind(listenfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    /* SIGUSR2 only interrupts a thread, so that it sees the shutdown */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handle_wakeup;
+    if (sigaction(SIGUSR2, &sa, NULL) == -1)
     {
-        perror("bind failed");
+        perror("sigaction");
+        if (handoff_lfd >= 0)
+            close(handoff_lfd);
+        close_listeners(listenfds, nlisteners);
         pthread_mutex_destroy(io_mutex);
         free(io_mutex);
         skvs_destroy(ctx, 1);
         exit(EXIT_FAILURE);
     }
 
-    /* Listen */
-    if (listen(listenfd, NUM_BACKLOG) < 0)
+    /* Workers, min_threads of them to begin with, run the connections
+     * the poller finds ready */
+    memset(&srv, 0, sizeof(srv));
+    srv.ctx = ctx;
+    srv.delay = delay;
+    srv.max_inflight = max_inflight;
+    srv.accepting = 1;
+    srv.min_workers = min_threads;
+    pthread_mutex_init(&srv.lock, NULL);
+    srv.epfd = epoll_create1(0);
+    if (srv.epfd >= 0)
+        srv.pool = pool_init(min_threads, num_threads, conn_run, conn_worker,
+                             &srv);
+    if (!srv.pool)
     {
-        perror("listen failed");
+        perror("pool_init failed");
+        if (srv.epfd >= 0)
+            close(srv.epfd);
+        pthread_mutex_destroy(&srv.lock);
+        if (handoff_lfd >= 0)
+            close(handoff_lfd);
+        close_listeners(listenfds, nlisteners);
         pthread_mutex_destroy(io_mutex);
         free(io_mutex);
         skvs_destroy(ctx, 1);
         exit(EXIT_FAILURE);
     }
-    else
-    {
-        printf("Server listening on %s:%d\n", ip, port);
-    }
+    ctx->pool = srv.pool;
+    if (max_conns == 0)
+        max_conns = num_threads * conns_per_worker;
 
-    /* Create worker threads */
-    workers = malloc(sizeof(pthread_t) * num_threads);
-    if (!workers)
+    if (pthread_create(&poller, NULL, poll_clients, &srv) != 0)
     {
-        perror("malloc failed");
+        perror("pthread_create failed");
+        for (i = ntaken; i < nfds; i++)
+            close(fds[i]);
+        free(fds);
+        ctx->pool = NULL;
+        pool_destroy(srv.pool);
+        close(srv.epfd);
+        pthread_mutex_destroy(&srv.lock);
+        if (handoff_lfd >= 0)
+            close(handoff_lfd);
+        close_listeners(listenfds, nlisteners);
         pthread_mutex_destroy(io_mutex);
         free(io_mutex);
         skvs_destroy(ctx, 1);
         exit(EXIT_FAILURE);
     }
 
-    /* Start worker threads */
-    for (i = 0; i < num_threads; i++)
+    /* Connections taken over are served first */
+    for (i = ntaken; i < nfds; i++)
     {
-        struct thread_args *args = malloc(sizeof(struct thread_args));
-        if (!args)
+        ctx->conns++;
+        if (conn_open(&srv, fds[i]) < 0)
         {
-            perror("malloc failed");
-            free(workers);
-            skvs_destroy(ctx, 1);
-            exit(EXIT_FAILURE);
+            close(fds[i]);
+            ctx->conns--;
         }
-        args->listenfd = listenfd;
-        args->idx = i;
-        args->ctx = ctx;
-        args->delay = delay;
+    }
+    free(fds);
+    nfds = 0;
 
-        if (pthread_create(&workers[i], NULL, handle_client, args) != 0)
+    /* Start an acceptor per listening socket */
+    for (i = 0; i < nlisteners; i++)
+    {
+        memset(&acceptor_args[i], 0, sizeof(acceptor_args[i]));
+        acceptor_args[i].listenfd = listenfds[i];
+        acceptor_args[i].idx = i;
+        acceptor_args[i].ctx = ctx;
+        acceptor_args[i].srv = &srv;
+        acceptor_args[i].max_conns = max_conns;
+        if (pthread_create(&acceptors[i], NULL, accept_client,
+                           &acceptor_args[i]) != 0)
         {
+            /* stop the acceptors started, the connections and the
+             * poller, then the workers */
             perror("pthread_create failed");
-            free(args);
-            free(workers);
+            g_shutdown = 1;
+            while (i-- > 0)
+            {
+                shutdown(listenfds[i], SHUT_RDWR);
+                pthread_join(acceptors[i], NULL);
+            }
+            stop_poller(&srv, poller);
+            ctx->pool = NULL;
+            pool_destroy(srv.pool);
+            close(srv.epfd);
+            pthread_mutex_destroy(&srv.lock);
+            if (handoff_lfd >= 0)
+                close(handoff_lfd);
+            close_listeners(listenfds, nlisteners);
+            pthread_mutex_destroy(io_mutex);
+            free(io_mutex);
             skvs_destroy(ctx, 1);
             exit(EXIT_FAILURE);
         }
     }
 
     /* Set up signal handler after threads are created */
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
     sa.sa_handler = handle_sigint;
-    sigemptyset(&sa.sa_mask);
     if (sigaction(SIGINT, &sa, NULL) == -1)
     {
         perror("sigaction");
@@ -312,7 +1518,17 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* Unblock SIGINT in main thread */
+    sa.sa_handler = handle_sigusr1;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        pthread_mutex_destroy(io_mutex);
+        free(io_mutex);
+        skvs_destroy(ctx, 1);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Unblock SIGINT and SIGUSR1 in main thread */
     if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
     {
         perror("sigprocmask");
@@ -322,17 +1538,98 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* Wait for shutdown signal */
-    pause();
+    /* Wait for shutdown signal or a handoff request, exporting on SIGUSR1
+     * meanwhile */
+    while (!g_shutdown)
+    {
+        if (handoff_lfd >= 0)
+        {
+            pfd.fd = handoff_lfd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, -1) == 1 &&
+                (handoff_fd = handoff_accept(handoff_lfd)) >= 0)
+            {
+                printf("Handing over to a new server...\n");
+                srv.deadline = time(NULL) + SEND_TIMEOUT;
+                g_handoff = 1;
+                g_shutdown = 1;
+            }
+        }
+        else
+        {
+            pause();
+        }
+        if (g_export)
+        {
+            g_export = 0;
+            if (skvs_export(ctx) < 0)
+            {
+                perror("export failed");
+            }
+            else
+            {
+                printf("Exported to %s\n", export_path);
+            }
+        }
+    }
+
+    /* Force shutdown after first SIGINT. at a handoff, the listening
+     * sockets stay open; connections wait in their backlogs meanwhile */
+    if (g_handoff)
+        close(handoff_lfd);
+    for (i = 0; i < nlisteners; i++)
+    {
+        if (g_handoff)
+        {
+            stop_acceptor(acceptors[i]);
+            continue;
+        }
+        unlink_listener(listenfds[i]);
+        shutdown(listenfds[i], SHUT_RDWR);
+        close(listenfds[i]);
+        pthread_join(acceptors[i], NULL);
+    }
 
-    /* Force shutdown after first SIGINT */
-    shutdown(listenfd, SHUT_RDWR);
-    close(listenfd);
+    /* Wait for the poller to see every connection closed, or at a
+     * handoff left to the next server, and then for the workers */
+    stop_poller(&srv, poller);
+    ctx->pool = NULL;
+    pool_destroy(srv.pool);
+    close(srv.epfd);
+    fds = g_handoff ? malloc(sizeof(int) * (nlisteners + srv.nhanded)) : NULL;
+    for (i = 0; fds && i < nlisteners; i++)
+        fds[nfds++] = listenfds[i];
+    for (i = 0; i < srv.nhanded; i++)
+    {
+        if (fds)
+            fds[nfds++] = srv.handed[i];
+        else
+            close(srv.handed[i]);
+    }
+    free(srv.handed);
 
-    /* Wait for threads to finish */
-    for (i = 0; i < num_threads; i++)
+    /* Hand the table over, and once it is loaded, the sockets */
+    if (g_handoff)
     {
-        pthread_join(workers[i], NULL);
+        if (fds && skvs_snapshot(ctx, handoff_fd) == 0 &&
+            handoff_expect_msg(handoff_fd, HANDOFF_ACK,
+                               strlen(HANDOFF_ACK)) == 0 &&
+            handoff_send_fds(handoff_fd, fds, nfds) == 0)
+        {
+            printf("Handed over %zu keys and %d connections\n",
+                   ctx->table->total_entries, nfds - nlisteners);
+            handed_over = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Handoff failed, shutting down\n");
+        }
+        close(handoff_fd);
+        for (i = nlisteners; i < nfds; i++)
+            close(fds[i]);
+        free(fds);
+        for (i = 0; i < nlisteners; i++)
+            close(listenfds[i]);
     }
 
     /* Clean up - only call hash_dump once under g_shutdown */
@@ -342,11 +1639,10 @@ int main(int argc, char *argv[])
         fflush(stdout);
     }
 
-    close(listenfd);
-    free(workers);
+    pthread_mutex_destroy(&srv.lock);
     pthread_mutex_destroy(io_mutex);
     free(io_mutex);
-    skvs_destroy(ctx, 1);
+    skvs_destroy(ctx, !handed_over);
     /*---------------------------------------------------------------------------*/
 
     return 0;
@@ -0,0 +1,347 @@
+/*---------------------------------------------------------------------------*/
+/* shm.c                                                                     */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashtable.h"
+#include "shm.h"
+/*---------------------------------------------------------------------------*/
+#define ALIGN64(n) (((n) + 63) & ~(uint64_t)63)
+/*---------------------------------------------------------------------------*/
+static inline struct shm_node *
+node_at(struct shm_mirror *m, uint32_t ref)
+{
+    return &m->nodes[ref - 1];
+}
+/*---------------------------------------------------------------------------*/
+/* the block size class of a value of size bytes */
+static int
+class_of(size_t size)
+{
+    int c = SHM_MIN_CLASS;
+
+    while (((size_t)1 << c) < size)
+    {
+        c++;
+    }
+
+    return c;
+}
+/*---------------------------------------------------------------------------*/
+/* returns the offset of a free block of class c, or 0 when none is left */
+static uint64_t
+alloc_block(struct shm_mirror *m, int c)
+{
+    uint64_t off = 0, *head = &m->free_blocks[c - SHM_MIN_CLASS];
+
+    pthread_mutex_lock(&m->alloc_lock);
+    if (*head)
+    {
+        off = *head;
+        memcpy(head, m->base + off, sizeof(off));
+    }
+    else if (m->arena_used + ((uint64_t)1 << c) <= m->hdr->arena_size)
+    {
+        off = m->hdr->arena_off + m->arena_used;
+        m->arena_used += (uint64_t)1 << c;
+    }
+    pthread_mutex_unlock(&m->alloc_lock);
+
+    return off;
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_block(struct shm_mirror *m, uint64_t off, int c)
+{
+    uint64_t *head = &m->free_blocks[c - SHM_MIN_CLASS];
+
+    pthread_mutex_lock(&m->alloc_lock);
+    memcpy(m->base + off, head, sizeof(off));
+    *head = off;
+    pthread_mutex_unlock(&m->alloc_lock);
+}
+/*---------------------------------------------------------------------------*/
+/* returns a free node reference, or 0 when none is left */
+static uint32_t
+alloc_node(struct shm_mirror *m)
+{
+    uint32_t ref = 0;
+
+    pthread_mutex_lock(&m->alloc_lock);
+    if (m->free_nodes)
+    {
+        ref = m->free_nodes;
+        m->free_nodes = node_at(m, ref)->next;
+    }
+    else if (m->used_nodes < m->hdr->nnodes)
+    {
+        ref = ++m->used_nodes;
+    }
+    pthread_mutex_unlock(&m->alloc_lock);
+
+    return ref;
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_node(struct shm_mirror *m, uint32_t ref)
+{
+    pthread_mutex_lock(&m->alloc_lock);
+    node_at(m, ref)->next = m->free_nodes;
+    m->free_nodes = ref;
+    pthread_mutex_unlock(&m->alloc_lock);
+}
+/*---------------------------------------------------------------------------*/
+/* copies the value of node into n, or marks n unmirrored when it does not
+ * fit; caller is inside the write section of the bucket of n */
+static void
+set_value(struct shm_mirror *m, struct shm_node *n, const node_t *node)
+{
+    int c = class_of(node->value_size);
+
+    if (n->value_off && n->value_class != c)
+    {
+        free_block(m, n->value_off, n->value_class);
+        n->value_off = 0;
+    }
+    if (n->value_off == 0 && node->value_size <= SHM_VALUE_MAX)
+    {
+        n->value_off = alloc_block(m, c);
+        n->value_class = c;
+    }
+
+    n->flags = node->flags & NODE_COMPRESSED;
+    n->value_size = node->value_size;
+    n->version = node->version;
+    if (n->value_off)
+    {
+        memcpy(m->base + n->value_off, node->value, node->value_size);
+    }
+    else
+    {
+        n->flags |= SHM_UNMIRRORED;
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* the mutation hook of the table, applies the change to the mirror */
+static void
+shm_update(void *arg, int op, const node_t *node)
+{
+    struct shm_mirror *m = arg;
+    uint32_t b = shm_hash(node->key) & (m->hdr->nbuckets - 1);
+    struct shm_bucket *bucket = &m->buckets[b];
+    pthread_mutex_t *lock = &m->locks[b % SHM_WRITE_LOCKS];
+    uint32_t *link, ref;
+    struct shm_node *n = NULL;
+
+    pthread_mutex_lock(lock);
+    __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (link = &bucket->head; *link; link = &node_at(m, *link)->next)
+    {
+        n = node_at(m, *link);
+        if (n->key_size == node->key_size &&
+            memcmp(n->key, node->key, node->key_size) == 0)
+        {
+            break;
+        }
+    }
+    ref = *link;
+
+    if (op == HASH_OP_DELETE)
+    {
+        if (ref)
+        {
+            *link = n->next;
+            if (n->value_off)
+            {
+                free_block(m, n->value_off, n->value_class);
+                n->value_off = 0;
+            }
+            free_node(m, ref);
+            __atomic_sub_fetch(&m->hdr->entries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else if (ref)
+    {
+        set_value(m, n, node);
+    }
+    else if ((ref = alloc_node(m)) != 0)
+    {
+        n = node_at(m, ref);
+        n->key_size = node->key_size;
+        memcpy(n->key, node->key, node->key_size);
+        n->key[node->key_size] = '\0';
+        n->value_off = 0;
+        set_value(m, n, node);
+        n->next = bucket->head;
+        bucket->head = ref;
+        __atomic_add_fetch(&m->hdr->entries, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        /* the key cannot be mirrored, so a miss proves nothing anymore */
+        __atomic_store_n(&m->hdr->incomplete, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(lock);
+}
+/*---------------------------------------------------------------------------*/
+struct shm_mirror *
+shm_create(struct hashtable_t *table, const char *name, size_t size)
+{
+    TRACE_PRINT();
+    struct shm_mirror *m = calloc(1, sizeof(struct shm_mirror));
+    struct shm_header *hdr;
+    uint64_t nnodes, nbuckets = 1, off;
+    int i;
+
+    if (m == NULL)
+    {
+        return NULL;
+    }
+    m->table = table;
+    m->fd = -1;
+    m->base = MAP_FAILED;
+    if (snprintf(m->name, sizeof(m->name), "%s%s", name[0] == '/' ? "" : "/",
+                 name) >= (int)sizeof(m->name))
+    {
+        goto fail;
+    }
+
+    /* lay the region out */
+    nnodes = size / SHM_NODE_BYTES;
+    if (nnodes > UINT32_MAX / 2)
+    {
+        nnodes = UINT32_MAX / 2;
+    }
+    while (nbuckets < nnodes)
+    {
+        nbuckets <<= 1;
+    }
+    off = ALIGN64(sizeof(struct shm_header));
+    off = ALIGN64(off + nbuckets * sizeof(struct shm_bucket));
+    off = ALIGN64(off + nnodes * sizeof(struct shm_node));
+    if (nnodes == 0 || off + ((uint64_t)1 << SHM_MIN_CLASS) > size)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    shm_unlink(m->name);
+    m->fd = shm_open(m->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (m->fd < 0 || ftruncate(m->fd, size) < 0)
+    {
+        goto fail;
+    }
+    m->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->base == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    hdr = m->hdr = (struct shm_header *)m->base;
+    hdr->format = SHM_FORMAT;
+    hdr->size = size;
+    hdr->nbuckets = nbuckets;
+    hdr->nnodes = nnodes;
+    hdr->buckets_off = ALIGN64(sizeof(struct shm_header));
+    hdr->nodes_off =
+        ALIGN64(hdr->buckets_off + nbuckets * sizeof(struct shm_bucket));
+    hdr->arena_off = ALIGN64(hdr->nodes_off + nnodes * sizeof(struct shm_node));
+    hdr->arena_size = size - hdr->arena_off;
+    m->buckets = (struct shm_bucket *)(m->base + hdr->buckets_off);
+    m->nodes = (struct shm_node *)(m->base + hdr->nodes_off);
+
+    for (i = 0; i < SHM_WRITE_LOCKS; i++)
+    {
+        pthread_mutex_init(&m->locks[i], NULL);
+    }
+    pthread_mutex_init(&m->alloc_lock, NULL);
+    if (hash_add_hook(table, shm_update, m) < 0)
+    {
+        for (i = 0; i < SHM_WRITE_LOCKS; i++)
+        {
+            pthread_mutex_destroy(&m->locks[i]);
+        }
+        pthread_mutex_destroy(&m->alloc_lock);
+        goto fail;
+    }
+
+    /* readers check the magic last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+
+    return m;
+
+fail:
+    if (m->base != MAP_FAILED)
+    {
+        munmap(m->base, size);
+    }
+    if (m->fd >= 0)
+    {
+        close(m->fd);
+        shm_unlink(m->name);
+    }
+    free(m);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+void shm_destroy(struct shm_mirror *m)
+{
+    TRACE_PRINT();
+    struct stat ours, named;
+    int fd, i;
+
+    hash_remove_hook(m->table, shm_update, m);
+    __atomic_store_n(&m->hdr->closed, 1, __ATOMIC_RELEASE);
+
+    /* a server that took over may have created the name anew */
+    fd = shm_open(m->name, O_RDONLY, 0);
+    if (fd >= 0)
+    {
+        if (fstat(m->fd, &ours) == 0 && fstat(fd, &named) == 0 &&
+            ours.st_dev == named.st_dev && ours.st_ino == named.st_ino)
+        {
+            shm_unlink(m->name);
+        }
+        close(fd);
+    }
+
+    munmap(m->base, m->hdr->size);
+    close(m->fd);
+    for (i = 0; i < SHM_WRITE_LOCKS; i++)
+    {
+        pthread_mutex_destroy(&m->locks[i]);
+    }
+    pthread_mutex_destroy(&m->alloc_lock);
+    free(m);
+}
+/*---------------------------------------------------------------------------*/
+int shm_stats(struct shm_mirror *m, char *buf, size_t len)
+{
+    uint32_t used;
+    uint64_t arena_used;
+    int n;
+
+    pthread_mutex_lock(&m->alloc_lock);
+    used = m->used_nodes;
+    arena_used = m->arena_used;
+    pthread_mutex_unlock(&m->alloc_lock);
+
+    n = snprintf(buf, len,
+                 " shm=%s shm_entries=%" PRIu64 " shm_nodes=%" PRIu32
+                 "/%" PRIu32 " shm_arena=%" PRIu64 "/%" PRIu64
+                 " shm_incomplete=%" PRIu32,
+                 m->name, __atomic_load_n(&m->hdr->entries, __ATOMIC_RELAXED),
+                 used, m->hdr->nnodes, arena_used, m->hdr->arena_size,
+                 __atomic_load_n(&m->hdr->incomplete, __ATOMIC_RELAXED));
+
+    return n < len ? n : len - 1;
+}
+/*---------------------------------------------------------------------------*/
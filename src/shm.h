@@ -0,0 +1,141 @@
+/*---------------------------------------------------------------------------*/
+/* shm.h                                                                     */
+/*---------------------------------------------------------------------------*/
+#ifndef _SHM_H
+#define _SHM_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* a read-only mirror of the table in a named shared-memory region, for
+ * processes on the same host to read without a round trip to the server.
+ *
+ * the server keeps the mirror up to date from its mutation hook, and is
+ * its only writer. the region holds no pointers, only offsets from its
+ * start and node indices, so every process can map it anywhere.
+ *
+ *   header | buckets | nodes | value arena
+ *
+ * a bucket is a sequence counter and the head of a chain of nodes. a
+ * writer makes the counter odd while it changes anything reachable from
+ * the bucket, including freeing the nodes and values of the bucket, and
+ * even again when done. a reader copies what it needs and retries when
+ * the counter was odd or has moved meanwhile (a seqlock), so it never
+ * blocks the server and never returns a torn value.
+ *
+ * values go in blocks of power-of-two sizes carved from the arena. a key
+ * whose value does not fit (over SHM_VALUE_MAX, or the arena is full) is
+ * kept with SHM_UNMIRRORED, so readers ask the server for it. when not
+ * even the key fits, the header is marked incomplete, and readers no
+ * longer trust a miss. */
+#define SHM_MAGIC "SKSM"
+#define SHM_FORMAT 1
+#define SHM_DEFAULT_MB 64          // region size unless given
+#define SHM_NODE_BYTES 256         // region bytes per node when sizing
+#define SHM_VALUE_MAX (64 << 10)   // largest value mirrored
+#define SHM_MIN_CLASS 4            // smallest value block, 1 << 4 bytes
+#define SHM_NCLASSES 13            // value blocks of 16 B .. 64 KiB
+#define SHM_WRITE_LOCKS 64         // writer locks, striped over buckets
+#define SHM_RETRIES 1000           // reader attempts before giving up
+/* node flags, next to NODE_COMPRESSED */
+#define SHM_UNMIRRORED 0x8000 // the value is only on the server
+/*---------------------------------------------------------------------------*/
+struct shm_header
+{
+    char magic[4]; // SHM_MAGIC, written last
+    uint32_t format;
+    uint64_t size; // bytes in the region
+    uint32_t nbuckets; // a power of two
+    uint32_t nnodes;
+    uint64_t buckets_off;
+    uint64_t nodes_off;
+    uint64_t arena_off;
+    uint64_t arena_size;
+    uint64_t entries;    // keys in the mirror
+    uint32_t incomplete; // keys were left out, a miss proves nothing
+    uint32_t closed;     // the server let go of the region
+};
+/*---------------------------------------------------------------------------*/
+struct shm_bucket
+{
+    uint32_t seq;  // odd while a writer changes the bucket
+    uint32_t head; // node index + 1, 0 when empty
+};
+/*---------------------------------------------------------------------------*/
+struct shm_node
+{
+    uint32_t next;        // node index + 1, 0 at the end of the chain
+    uint16_t key_size;
+    uint16_t flags;       // NODE_COMPRESSED, SHM_UNMIRRORED
+    uint32_t value_size;  // as stored by the table
+    uint32_t value_class; // log2 of the value block size
+    uint64_t value_off;   // 0 when there is no value block
+    uint64_t version;
+    char key[MAX_KEY_LEN + 1];
+};
+/*---------------------------------------------------------------------------*/
+/* 64-bit FNV-1a, which places keys in buckets on both sides */
+static inline uint64_t
+shm_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+/* the writer side, kept by the server */
+struct hashtable_t;
+struct shm_mirror
+{
+    struct hashtable_t *table;
+    char name[NAME_MAX];
+    int fd;
+    char *base; // the mapped region
+    struct shm_header *hdr;
+    struct shm_bucket *buckets;
+    struct shm_node *nodes;
+    pthread_mutex_t locks[SHM_WRITE_LOCKS];
+
+    /* allocation, under alloc_lock */
+    pthread_mutex_t alloc_lock;
+    uint32_t free_nodes;                 // node index + 1, chained by next
+    uint32_t used_nodes;                 // nodes ever handed out
+    uint64_t free_blocks[SHM_NCLASSES];  // offsets, chained in the blocks
+    uint64_t arena_used;                 // bytes of the arena carved out
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * creates the shared-memory region name (a leading '/' is added when
+ * missing) of size bytes, replacing a stale one, and hooks it to table
+ * so that it mirrors every change from now on.
+ * must be called before the table is shared between threads.
+ * returns NULL when any internal errors occur.
+ */
+struct shm_mirror *shm_create(struct hashtable_t *table, const char *name,
+                              size_t size);
+/*---------------------------------------------------------------------------*/
+/**
+ * unhooks the mirror, marks the region closed for its readers, and
+ * removes its name unless a newer region took it over.
+ */
+void shm_destroy(struct shm_mirror *m);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes mirror status as " key=value" pairs into buf.
+ * returns the number of bytes written (null-terminated).
+ */
+int shm_stats(struct shm_mirror *m, char *buf, size_t len);
+/*---------------------------------------------------------------------------*/
+#endif // _SHM_H
@@ -0,0 +1,449 @@
+/*---------------------------------------------------------------------------*/
+/* skiplist.c                                                                */
+/*---------------------------------------------------------------------------*/
+#include "skiplist.h"
+/*---------------------------------------------------------------------------*/
+/* draws a level with p = 1/4 from a per-thread xorshift generator */
+static inline int
+random_level(void)
+{
+    static __thread unsigned int seed = 0;
+    int level = 1;
+
+    if (seed == 0)
+    {
+        seed = (unsigned int)(uintptr_t)&seed | 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    for (unsigned int r = seed; (r & 3) == 0 && level < SKIPLIST_MAX_LEVEL;
+         r >>= 2)
+    {
+        level++;
+    }
+
+    return level;
+}
+/*---------------------------------------------------------------------------*/
+static inline sl_node_t *
+node_alloc(const char *key, int level)
+{
+    sl_node_t *node = calloc(1, sizeof(sl_node_t) + level * sizeof(sl_node_t *));
+    if (!node)
+    {
+        return NULL;
+    }
+    if (key)
+    {
+        strncpy(node->key, key, MAX_KEY_LEN);
+    }
+    node->level = level;
+    if (pthread_mutex_init(&node->lock, NULL) != 0)
+    {
+        free(node);
+        return NULL;
+    }
+
+    return node;
+}
+/*---------------------------------------------------------------------------*/
+static inline void
+node_free(sl_node_t *node)
+{
+    pthread_mutex_destroy(&node->lock);
+    free(node);
+}
+/*---------------------------------------------------------------------------*/
+static inline sl_node_t *
+next_of(sl_node_t *node, int level)
+{
+    return __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+}
+/*---------------------------------------------------------------------------*/
+static inline int
+is_marked(sl_node_t *node)
+{
+    return __atomic_load_n(&node->marked, __ATOMIC_ACQUIRE);
+}
+/*---------------------------------------------------------------------------*/
+static inline int
+is_linked(sl_node_t *node)
+{
+    return __atomic_load_n(&node->linked, __ATOMIC_ACQUIRE);
+}
+/*---------------------------------------------------------------------------*/
+/* enters the current epoch, so that the nodes reachable now stay allocated
+ * until epoch_leave().
+ * returns the epoch entered. */
+static uint64_t
+epoch_enter(skiplist_t *sl)
+{
+    uint64_t epoch;
+
+    while (1)
+    {
+        epoch = __atomic_load_n(&sl->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&sl->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sl->epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+            return epoch;
+        }
+        /* it moved on meanwhile, and may be freeing what it left behind */
+        __atomic_sub_fetch(&sl->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+    }
+}
+/*---------------------------------------------------------------------------*/
+static void
+epoch_leave(skiplist_t *sl, uint64_t epoch)
+{
+    __atomic_sub_fetch(&sl->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+}
+/*---------------------------------------------------------------------------*/
+/* queues the unlinked node to be freed, and advances the epoch when nobody
+ * is left in the previous one. what was unlinked two epochs ago is then out
+ * of every search's reach, and is freed. called outside any epoch. */
+static void
+epoch_retire(skiplist_t *sl, sl_node_t *node)
+{
+    sl_node_t *expired = NULL, *tmp;
+    uint64_t epoch;
+
+    pthread_mutex_lock(&sl->limbo_lock);
+    epoch = __atomic_load_n(&sl->epoch, __ATOMIC_SEQ_CST);
+    node->retired = sl->limbo[epoch % 3];
+    sl->limbo[epoch % 3] = node;
+    if (__atomic_load_n(&sl->active[(epoch + 2) % 3], __ATOMIC_SEQ_CST) == 0)
+    {
+        expired = sl->limbo[(epoch + 1) % 3];
+        sl->limbo[(epoch + 1) % 3] = NULL;
+        __atomic_store_n(&sl->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&sl->limbo_lock);
+
+    while (expired)
+    {
+        tmp = expired;
+        expired = expired->retired;
+        node_free(tmp);
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* fills preds[] and succs[] with the nodes around key on every level,
+ * without locks; caller is inside an epoch.
+ * returns the highest level key was found on, or -1. */
+static int
+find(skiplist_t *sl, const char *key, sl_node_t **preds, sl_node_t **succs)
+{
+    sl_node_t *pred = sl->head, *curr;
+    int i, found = -1;
+
+    for (i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--)
+    {
+        curr = next_of(pred, i);
+        while (curr && strcmp(curr->key, key) < 0)
+        {
+            pred = curr;
+            curr = next_of(pred, i);
+        }
+        if (found < 0 && curr && strcmp(curr->key, key) == 0)
+        {
+            found = i;
+        }
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+
+    return found;
+}
+/*---------------------------------------------------------------------------*/
+/* locks the preds of the levels below level, lowest level first, which is
+ * in descending key order as every path here takes them, and checks that
+ * each is still live and followed by its succ (unmarked as well, unless
+ * deleting it).
+ * returns 1 when all are valid, 0 otherwise; *locked tells how many levels
+ * to unlock_preds() either way. */
+static int
+lock_preds(sl_node_t **preds, sl_node_t **succs, int level, int deleting,
+           int *locked)
+{
+    sl_node_t *prev = NULL;
+    int i, valid = 1;
+
+    for (i = 0; valid && i < level; i++)
+    {
+        if (preds[i] != prev)
+        {
+            pthread_mutex_lock(&preds[i]->lock);
+            prev = preds[i];
+        }
+        *locked = i + 1;
+        valid = !is_marked(preds[i]) &&
+                (deleting || !succs[i] || !is_marked(succs[i])) &&
+                next_of(preds[i], i) == succs[i];
+    }
+
+    return valid;
+}
+/*---------------------------------------------------------------------------*/
+static void
+unlock_preds(sl_node_t **preds, int locked)
+{
+    sl_node_t *prev = NULL;
+    int i;
+
+    for (i = 0; i < locked; i++)
+    {
+        if (preds[i] != prev)
+        {
+            pthread_mutex_unlock(&preds[i]->lock);
+            prev = preds[i];
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+skiplist_t *skiplist_init(void)
+{
+    TRACE_PRINT();
+    skiplist_t *sl = calloc(1, sizeof(skiplist_t));
+
+    if (!sl)
+    {
+        DEBUG_PRINT("Failed to allocate memory for skip list");
+        return NULL;
+    }
+
+    sl->head = node_alloc(NULL, SKIPLIST_MAX_LEVEL);
+    if (!sl->head)
+    {
+        free(sl);
+        return NULL;
+    }
+    sl->head->linked = 1;
+
+    if (pthread_mutex_init(&sl->limbo_lock, NULL) != 0)
+    {
+        DEBUG_PRINT("Failed to initialize skip list lock");
+        node_free(sl->head);
+        free(sl);
+        return NULL;
+    }
+
+    return sl;
+}
+/*---------------------------------------------------------------------------*/
+void skiplist_destroy(skiplist_t *sl)
+{
+    TRACE_PRINT();
+    sl_node_t *node, *tmp;
+    int i;
+
+    node = sl->head;
+    while (node)
+    {
+        tmp = node;
+        node = node->next[0];
+        node_free(tmp);
+    }
+    for (i = 0; i < 3; i++)
+    {
+        node = sl->limbo[i];
+        while (node)
+        {
+            tmp = node;
+            node = node->retired;
+            node_free(tmp);
+        }
+    }
+    pthread_mutex_destroy(&sl->limbo_lock);
+    free(sl);
+}
+/*---------------------------------------------------------------------------*/
+int skiplist_insert(skiplist_t *sl, const char *key)
+{
+    TRACE_PRINT();
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    sl_node_t *node, *found;
+    int i, level = random_level(), locked, ret = 1;
+    uint64_t epoch;
+
+    /* allocate outside the locks */
+    node = node_alloc(key, level);
+    if (!node)
+    {
+        return -1;
+    }
+
+    epoch = epoch_enter(sl);
+    while (1)
+    {
+        i = find(sl, key, preds, succs);
+        if (i >= 0)
+        {
+            found = succs[i];
+            if (!is_marked(found))
+            {
+                /* wait until it is in for good, then report it */
+                while (!is_linked(found))
+                    ;
+                ret = 0;
+                break;
+            }
+            continue; // on its way out, try again once it is unlinked
+        }
+
+        locked = 0;
+        if (!lock_preds(preds, succs, level, 0, &locked))
+        {
+            unlock_preds(preds, locked);
+            continue;
+        }
+        for (i = 0; i < level; i++)
+        {
+            node->next[i] = succs[i];
+        }
+        for (i = 0; i < level; i++)
+        {
+            __atomic_store_n(&preds[i]->next[i], node, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&node->linked, 1, __ATOMIC_RELEASE);
+        unlock_preds(preds, locked);
+        break;
+    }
+    epoch_leave(sl, epoch);
+
+    if (ret == 0)
+    {
+        node_free(node);
+        return 0;
+    }
+    __atomic_add_fetch(&sl->count, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+int skiplist_delete(skiplist_t *sl, const char *key)
+{
+    TRACE_PRINT();
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    sl_node_t *victim = NULL;
+    int i, level = 0, locked, ret = 0;
+    uint64_t epoch;
+
+    epoch = epoch_enter(sl);
+    while (1)
+    {
+        i = find(sl, key, preds, succs);
+        if (victim == NULL)
+        {
+            /* only a node found on its top level is fully linked and
+             * final, other ones are still being inserted */
+            if (i < 0 || !is_linked(succs[i]) || succs[i]->level - 1 != i ||
+                is_marked(succs[i]))
+            {
+                break;
+            }
+            victim = succs[i];
+            level = victim->level;
+            pthread_mutex_lock(&victim->lock);
+            if (is_marked(victim))
+            {
+                /* another delete got it first */
+                pthread_mutex_unlock(&victim->lock);
+                victim = NULL;
+                break;
+            }
+            __atomic_store_n(&victim->marked, 1, __ATOMIC_RELEASE);
+        }
+
+        for (i = 0; i < level; i++)
+        {
+            succs[i] = victim;
+        }
+        locked = 0;
+        if (!lock_preds(preds, succs, level, 1, &locked))
+        {
+            unlock_preds(preds, locked);
+            continue;
+        }
+        for (i = level - 1; i >= 0; i--)
+        {
+            __atomic_store_n(&preds[i]->next[i], victim->next[i],
+                             __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&victim->lock);
+        unlock_preds(preds, locked);
+        ret = 1;
+        break;
+    }
+    epoch_leave(sl, epoch);
+
+    if (ret)
+    {
+        __atomic_sub_fetch(&sl->count, 1, __ATOMIC_RELAXED);
+        epoch_retire(sl, victim);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+int skiplist_scan(skiplist_t *sl, const char *start, skiplist_fn fn, void *arg)
+{
+    TRACE_PRINT();
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    char keys[SKIPLIST_SCAN_BATCH][MAX_KEY_LEN + 1];
+    char from[MAX_KEY_LEN + 1];
+    sl_node_t *node;
+    int i, n, visited, after = 0, ret;
+    uint64_t epoch;
+
+    if (start)
+    {
+        strncpy(from, start, MAX_KEY_LEN);
+        from[MAX_KEY_LEN] = '\0';
+    }
+
+    do
+    {
+        /* copy out a batch of keys from where the last one stopped */
+        epoch = epoch_enter(sl);
+        if (start || after)
+        {
+            find(sl, from, preds, succs);
+            node = succs[0];
+        }
+        else
+        {
+            node = next_of(sl->head, 0);
+        }
+        if (node && after && strcmp(node->key, from) == 0)
+        {
+            node = next_of(node, 0);
+        }
+        for (n = 0, visited = 0; node && visited < SKIPLIST_SCAN_BATCH;
+             visited++)
+        {
+            if (is_linked(node) && !is_marked(node))
+            {
+                memcpy(keys[n++], node->key, MAX_KEY_LEN + 1);
+            }
+            memcpy(from, node->key, MAX_KEY_LEN + 1);
+            node = next_of(node, 0);
+        }
+        epoch_leave(sl, epoch);
+        after = 1;
+
+        for (i = 0; i < n; i++)
+        {
+            ret = fn(arg, keys[i]);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+    } while (node);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
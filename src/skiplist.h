@@ -0,0 +1,84 @@
+/*---------------------------------------------------------------------------*/
+/* skiplist.h                                                                */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKIPLIST_H
+#define _SKIPLIST_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* a lazy concurrent skip list: searches and scans take no locks. an insert
+ * or delete locks only the nodes it links around, and a node is marked
+ * deleted before it is unlinked. unlinked nodes wait in a limbo list until
+ * two epochs later, when no search can still be on them. */
+#define SKIPLIST_MAX_LEVEL 16
+#define SKIPLIST_SCAN_BATCH 64 // nodes a scan visits per epoch
+/*---------------------------------------------------------------------------*/
+typedef struct sl_node_t
+{
+    char key[MAX_KEY_LEN + 1];
+    int level;
+    int marked; // deleted, to be unlinked
+    int linked; // linked on every level
+    pthread_mutex_t lock;
+    struct sl_node_t *retired; // next in its limbo list once unlinked
+    struct sl_node_t *next[];  // one forward pointer per level
+} sl_node_t;
+/*---------------------------------------------------------------------------*/
+typedef struct skiplist_t
+{
+    sl_node_t *head; // sentinel with SKIPLIST_MAX_LEVEL pointers
+    size_t count;    // number of keys
+    uint64_t epoch;  // advanced under limbo_lock
+    int active[3];   // operations running in each of the last 3 epochs
+    pthread_mutex_t limbo_lock;
+    sl_node_t *limbo[3]; // nodes unlinked in each of the last 3 epochs
+} skiplist_t;
+/*---------------------------------------------------------------------------*/
+/**
+ * callback for skiplist_scan().
+ * returns nonzero to stop the scan at the given key.
+ */
+typedef int (*skiplist_fn)(void *arg, const char *key);
+/*---------------------------------------------------------------------------*/
+/**
+ * initializes an empty ordered key index.
+ * returns NULL when any internal errors occur.
+ */
+skiplist_t *skiplist_init(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * destroys an ordered key index.
+ */
+void skiplist_destroy(skiplist_t *sl);
+/*---------------------------------------------------------------------------*/
+/**
+ * inserts a key.
+ * returns -1 when any internal errors occur.
+ * returns 1 when successfully inserted.
+ * returns 0 when the key already exists.
+ */
+int skiplist_insert(skiplist_t *sl, const char *key);
+/*---------------------------------------------------------------------------*/
+/**
+ * deletes a key.
+ * returns 1 when successfully deleted.
+ * returns 0 when there is no such key found.
+ */
+int skiplist_delete(skiplist_t *sl, const char *key);
+/*---------------------------------------------------------------------------*/
+/**
+ * calls fn for every key not less than start (from the first key when start
+ * is NULL) in ascending order, until fn returns nonzero.
+ * keys are copied out SKIPLIST_SCAN_BATCH nodes at a time, and fn is called
+ * outside the index, so it may block. a key present for the whole scan is
+ * visited once; keys inserted or deleted meanwhile may or may not be.
+ * returns the nonzero value returned by fn, or 0 when all keys are visited.
+ */
+int skiplist_scan(skiplist_t *sl, const char *start, skiplist_fn fn, void *arg);
+/*---------------------------------------------------------------------------*/
+#endif // _SKIPLIST_H
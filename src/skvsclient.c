@@ -0,0 +1,1132 @@
+/*---------------------------------------------------------------------------*/
+/* skvsclient.c                                                              */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <strings.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "skvsclient.h"
+#include "lz.h"
+/*---------------------------------------------------------------------------*/
+#define SKVS_READ_CHUNK (64 << 10)
+/*---------------------------------------------------------------------------*/
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*---------------------------------------------------------------------------*/
+/* makes room for need more bytes after len */
+static int
+buf_reserve(char **buf, size_t *cap, size_t len, size_t need)
+{
+    size_t new_cap = *cap ? *cap : BUFFER_SIZE;
+    char *tmp;
+
+    if (len + need <= *cap)
+    {
+        return 0;
+    }
+    while (new_cap < len + need)
+    {
+        new_cap *= 2;
+    }
+    tmp = realloc(*buf, new_cap);
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    *buf = tmp;
+    *cap = new_cap;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* closes conn and completes everything pending on it with status */
+static void
+conn_fail(skvs_conn_t *conn, int status)
+{
+    skvs_op_t *op;
+
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->wlen = conn->woff = conn->rlen = 0;
+
+    while ((op = conn->head) != NULL)
+    {
+        conn->head = op->next;
+        op->status = status;
+        if (op->cb)
+        {
+            op->cb(op, op->arg);
+        }
+    }
+    conn->tail = NULL;
+    conn->inflight = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* opens a non-blocking socket and connects it to addr within timeout_ms.
+ * returns -1 when any internal errors occur, or else the socket. */
+static int
+connect_addr(int family, const struct sockaddr *addr, socklen_t addr_len,
+             int timeout_ms)
+{
+    struct pollfd pfd;
+    int fd, err;
+    socklen_t err_len = sizeof(err);
+
+    fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, addr, addr_len) == 0)
+    {
+        return fd;
+    }
+    if (errno == EINPROGRESS)
+    {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, timeout_ms) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 &&
+            err == 0)
+        {
+            return fd;
+        }
+    }
+    close(fd);
+
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
+/* connects conn without blocking longer than its timeout */
+static int
+conn_connect(skvs_conn_t *conn)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un addr;
+    char port_str[16];
+    int fd = -1, addr_len, yes = 1;
+
+    if (IS_UNIX_PATH(conn->host))
+    {
+        /* a server on this host */
+        addr_len = unix_addr(&addr, conn->host);
+        if (addr_len >= 0)
+        {
+            fd = connect_addr(AF_UNIX, (struct sockaddr *)&addr, addr_len,
+                              conn->timeout_ms);
+        }
+    }
+    else
+    {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port_str, sizeof(port_str), "%d", conn->port);
+        if (getaddrinfo(conn->host, port_str, &hints, &res) != 0)
+        {
+            return -1;
+        }
+        for (ai = res; ai && fd < 0; ai = ai->ai_next)
+        {
+            fd = connect_addr(ai->ai_family, ai->ai_addr, ai->ai_addrlen,
+                              conn->timeout_ms);
+        }
+        freeaddrinfo(res);
+        if (fd >= 0)
+        {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+    }
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    conn->fd = fd;
+    conn->last_io_ms = now_ms();
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* appends the request bytes to the output buffer */
+static int
+conn_put(skvs_conn_t *conn, const char *data, size_t len)
+{
+    if (buf_reserve(&conn->wbuf, &conn->wcap, conn->wlen, len) < 0)
+    {
+        return -1;
+    }
+    memcpy(conn->wbuf + conn->wlen, data, len);
+    conn->wlen += len;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* puts op at the end of the queue waiting for replies */
+static void
+conn_enqueue(skvs_conn_t *conn, skvs_op_t *op)
+{
+    op->status = SKVS_PENDING;
+    op->reply = NULL;
+    op->reply_len = 0;
+    op->next = NULL;
+
+    if (conn->tail)
+    {
+        conn->tail->next = op;
+    }
+    else
+    {
+        conn->head = op;
+        conn->last_io_ms = now_ms();
+    }
+    conn->tail = op;
+    conn->inflight++;
+}
+/*---------------------------------------------------------------------------*/
+/* reconnects a failed connection once nothing is pending on it */
+static int
+conn_ready(skvs_conn_t *conn)
+{
+    if (conn->fd >= 0)
+    {
+        return 0;
+    }
+    if (conn->head)
+    {
+        return -1;
+    }
+
+    return conn_connect(conn);
+}
+/*---------------------------------------------------------------------------*/
+static inline int
+is_framable(const char *cmd, size_t cmd_len)
+{
+    return cmd_len == 6 && (strncasecmp(cmd, "CREATE", 6) == 0 ||
+                            strncasecmp(cmd, "UPDATE", 6) == 0);
+}
+/*---------------------------------------------------------------------------*/
+/* queues "cmd key #<len>\n<value>\n" */
+static int
+conn_put_framed(skvs_conn_t *conn, const char *cmd, size_t cmd_len,
+                const char *key, size_t key_len,
+                const char *value, size_t value_len)
+{
+    char header[MAX_KEY_LEN + 64];
+    int n;
+
+    n = snprintf(header, sizeof(header), "%.*s %.*s #%zu\n",
+                 (int)cmd_len, cmd, (int)key_len, key, value_len);
+    if (n >= sizeof(header) ||
+        conn_put(conn, header, n) < 0 ||
+        conn_put(conn, value, value_len) < 0 ||
+        conn_put(conn, "\n", 1) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+skvs_client_t *skvs_client_open(const char *host, int port,
+                                int pool_size, int timeout_ms)
+{
+    skvs_client_t *c;
+    int i;
+
+    if (pool_size < 1)
+    {
+        pool_size = 1;
+    }
+    c = calloc(1, sizeof(skvs_client_t));
+    if (c == NULL)
+    {
+        return NULL;
+    }
+    c->conns = calloc(pool_size, sizeof(skvs_conn_t));
+    if (c->conns == NULL ||
+        snprintf(c->host, sizeof(c->host), "%s", host) >= sizeof(c->host))
+    {
+        free(c->conns);
+        free(c);
+        return NULL;
+    }
+    c->port = port;
+    c->timeout_ms = timeout_ms > 0 ? timeout_ms : SKVS_DEFAULT_TIMEOUT_MS;
+    c->pool_size = pool_size;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+
+    for (i = pool_size - 1; i >= 0; i--)
+    {
+        c->conns[i].fd = -1;
+        c->conns[i].host = c->host;
+        c->conns[i].port = port;
+        c->conns[i].timeout_ms = c->timeout_ms;
+        c->conns[i].next_free = c->free_list;
+        c->free_list = &c->conns[i];
+    }
+
+    return c;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_client_close(skvs_client_t *c)
+{
+    int i;
+
+    for (i = 0; i < c->pool_size; i++)
+    {
+        conn_fail(&c->conns[i], SKVS_EIO);
+        free(c->conns[i].wbuf);
+        free(c->conns[i].rbuf);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c->conns);
+    free(c);
+}
+/*---------------------------------------------------------------------------*/
+skvs_conn_t *skvs_acquire(skvs_client_t *c)
+{
+    struct timespec deadline;
+    skvs_conn_t *conn;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += c->timeout_ms / 1000;
+    deadline.tv_nsec += (c->timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while (c->free_list == NULL)
+    {
+        if (pthread_cond_timedwait(&c->cond, &c->lock, &deadline) != 0)
+        {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+    }
+    conn = c->free_list;
+    c->free_list = conn->next_free;
+    pthread_mutex_unlock(&c->lock);
+
+    if (conn_ready(conn) < 0)
+    {
+        skvs_release(c, conn);
+        return NULL;
+    }
+
+    return conn;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_release(skvs_client_t *c, skvs_conn_t *conn)
+{
+    while (conn->head && skvs_poll(conn, -1) >= 0)
+        ;
+
+    pthread_mutex_lock(&c->lock);
+    conn->next_free = c->free_list;
+    c->free_list = conn;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+/*---------------------------------------------------------------------------*/
+int skvs_submit(skvs_conn_t *conn, skvs_op_t *op, const char *cmd,
+                const char *key, const char *value, size_t value_len)
+{
+    size_t cmd_len = strlen(cmd), key_len = key ? strlen(key) : 0;
+    size_t len = cmd_len + (key ? key_len + 1 : 0) +
+                 (value ? value_len + 1 : 0) + 1;
+    size_t start;
+
+    if (conn_ready(conn) < 0)
+    {
+        return -1;
+    }
+
+    if (key && value && is_framable(cmd, cmd_len) &&
+        (len > BUFFER_SIZE || value_len == 0 || value[0] == '#' ||
+         memchr(value, ' ', value_len) || memchr(value, '\n', value_len)))
+    {
+        if (conn_put_framed(conn, cmd, cmd_len, key, key_len,
+                            value, value_len) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        start = conn->wlen;
+        if (conn_put(conn, cmd, cmd_len) < 0 ||
+            (key && (conn_put(conn, " ", 1) < 0 ||
+                     conn_put(conn, key, key_len) < 0)) ||
+            (value && (conn_put(conn, " ", 1) < 0 ||
+                       conn_put(conn, value, value_len) < 0)) ||
+            conn_put(conn, "\n", 1) < 0)
+        {
+            conn->wlen = start;
+            return -1;
+        }
+    }
+    conn_enqueue(conn, op);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* whether key can be sent as a token of a request line */
+static int
+is_valid_key(const char *key)
+{
+    size_t len = strcspn(key, " \n");
+
+    return len > 0 && len <= MAX_KEY_LEN && key[len] == '\0';
+}
+/*---------------------------------------------------------------------------*/
+/* queues "MGET key1 ... keyn" for n (at most MGET_MAX_KEYS) valid keys,
+ * with ops[i] waiting for the reply to keys[i] */
+static int
+conn_put_mget(skvs_conn_t *conn, const char **keys, skvs_op_t **ops, int n)
+{
+    size_t start = conn->wlen;
+    int i;
+
+    if (conn_put(conn, "MGET", 4) < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (conn_put(conn, " ", 1) < 0 ||
+            conn_put(conn, keys[i], strlen(keys[i])) < 0)
+        {
+            conn->wlen = start;
+            return -1;
+        }
+    }
+    if (conn_put(conn, "\n", 1) < 0)
+    {
+        conn->wlen = start;
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        conn_enqueue(conn, ops[i]);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_submit_mget(skvs_conn_t *conn, skvs_op_t *ops, const char **keys,
+                     int n)
+{
+    skvs_op_t *chunk[MGET_MAX_KEYS];
+    size_t start = conn->wlen;
+    skvs_op_t *tail = conn->tail;
+    int i, j, m;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!is_valid_key(keys[i]))
+        {
+            return -1;
+        }
+    }
+    if (conn_ready(conn) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < n; i += m)
+    {
+        m = n - i < MGET_MAX_KEYS ? n - i : MGET_MAX_KEYS;
+        for (j = 0; j < m; j++)
+        {
+            chunk[j] = &ops[i + j];
+        }
+        if (conn_put_mget(conn, keys + i, chunk, m) < 0)
+        {
+            /* take back the requests queued so far */
+            conn->wlen = start;
+            conn->inflight -= i;
+            conn->tail = tail;
+            if (tail)
+            {
+                tail->next = NULL;
+            }
+            else
+            {
+                conn->head = NULL;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* whether req can be a line of a MULTI block, where nothing is framed */
+static int
+is_valid_multi_req(const struct skvs_req *req)
+{
+    const char *v = req->value;
+    size_t n = req->value_len;
+
+    if (req->cmd[0] == '\0' || strpbrk(req->cmd, " \n") ||
+        !req->key || !is_valid_key(req->key))
+    {
+        return 0;
+    }
+
+    return !v || (n > 0 && v[0] != '#' && !memchr(v, ' ', n) &&
+                  !memchr(v, '\n', n));
+}
+/*---------------------------------------------------------------------------*/
+int skvs_submit_multi(skvs_conn_t *conn, skvs_op_t *ops,
+                      const struct skvs_req *reqs, int n)
+{
+    size_t start = conn->wlen;
+    int i;
+
+    if (n < 1 || n > MULTI_MAX_OPS)
+    {
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (!is_valid_multi_req(&reqs[i]))
+        {
+            return -1;
+        }
+    }
+    if (conn_ready(conn) < 0)
+    {
+        return -1;
+    }
+
+    if (conn_put(conn, "MULTI\n", 6) < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (conn_put(conn, reqs[i].cmd, strlen(reqs[i].cmd)) < 0 ||
+            conn_put(conn, " ", 1) < 0 ||
+            conn_put(conn, reqs[i].key, strlen(reqs[i].key)) < 0 ||
+            (reqs[i].value && (conn_put(conn, " ", 1) < 0 ||
+                               conn_put(conn, reqs[i].value,
+                                        reqs[i].value_len) < 0)) ||
+            conn_put(conn, "\n", 1) < 0)
+        {
+            conn->wlen = start;
+            return -1;
+        }
+    }
+    if (conn_put(conn, "EXEC\n", 5) < 0 ||
+        conn->wlen - start > MULTI_MAX_LEN)
+    {
+        /* the server could never read the block whole */
+        conn->wlen = start;
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        conn_enqueue(conn, &ops[i]);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_submit_line(skvs_conn_t *conn, skvs_op_t *op,
+                     const char *line, size_t len)
+{
+    const char *key, *value = NULL;
+    size_t cmd_len;
+
+    if (conn_ready(conn) < 0)
+    {
+        return -1;
+    }
+
+    if (len + 1 > BUFFER_SIZE)
+    {
+        /* too long for a message, frame "CREATE key <rest of line>" */
+        cmd_len = strcspn(line, " ");
+        key = line + cmd_len + 1;
+        if (key < line + len)
+        {
+            value = memchr(key, ' ', line + len - key);
+        }
+        if (value && value - key <= MAX_KEY_LEN && is_framable(line, cmd_len))
+        {
+            if (conn_put_framed(conn, line, cmd_len, key, value - key,
+                                value + 1, line + len - value - 1) < 0)
+            {
+                return -1;
+            }
+            conn_enqueue(conn, op);
+            return 0;
+        }
+    }
+
+    if (conn_put(conn, line, len) < 0 || conn_put(conn, "\n", 1) < 0)
+    {
+        return -1;
+    }
+    conn_enqueue(conn, op);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* completes the oldest pending op with a copy of len bytes of reply, or
+ * with its decompression when raw is not -1 */
+static int
+conn_complete(skvs_conn_t *conn, const char *reply, size_t len, long raw)
+{
+    skvs_op_t *op = conn->head;
+    char *buf;
+
+    if (op == NULL)
+    {
+        /* a reply nobody asked for */
+        return -1;
+    }
+
+    buf = malloc((raw >= 0 ? raw : len) + 1);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    if (raw >= 0)
+    {
+        if (lz_decompress(reply, len, buf, raw) != raw)
+        {
+            free(buf);
+            return -1;
+        }
+        len = raw;
+    }
+    else
+    {
+        memcpy(buf, reply, len);
+    }
+    buf[len] = '\0';
+
+    conn->head = op->next;
+    if (conn->head == NULL)
+    {
+        conn->tail = NULL;
+    }
+    conn->inflight--;
+
+    op->reply = buf;
+    op->reply_len = len;
+    op->status = SKVS_OK;
+    if (op->cb)
+    {
+        op->cb(op, op->arg);
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* completes operations with every whole reply in rbuf.
+ * returns the number completed, or -1 when the stream is malformed. */
+static int
+conn_parse(skvs_conn_t *conn)
+{
+    char *line, *nl, *end;
+    size_t off = 0, len, llen;
+    long raw;
+    int done = 0;
+
+    while (off < conn->rlen)
+    {
+        line = conn->rbuf + off;
+        nl = memchr(line, '\n', conn->rlen - off);
+        if (nl == NULL)
+        {
+            break;
+        }
+        llen = nl - line;
+
+        if (line[0] == '#' && llen > 1)
+        {
+            /* "#<len>" or "#<len> <raw_len>", then the value */
+            raw = -1;
+            len = strtoull(line + 1, &end, 10);
+            if (*end == ' ')
+            {
+                raw = strtol(end + 1, &end, 10);
+            }
+            if (end != nl || raw > MAX_BODY_LEN)
+            {
+                return -1;
+            }
+            if (conn->rlen - off < llen + 1 + len + 1)
+            {
+                break;
+            }
+            if (nl[1 + len] != '\n' ||
+                conn_complete(conn, nl + 1, len, raw) < 0)
+            {
+                return -1;
+            }
+            off += llen + 1 + len + 1;
+        }
+        else
+        {
+            if (conn_complete(conn, line, llen, -1) < 0)
+            {
+                return -1;
+            }
+            off += llen + 1;
+        }
+        done++;
+    }
+
+    memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+    conn->rlen -= off;
+
+    return done;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_poll(skvs_conn_t *conn, int timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t start = now_ms(), now;
+    long wait;
+    ssize_t n;
+    int done = 0, ret;
+
+    if (conn->fd < 0)
+    {
+        return -1;
+    }
+
+    while (1)
+    {
+        /* write what the socket takes */
+        while (conn->woff < conn->wlen)
+        {
+            n = send(conn->fd, conn->wbuf + conn->woff,
+                     conn->wlen - conn->woff, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                conn->woff += n;
+                conn->last_io_ms = now_ms();
+            }
+            else if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            else
+            {
+                conn_fail(conn, SKVS_EIO);
+                return -1;
+            }
+        }
+        if (conn->woff == conn->wlen)
+        {
+            conn->woff = conn->wlen = 0;
+        }
+
+        if (done > 0 || conn->head == NULL)
+        {
+            return done;
+        }
+
+        /* wait for the socket, but not past either timeout */
+        now = now_ms();
+        if (now - conn->last_io_ms >= conn->timeout_ms)
+        {
+            conn_fail(conn, SKVS_ETIMEDOUT);
+            return -1;
+        }
+        wait = conn->timeout_ms - (now - conn->last_io_ms);
+        if (timeout_ms >= 0 && timeout_ms - (long)(now - start) < wait)
+        {
+            wait = timeout_ms > now - start ? timeout_ms - (now - start) : 0;
+        }
+
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN | (conn->wlen ? POLLOUT : 0);
+        ret = poll(&pfd, 1, wait);
+        if (ret < 0 && errno != EINTR)
+        {
+            conn_fail(conn, SKVS_EIO);
+            return -1;
+        }
+        if (ret == 0 && timeout_ms >= 0 && now_ms() - start >= timeout_ms)
+        {
+            return 0;
+        }
+        if (ret <= 0 || !(pfd.revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            continue;
+        }
+
+        if (buf_reserve(&conn->rbuf, &conn->rcap, conn->rlen,
+                        SKVS_READ_CHUNK) < 0)
+        {
+            conn_fail(conn, SKVS_EIO);
+            return -1;
+        }
+        n = recv(conn->fd, conn->rbuf + conn->rlen,
+                 conn->rcap - conn->rlen, 0);
+        if (n > 0)
+        {
+            conn->rlen += n;
+            conn->last_io_ms = now_ms();
+            ret = conn_parse(conn);
+            if (ret < 0)
+            {
+                conn_fail(conn, SKVS_EIO);
+                return -1;
+            }
+            done += ret;
+        }
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                            errno != EINTR))
+        {
+            conn_fail(conn, SKVS_EIO);
+            return -1;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+int skvs_wait(skvs_conn_t *conn, skvs_op_t *op)
+{
+    while (op->status == SKVS_PENDING)
+    {
+        if (skvs_poll(conn, -1) < 0)
+        {
+            break;
+        }
+        if (op->status == SKVS_PENDING && conn->head == NULL)
+        {
+            /* op was not submitted on this connection */
+            op->status = SKVS_EIO;
+        }
+    }
+
+    return op->status;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_call(skvs_client_t *c, skvs_op_t *op, const char *cmd,
+              const char *key, const char *value, size_t value_len)
+{
+    skvs_conn_t *conn = skvs_acquire(c);
+
+    op->status = SKVS_EIO;
+    op->reply = NULL;
+    if (conn == NULL)
+    {
+        return op->status;
+    }
+    if (skvs_submit(conn, op, cmd, key, value, value_len) == 0)
+    {
+        skvs_wait(conn, op);
+    }
+    skvs_release(c, conn);
+
+    return op->status;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_op_release(skvs_op_t *op)
+{
+    free(op->reply);
+    op->reply = NULL;
+    op->reply_len = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* 64-bit FNV-1a, spread by the jump hash below */
+static uint64_t
+key_hash(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+/*---------------------------------------------------------------------------*/
+/* jump consistent hash (Lamping and Veach): a bucket in [0, n) for h */
+static int
+jump_hash(uint64_t h, int n)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < n)
+    {
+        b = j;
+        h = h * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((h >> 33) + 1));
+    }
+
+    return b;
+}
+/*---------------------------------------------------------------------------*/
+skvs_cluster_t *skvs_cluster_open(const char *list, int default_port,
+                                  int pool_size, int timeout_ms)
+{
+    skvs_cluster_t *cl;
+    char host[256], *colon, *end;
+    const char *p = list;
+    size_t len;
+    int n = 1, port;
+
+    for (; *p; p++)
+    {
+        n += *p == ',';
+    }
+    cl = calloc(1, sizeof(skvs_cluster_t));
+    if (cl == NULL)
+    {
+        return NULL;
+    }
+    cl->servers = calloc(n, sizeof(skvs_client_t *));
+    if (cl->servers == NULL)
+    {
+        free(cl);
+        return NULL;
+    }
+
+    for (p = list; cl->nservers < n; p += len + 1)
+    {
+        len = strcspn(p, ",");
+        if (len == 0 || len >= sizeof(host))
+        {
+            goto fail;
+        }
+        memcpy(host, p, len);
+        host[len] = '\0';
+
+        port = default_port;
+        colon = IS_UNIX_PATH(host) ? NULL : strrchr(host, ':');
+        if (colon)
+        {
+            port = strtol(colon + 1, &end, 10);
+            if (*end != '\0' || port <= 0 || port > 65535)
+            {
+                goto fail;
+            }
+            *colon = '\0';
+        }
+
+        cl->servers[cl->nservers] = skvs_client_open(host, port, pool_size,
+                                                     timeout_ms);
+        if (cl->servers[cl->nservers] == NULL)
+        {
+            goto fail;
+        }
+        cl->nservers++;
+    }
+
+    return cl;
+
+fail:
+    skvs_cluster_close(cl);
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_cluster_close(skvs_cluster_t *cl)
+{
+    int i;
+
+    for (i = 0; i < cl->nservers; i++)
+    {
+        skvs_client_close(cl->servers[i]);
+    }
+    free(cl->servers);
+    free(cl);
+}
+/*---------------------------------------------------------------------------*/
+int skvs_cluster_route(skvs_cluster_t *cl, const char *key)
+{
+    if (key == NULL || cl->nservers == 1)
+    {
+        return 0;
+    }
+
+    return jump_hash(key_hash(key), cl->nservers);
+}
+/*---------------------------------------------------------------------------*/
+/* drives the connections of a batch on all servers at once until every
+ * request is answered, then releases them and frees conns and pfds.
+ * returns the number of ops that failed. */
+static int
+cluster_finish(skvs_cluster_t *cl, skvs_conn_t **conns,
+               struct pollfd *pfds, skvs_op_t *ops, int n)
+{
+    int i, s, npfd, failed = 0;
+
+    while (1)
+    {
+        npfd = 0;
+        for (s = 0; s < cl->nservers; s++)
+        {
+            if (conns[s] && conns[s]->head && skvs_poll(conns[s], 0) >= 0 &&
+                conns[s]->head)
+            {
+                pfds[npfd].fd = conns[s]->fd;
+                pfds[npfd].events = POLLIN | (conns[s]->wlen ? POLLOUT : 0);
+                npfd++;
+            }
+        }
+        if (npfd == 0)
+        {
+            break;
+        }
+        /* wake up now and then, so each connection checks its timeout */
+        poll(pfds, npfd, 100);
+    }
+
+    for (s = 0; s < cl->nservers; s++)
+    {
+        if (conns[s])
+        {
+            skvs_release(cl->servers[s], conns[s]);
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        failed += ops[i].status != SKVS_OK;
+    }
+    free(conns);
+    free(pfds);
+
+    return failed;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_cluster_exec(skvs_cluster_t *cl, const struct skvs_req *reqs,
+                      skvs_op_t *ops, int n)
+{
+    skvs_conn_t **conns;
+    struct pollfd *pfds;
+    int i, s;
+
+    conns = calloc(cl->nservers, sizeof(skvs_conn_t *));
+    pfds = calloc(cl->nservers, sizeof(struct pollfd));
+    if (conns == NULL || pfds == NULL)
+    {
+        free(conns);
+        free(pfds);
+        for (i = 0; i < n; i++)
+        {
+            ops[i].status = SKVS_EIO;
+            ops[i].reply = NULL;
+        }
+        return n;
+    }
+
+    /* queue every request on the connection of its server */
+    for (i = 0; i < n; i++)
+    {
+        s = skvs_cluster_route(cl, reqs[i].key);
+        ops[i].status = SKVS_EIO;
+        ops[i].reply = NULL;
+        if (conns[s] == NULL)
+        {
+            conns[s] = skvs_acquire(cl->servers[s]);
+        }
+        if (conns[s] != NULL)
+        {
+            skvs_submit(conns[s], &ops[i], reqs[i].cmd, reqs[i].key,
+                        reqs[i].value, reqs[i].value_len);
+        }
+    }
+
+    return cluster_finish(cl, conns, pfds, ops, n);
+}
+/*---------------------------------------------------------------------------*/
+int skvs_cluster_mget(skvs_cluster_t *cl, const char **keys,
+                      skvs_op_t *ops, int n)
+{
+    skvs_conn_t **conns;
+    struct pollfd *pfds;
+    int *owner;
+    const char *chunk_keys[MGET_MAX_KEYS];
+    skvs_op_t *chunk_ops[MGET_MAX_KEYS];
+    int i, s, m;
+
+    conns = calloc(cl->nservers, sizeof(skvs_conn_t *));
+    pfds = calloc(cl->nservers, sizeof(struct pollfd));
+    owner = malloc(sizeof(int) * (n > 0 ? n : 1));
+    for (i = 0; i < n; i++)
+    {
+        ops[i].status = SKVS_EIO;
+        ops[i].reply = NULL;
+    }
+    if (conns == NULL || pfds == NULL || owner == NULL)
+    {
+        free(conns);
+        free(pfds);
+        free(owner);
+        return n;
+    }
+
+    /* a key that cannot be sent fails alone */
+    for (i = 0; i < n; i++)
+    {
+        owner[i] = is_valid_key(keys[i]) ? skvs_cluster_route(cl, keys[i])
+                                         : -1;
+    }
+
+    /* one MGET per server, with the keys it owns in their order */
+    for (s = 0; s < cl->nservers; s++)
+    {
+        m = 0;
+        for (i = 0; i < n; i++)
+        {
+            if (owner[i] == s)
+            {
+                chunk_keys[m] = keys[i];
+                chunk_ops[m++] = &ops[i];
+            }
+            if (m == 0 || (m < MGET_MAX_KEYS && i < n - 1))
+            {
+                continue;
+            }
+            if (conns[s] == NULL)
+            {
+                conns[s] = skvs_acquire(cl->servers[s]);
+            }
+            if (conns[s] != NULL && conn_ready(conns[s]) == 0)
+            {
+                conn_put_mget(conns[s], chunk_keys, chunk_ops, m);
+            }
+            m = 0;
+        }
+    }
+    free(owner);
+
+    return cluster_finish(cl, conns, pfds, ops, n);
+}
+/*---------------------------------------------------------------------------*/
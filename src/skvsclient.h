@@ -0,0 +1,282 @@
+/*---------------------------------------------------------------------------*/
+/* skvsclient.h                                                              */
+/*---------------------------------------------------------------------------*/
+#ifndef _SKVSCLIENT_H
+#define _SKVSCLIENT_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* a client library for SKVS servers.
+ *
+ * a client keeps a pool of connections to one server. a connection taken
+ * from the pool pipelines any number of operations: skvs_submit() only
+ * queues a request, requests queued together go out in as few writes as
+ * possible, and replies complete the operations in submission order.
+ * nothing blocks longer than the timeout given to skvs_client_open(). */
+/*---------------------------------------------------------------------------*/
+/* operation status */
+#define SKVS_PENDING 1    // submitted, no reply yet
+#define SKVS_OK 0         // reply received
+#define SKVS_EIO -1       // the connection failed or broke the protocol
+#define SKVS_ETIMEDOUT -2 // no reply within the timeout
+/*---------------------------------------------------------------------------*/
+#define SKVS_DEFAULT_TIMEOUT_MS 5000
+/*---------------------------------------------------------------------------*/
+typedef struct skvs_op skvs_op_t;
+typedef void (*skvs_cb)(skvs_op_t *op, void *arg);
+/*---------------------------------------------------------------------------*/
+/* one request and its reply; owned by the caller, which must keep it
+ * alive until it completes */
+struct skvs_op
+{
+    int status;       // SKVS_* status
+    char *reply;      // reply line, or the value of a framed reply,
+                      // null-terminated; freed by skvs_op_release()
+    size_t reply_len;
+    skvs_cb cb;       // called on completion when set
+    void *arg;
+
+    /* internal */
+    struct skvs_op *next;
+};
+/*---------------------------------------------------------------------------*/
+/* one connection, used by one thread at a time */
+typedef struct skvs_conn
+{
+    int fd; // -1 until connected, or after a failure
+    int timeout_ms;
+    const char *host;
+    int port;
+
+    char *wbuf; // requests not written yet
+    size_t wlen, wcap, woff;
+    char *rbuf; // reply bytes not parsed yet
+    size_t rlen, rcap;
+
+    skvs_op_t *head, *tail; // operations waiting for replies, in order
+    int inflight;
+    uint64_t last_io_ms; // last progress, for the timeout
+
+    struct skvs_conn *next_free;
+} skvs_conn_t;
+/*---------------------------------------------------------------------------*/
+/* a pool of connections to one server */
+typedef struct skvs_client
+{
+    char host[256];
+    int port;
+    int timeout_ms;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    skvs_conn_t *conns; // pool_size connections, opened on first use
+    skvs_conn_t *free_list;
+    int pool_size;
+} skvs_client_t;
+/*---------------------------------------------------------------------------*/
+/* a set of servers sharing the key space by consistent hashing */
+typedef struct skvs_cluster
+{
+    skvs_client_t **servers;
+    int nservers;
+} skvs_cluster_t;
+/*---------------------------------------------------------------------------*/
+/* one request of a batch run by skvs_cluster_exec() */
+struct skvs_req
+{
+    const char *cmd;
+    const char *key;   // routes the request, NULL for the first server
+    const char *value; // may be NULL
+    size_t value_len;
+};
+/*---------------------------------------------------------------------------*/
+/* a mapping of the shared-memory mirror of a server on this host (see
+ * shm.h), used by one thread at a time */
+typedef struct skvs_shm
+{
+    char name[NAME_MAX];
+    const char *base; // the mapped region
+    size_t size;
+    char *scratch; // compressed values are copied here before inflating
+} skvs_shm_t;
+/*---------------------------------------------------------------------------*/
+/**
+ * creates a client for the server at host:port with up to pool_size
+ * connections. a host that is a path with a '/' in it, or "@name" in the
+ * abstract namespace, names the unix domain socket of a server on this
+ * host instead (the -u of the server), and port is not used.
+ * timeout_ms bounds connecting and waiting for a reply
+ * (SKVS_DEFAULT_TIMEOUT_MS when 0).
+ * no connection is made until one is acquired.
+ * returns NULL when any internal errors occur.
+ */
+skvs_client_t *skvs_client_open(const char *host, int port,
+                                int pool_size, int timeout_ms);
+/*---------------------------------------------------------------------------*/
+/**
+ * closes all connections and frees the client.
+ * every connection must have been released.
+ */
+void skvs_client_close(skvs_client_t *c);
+/*---------------------------------------------------------------------------*/
+/**
+ * takes a connection from the pool, waiting up to the timeout for one
+ * to be released, and connects it if needed.
+ * returns NULL when none is available or the server cannot be reached.
+ */
+skvs_conn_t *skvs_acquire(skvs_client_t *c);
+/*---------------------------------------------------------------------------*/
+/**
+ * gives a connection back to the pool. operations still in flight are
+ * waited for first; a failed connection is closed and reopened later.
+ */
+void skvs_release(skvs_client_t *c, skvs_conn_t *conn);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues "cmd key value" on conn, where key and value may be NULL.
+ * a CREATE or UPDATE value that is long, or holds spaces or line feeds,
+ * is sent framed, so values may hold any bytes.
+ * the request is written by the next skvs_poll() or skvs_wait().
+ * returns -1 when conn has failed or memory runs out.
+ * returns 0 on success.
+ */
+int skvs_submit(skvs_conn_t *conn, skvs_op_t *op, const char *cmd,
+                const char *key, const char *value, size_t value_len);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues a request line of len bytes (without the line feed) as typed by
+ * a user. a CREATE or UPDATE line too long for a message is sent framed.
+ * returns -1 when conn has failed or memory runs out.
+ * returns 0 on success.
+ */
+int skvs_submit_line(skvs_conn_t *conn, skvs_op_t *op,
+                     const char *line, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes queued requests and reads replies, waiting up to timeout_ms
+ * (-1 waits for at least one completion, 0 never waits).
+ * on a failure or timeout every pending operation completes with an
+ * error, and the connection is closed.
+ * returns -1 when the connection failed.
+ * returns the number of operations completed otherwise.
+ */
+int skvs_poll(skvs_conn_t *conn, int timeout_ms);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues a READ of n keys on conn as "MGET key1 key2 ...", which the
+ * server looks up together. ops[i] completes with the reply READ would
+ * give for keys[i]. more than MGET_MAX_KEYS keys go in several requests.
+ * returns -1 when a key is not valid (too long, or holds a space or line
+ * feed), conn has failed or memory runs out; no op is queued then.
+ * returns 0 on success.
+ */
+int skvs_submit_mget(skvs_conn_t *conn, skvs_op_t *ops, const char **keys,
+                     int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * queues the n requests of reqs (at most MULTI_MAX_OPS, all with a key)
+ * on conn as one "MULTI ... EXEC" block, which the server applies at
+ * once: no other client sees any of them apart. ops[i] completes with
+ * the reply to reqs[i], ABORTED when another request of the block was
+ * refused, in which case none was applied. the block is sent as plain
+ * request lines, so values may hold no space or line feed.
+ * returns -1 when a request cannot be part of a block, the block is over
+ * MULTI_MAX_LEN bytes, conn has failed or memory runs out; no op is
+ * queued then.
+ * returns 0 on success.
+ */
+int skvs_submit_multi(skvs_conn_t *conn, skvs_op_t *ops,
+                      const struct skvs_req *reqs, int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * polls conn until op completes.
+ * returns the final status of op.
+ */
+int skvs_wait(skvs_conn_t *conn, skvs_op_t *op);
+/*---------------------------------------------------------------------------*/
+/**
+ * runs a single request on a pooled connection and waits for its reply.
+ * returns the final status of op.
+ */
+int skvs_call(skvs_client_t *c, skvs_op_t *op, const char *cmd,
+              const char *key, const char *value, size_t value_len);
+/*---------------------------------------------------------------------------*/
+/**
+ * frees the reply of a completed op so that it can be submitted again.
+ */
+void skvs_op_release(skvs_op_t *op);
+/*---------------------------------------------------------------------------*/
+/**
+ * creates a cluster of the comma-separated "host[:port]" servers in list,
+ * using default_port where none is given, each with its own client of
+ * pool_size connections. unix domain sockets are given as for
+ * skvs_client_open(), without a port.
+ * keys are spread with jump consistent hashing, so adding a server to
+ * the end of the list moves only about 1/n of the keys.
+ * returns NULL when list is malformed or any internal errors occur.
+ */
+skvs_cluster_t *skvs_cluster_open(const char *list, int default_port,
+                                  int pool_size, int timeout_ms);
+/*---------------------------------------------------------------------------*/
+/**
+ * closes every client of the cluster.
+ */
+void skvs_cluster_close(skvs_cluster_t *cl);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the index of the server owning key (0 when key is NULL).
+ */
+int skvs_cluster_route(skvs_cluster_t *cl, const char *key);
+/*---------------------------------------------------------------------------*/
+/**
+ * runs n requests across the cluster: requests for the same server are
+ * pipelined on one of its connections, and all servers are driven at
+ * once. ops[i] receives the reply to reqs[i].
+ * returns the number of requests that failed (status other than SKVS_OK).
+ */
+int skvs_cluster_exec(skvs_cluster_t *cl, const struct skvs_req *reqs,
+                      skvs_op_t *ops, int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * reads n keys across the cluster with one MGET per server (or more, for
+ * over MGET_MAX_KEYS keys), all servers driven at once.
+ * ops[i] receives the reply to keys[i], as with skvs_submit_mget().
+ * returns the number of keys that failed (status other than SKVS_OK).
+ */
+int skvs_cluster_mget(skvs_cluster_t *cl, const char **keys,
+                      skvs_op_t *ops, int n);
+/*---------------------------------------------------------------------------*/
+/**
+ * maps the shared-memory mirror name of a server on this host (the -m
+ * option of the server) for reading.
+ * returns NULL when there is no such mirror or any internal errors occur.
+ */
+skvs_shm_t *skvs_shm_open(const char *name);
+/*---------------------------------------------------------------------------*/
+/**
+ * unmaps the mirror and frees m.
+ */
+void skvs_shm_close(skvs_shm_t *m);
+/*---------------------------------------------------------------------------*/
+/**
+ * reads the value of key from the mirror into buf of len bytes, null-
+ * terminated, and sets *value_len to its length, without locks or system
+ * calls. when the server that wrote the mirror has gone, the mirror of
+ * the server that took over is mapped instead.
+ * returns -1 when the mirror cannot answer (the value is not mirrored,
+ * does not fit in buf, or keeps changing, or the server is gone); the
+ * server has to be asked then.
+ * returns 0 when key does not exist.
+ * returns 1 when the value was read.
+ */
+int skvs_shm_read(skvs_shm_t *m, const char *key, char *buf, size_t len,
+                  size_t *value_len);
+/*---------------------------------------------------------------------------*/
+#endif // _SKVSCLIENT_H
@@ -12,20 +12,86 @@ const char *g_msgs[MSG_COUNT] = {
     "NOT FOUND",
     "UPDATE OK",
     "DELETE OK",
-    "INTERNAL ERR"};
+    "INTERNAL ERR",
+    "CAS OK",
+    "MISMATCH",
+    "APPEND OK",
+    "NOT NUMBER",
+    "TOO LARGE",
+    "NO INDEX",
+    "EXPORT OK",
+    "READ ONLY",
+    "BUSY",
+    "TRACE OK",
+    "ABORTED"};
 const char *g_cmds[CMD_COUNT] = {
     "CREATE",
     "READ",
     "UPDATE",
-    "DELETE"};
+    "DELETE",
+    "GETS",
+    "CAS",
+    "INCR",
+    "DECR",
+    "APPEND",
+    "RANGE",
+    "PREFIX",
+    "SCAN",
+    "EXPORT",
+    "READC",
+    "STATS",
+    "SYNC",
+    "TRACE",
+    "MGET",
+    "MULTI",
+    "EXEC"};
+/* minimum and maximum number of arguments (key included) of each command */
+static const int g_cmd_args[CMD_COUNT][2] = {
+    {2, 2}, /* CREATE key value */
+    {1, 1}, /* READ key */
+    {2, 2}, /* UPDATE key value */
+    {1, 1}, /* DELETE key */
+    {1, 1}, /* GETS key */
+    {3, 3}, /* CAS key version value */
+    {1, 2}, /* INCR key [delta] */
+    {1, 2}, /* DECR key [delta] */
+    {2, 2}, /* APPEND key value */
+    {3, 3}, /* RANGE start end limit */
+    {2, 3}, /* PREFIX prefix limit [cursor] */
+    {1, 2}, /* SCAN cursor [count] */
+    {0, 0}, /* EXPORT */
+    {1, 1}, /* READC key */
+    {0, 0}, /* STATS */
+    {0, 0}, /* SYNC, served by skvs_sync() */
+    {1, 1}, /* TRACE on|off|dump */
+    {1, MGET_MAX_KEYS}, /* MGET key [key ...] */
+    {0, 0}, /* MULTI, served by skvs_serve_multi() */
+    {0, 0}, /* EXEC, ends a MULTI block */
+};
 // const char *g_crlf = "\r\n";
 const char *g_crlf = "\n";
+/* per-thread buffer for responses built on the fly (e.g., INCR results);
+ * large enough for a version, a space and the largest value */
+static __thread char t_resp[MAX_VALUE_LEN + 32];
+/* per-thread buffer a short value is copied into by READ */
+static __thread char t_short[NODE_INLINE_VALUE];
+/* per-thread buffer for the header of a framed response */
+static __thread char t_frame[48];
+/* per-thread buffer a compressed value is read into, grown on demand */
+static __thread char *t_raw;
+static __thread size_t t_raw_cap;
+/* per-thread buffer the replies of an MGET are gathered in */
+static __thread char *t_mget;
+static __thread size_t t_mget_len, t_mget_cap;
+/* set while a MULTI block holds its buckets, which must not wait on a
+ * READ of another thread that may be waiting on them */
+static __thread int t_in_multi;
 /*---------------------------------------------------------------------------*/
 static inline enum CMD
-skvs_parse(char *buffer, size_t len, const char **key, const char **value)
+skvs_parse(char *buffer, size_t len, const char **args, int *nargs)
 {
     TRACE_PRINT();
-    char *cmd;
+    char *cmd, *arg, *saveptr;
     int i;
 
     if (len > BUFFER_SIZE)
@@ -33,33 +99,23 @@ skvs_parse(char *buffer, size_t len, const char **key, const char **value)
         /* too large message */
         return CMD_INVALID;
     }
-    if (len == BUFFER_SIZE)
+
+    /* the request ends at the first line feed, nothing after it is touched */
+    char *crlf_ptr = memchr(buffer, g_crlf[0], len);
+    if (crlf_ptr == NULL)
     {
-        if (memcmp(&buffer[BUFFER_SIZE - 1], g_crlf, strlen(g_crlf)))
+        if (len == BUFFER_SIZE)
         {
             /* too large message */
             return CMD_INVALID;
         }
-
-        /* remove line feed */
-        buffer[BUFFER_SIZE - 1] = '\0';
+        return CMD_INCOMPLETE;
     }
-    else
-    {
-        /* make it null-terminated */
-        buffer[len] = '\0';
 
-        char *crlf_ptr = strstr(buffer, g_crlf);
-        if (crlf_ptr == NULL)
-        {
-            return CMD_INCOMPLETE;
-        }
+    /* remove line feed */
+    *crlf_ptr = '\0';
 
-        /* remove line feed */
-        *crlf_ptr = '\0';
-    }
-
-    cmd = strtok(buffer, " ");
+    cmd = strtok_r(buffer, " ", &saveptr);
     if (cmd == NULL)
     {
         /* no command found */
@@ -76,91 +132,878 @@ skvs_parse(char *buffer, size_t len, const char **key, const char **value)
     {
         if (strcmp(cmd, g_cmds[i]) == 0)
         {
-            *key = strtok(NULL, " ");
-            if (*key == NULL)
-            {
-                /* no key found */
-                return CMD_INVALID;
-            }
-            if (strlen(*key) > MAX_KEY_LEN)
-            {
-                /* too large key */
-                return CMD_INVALID;
-            }
+            break;
+        }
+    }
+    if (i == CMD_COUNT)
+    {
+        /* command not recognized */
+        return CMD_INVALID;
+    }
+
+    /* collect arguments, one extra slot to detect extra tokens */
+    *nargs = 0;
+    while ((arg = strtok_r(NULL, " ", &saveptr)) != NULL)
+    {
+        if (*nargs == g_cmd_args[i][1])
+        {
+            /* extra tokens found */
+            return CMD_INVALID;
+        }
+        args[(*nargs)++] = arg;
+    }
+    if (*nargs < g_cmd_args[i][0])
+    {
+        /* no key or missing value */
+        return CMD_INVALID;
+    }
+    if (*nargs > 0 && strlen(args[0]) > MAX_KEY_LEN)
+    {
+        /* too large key */
+        return CMD_INVALID;
+    }
 
-            *value = strtok(NULL, " ");
+    /* return the corresponding command enum */
+    return i;
+}
+/*---------------------------------------------------------------------------*/
+/* parses a whole token as a signed or unsigned decimal number */
+static inline int
+skvs_parse_ll(const char *str, long long *num)
+{
+    char *end;
 
-            /* handle specific cases for READ and DELETE */
-            if ((i == CMD_READ || i == CMD_DELETE) && *value != NULL)
-            {
-                /* READ or DELETE should not have a value */
-                return CMD_INVALID;
-            }
+    errno = 0;
+    *num = strtoll(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0')
+    {
+        return -1;
+    }
 
-            /* handle specific cases for CREATE and UPDATE */
-            if ((i == CMD_CREATE || i == CMD_UPDATE) && *value == NULL)
-            {
-                /* CREATE or UPDATE must have a value */
-                return CMD_INVALID;
-            }
+    return 0;
+}
+static inline int
+skvs_parse_ull(const char *str, uint64_t *num)
+{
+    char *end;
+
+    if (*str == '-')
+    {
+        return -1;
+    }
+    errno = 0;
+    *num = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0')
+    {
+        return -1;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* state of a RANGE or PREFIX scan */
+struct skvs_scan
+{
+    const char *end;    // exclusive upper bound, or NULL
+    const char *prefix; // required prefix, or NULL
+    size_t prefix_len;
+    long long limit;    // maximum number of keys
+    char *buf;          // keys are appended as " key"
+    size_t len;
+    size_t off;
+    char cursor[MAX_KEY_LEN + 1]; // first key not returned
+};
+/*---------------------------------------------------------------------------*/
+static int
+skvs_scan_key(void *arg, const char *key)
+{
+    struct skvs_scan *scan = arg;
+    size_t klen;
+
+    if (scan->end && strcmp(key, scan->end) >= 0)
+    {
+        return 1;
+    }
+    if (scan->prefix && strncmp(key, scan->prefix, scan->prefix_len) != 0)
+    {
+        return 1;
+    }
+
+    klen = strlen(key);
+    if (scan->limit == 0 || scan->off + 1 + klen >= scan->len)
+    {
+        /* more keys left, resume from here */
+        memcpy(scan->cursor, key, klen + 1);
+        return 2;
+    }
+
+    scan->buf[scan->off++] = ' ';
+    memcpy(scan->buf + scan->off, key, klen);
+    scan->off += klen;
+    scan->limit--;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* builds "<cursor> key1 key2 ..." where cursor is "-" once the scan ends */
+static const char *
+skvs_scan(struct skvs_ctx *ctx, struct skvs_scan *scan, const char *start)
+{
+    /* keys go after room for the cursor, which is prepended at the end */
+    char *keys = t_resp + MAX_KEY_LEN + 1;
+    const char *cursor = "-";
+    size_t clen;
+    int ret;
+
+    scan->buf = keys;
+    scan->len = sizeof(t_resp) - (MAX_KEY_LEN + 1);
+    scan->off = 0;
+
+    ret = hash_range(ctx->table, start, skvs_scan_key, scan);
+    if (ret < 0)
+    {
+        return g_msgs[MSG_INTERNAL_ERR];
+    }
+    if (ret == 2)
+    {
+        cursor = scan->cursor;
+    }
+    keys[scan->off] = '\0';
+
+    clen = strlen(cursor);
+    memcpy(keys - clen, cursor, clen);
+
+    return keys - clen;
+}
+/*---------------------------------------------------------------------------*/
+/* stores the value of a CREATE or UPDATE, compressed when it is at least
+ * ctx->compress_min bytes and compresses well. an owned value (a framed
+ * body) is adopted in any case. returns what hash_insert/update() do. */
+static int
+skvs_store(struct skvs_ctx *ctx, enum CMD cmd, const char *key,
+           char *value, size_t value_size, int owned)
+{
+    char *zvalue = NULL;
+    size_t zsize;
+    int ret;
 
-            /* check for extra tokens after value */
-            if (strtok(NULL, " ") != NULL)
+    if (ctx->compress_min && value_size >= ctx->compress_min)
+    {
+        zvalue = hash_compress(value, value_size, &zsize);
+    }
+    if (zvalue)
+    {
+        ret = cmd == CMD_CREATE
+                  ? hash_insert_owned(ctx->table, key, zvalue, zsize,
+                                      NODE_COMPRESSED)
+                  : hash_update_owned(ctx->table, key, zvalue, zsize,
+                                      NODE_COMPRESSED);
+        if (ret != 1)
+        {
+            free(zvalue);
+        }
+        if (owned)
+        {
+            free(value);
+        }
+        return ret;
+    }
+
+    if (!owned)
+    {
+        return cmd == CMD_CREATE ? hash_insert(ctx->table, key, value)
+                                 : hash_update(ctx->table, key, value);
+    }
+    ret = cmd == CMD_CREATE
+              ? hash_insert_owned(ctx->table, key, value, value_size, 0)
+              : hash_update_owned(ctx->table, key, value, value_size, 0);
+    if (ret != 1)
+    {
+        free(value);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* fills iov with the reply to READ or READC of a found value.
+ * returns the number of iovec entries filled, or -1 on errors. */
+static int
+skvs_reply_value(enum CMD cmd, const char *value, size_t value_size,
+                 int flags, struct iovec *iov)
+{
+    size_t raw;
+    char *tmp;
+    long n;
+
+    if (flags & NODE_COMPRESSED)
+    {
+        raw = compressed_raw_size(value);
+        if (cmd == CMD_READC)
+        {
+            iov[0].iov_base = t_frame;
+            iov[0].iov_len = sprintf(t_frame, "#%zu %zu%s",
+                                     value_size - COMPRESSED_HDR, raw,
+                                     g_crlf);
+            iov[1].iov_base = (void *)(value + COMPRESSED_HDR);
+            iov[1].iov_len = value_size - COMPRESSED_HDR;
+            iov[2].iov_base = (void *)g_crlf;
+            iov[2].iov_len = strlen(g_crlf);
+            return 3;
+        }
+
+        if (raw >= t_raw_cap)
+        {
+            tmp = realloc(t_raw, raw + 1);
+            if (!tmp)
             {
-                /* extra tokens found */
-                return CMD_INVALID;
+                return -1;
             }
+            t_raw = tmp;
+            t_raw_cap = raw + 1;
+        }
+        n = hash_decompress(value, value_size, t_raw, t_raw_cap);
+        if (n < 0)
+        {
+            return -1;
+        }
+        value = t_raw;
+        value_size = n;
+    }
+
+    if (value_size > MAX_VALUE_LEN || value[0] == '#' ||
+        memchr(value, g_crlf[0], value_size))
+    {
+        /* "#<len>\n<value>\n", the value is sent from where it is */
+        iov[0].iov_base = t_frame;
+        iov[0].iov_len = sprintf(t_frame, "#%zu%s", value_size, g_crlf);
+        iov[1].iov_base = (void *)value;
+        iov[1].iov_len = value_size;
+        iov[2].iov_base = (void *)g_crlf;
+        iov[2].iov_len = strlen(g_crlf);
+        return 3;
+    }
+    iov[0].iov_base = (void *)value;
+    iov[0].iov_len = value_size;
+    iov[1].iov_base = (void *)g_crlf;
+    iov[1].iov_len = strlen(g_crlf);
+
+    return 2;
+}
+/*---------------------------------------------------------------------------*/
+/* appends a reply to t_mget, the per-thread buffer a response made of
+ * several replies is gathered in */
+static int
+skvs_gather(const struct iovec *iov, int cnt)
+{
+    size_t total = 0, cap;
+    char *tmp;
+    int j;
+
+    for (j = 0; j < cnt; j++)
+    {
+        total += iov[j].iov_len;
+    }
+    if (t_mget_len + total > t_mget_cap)
+    {
+        cap = t_mget_cap ? t_mget_cap : BUFFER_SIZE;
+        while (cap < t_mget_len + total)
+        {
+            cap *= 2;
+        }
+        tmp = realloc(t_mget, cap);
+        if (!tmp)
+        {
+            return -1;
+        }
+        t_mget = tmp;
+        t_mget_cap = cap;
+    }
+    for (j = 0; j < cnt; j++)
+    {
+        memcpy(t_mget + t_mget_len, iov[j].iov_base, iov[j].iov_len);
+        t_mget_len += iov[j].iov_len;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* appends the reply line of a message to t_mget */
+static int
+skvs_gather_msg(enum MSG msg)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void *)g_msgs[msg];
+    iov[0].iov_len = strlen(g_msgs[msg]);
+    iov[1].iov_base = (void *)g_crlf;
+    iov[1].iov_len = strlen(g_crlf);
+
+    return skvs_gather(iov, 2);
+}
+/*---------------------------------------------------------------------------*/
+/* appends the READ reply of one MGET key to t_mget; called with the
+ * bucket of the key read-locked, so the value is copied out in time */
+static int
+skvs_mget_value(void *arg, int i, const char *value, size_t value_size,
+                int flags)
+{
+    struct iovec iov[SKVS_RESP_IOV];
+    int cnt;
+
+    cnt = value ? skvs_reply_value(CMD_READ, value, value_size, flags, iov)
+                : 0;
+    if (cnt <= 0)
+    {
+        return skvs_gather_msg(value ? MSG_INTERNAL_ERR : MSG_NOT_FOUND);
+    }
+
+    return skvs_gather(iov, cnt);
+}
+/*---------------------------------------------------------------------------*/
+/* what the leader of a READ flight needs while the bucket is locked */
+struct skvs_lead
+{
+    struct skvs_ctx *ctx;
+    struct flight *fl;
+    struct hot_ticket *ticket;
+    const char *key;
+};
+/*---------------------------------------------------------------------------*/
+/* gathers the READ reply of the leader of a flight, called with the
+ * bucket read-locked, and seals the flight before the lock goes */
+static int
+skvs_lead_value(void *arg, int i, const char *value, size_t value_size,
+                int flags)
+{
+    struct skvs_lead *lead = arg;
+    int ret;
+
+    if (value && flags == 0)
+    {
+        hot_fill(lead->ctx->hot, lead->ticket, lead->key, value, value_size);
+    }
+    ret = skvs_mget_value(NULL, i, value, value_size, flags);
+    flight_seal(lead->ctx->flights, lead->fl);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* serves a READ of key as part of the flight of the READs of key that
+ * run at the same time (see flight.h).
+ * returns the number of iovec entries filled, or 0 when the caller has
+ * to read alone. */
+static int
+skvs_read_shared(struct skvs_ctx *ctx, const char *key,
+                 struct hot_ticket *ticket, struct iovec *iov)
+{
+    struct skvs_lead lead = {ctx, NULL, ticket, key};
+    struct iovec reply;
+    int ret;
+
+    t_mget_len = 0;
+    ret = flight_join(ctx->flights, key, &lead.fl);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    if (ret == 0)
+    {
+        reply.iov_base = lead.fl->reply;
+        reply.iov_len = lead.fl->reply_len;
+        ret = lead.fl->reply && skvs_gather(&reply, 1) == 0;
+        flight_leave(ctx->flights, lead.fl);
+    }
+    else
+    {
+        ret = hash_search_batch(ctx->table, &key, 1, skvs_lead_value,
+                                &lead) >= 0;
+        flight_land(ctx->flights, lead.fl, ret ? t_mget : NULL, t_mget_len);
+    }
+    if (!ret)
+    {
+        return 0;
+    }
+    iov[0].iov_base = t_mget;
+    iov[0].iov_len = t_mget_len;
 
-            /* return the corresponding command enum */
-            return i;
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* what a READ needs to copy its reply out while the bucket is locked */
+struct skvs_copy
+{
+    struct skvs_ctx *ctx;
+    enum CMD cmd;
+    struct hot_ticket *ticket;
+    const char *key;
+    const struct skvs_out *out;
+    struct iovec *iov; // set to the reply when the key is found
+    int cnt;           // iovec entries of the reply
+};
+/*---------------------------------------------------------------------------*/
+/* copies the READ reply of a found value to the room of the caller, or to
+ * t_mget when it does not fit there; called with the bucket read-locked,
+ * as the value may be changed or freed once the lock goes */
+static int
+skvs_copy_value(void *arg, int i, const char *value, size_t value_size,
+                int flags)
+{
+    struct skvs_copy *cp = arg;
+    struct iovec iov[SKVS_RESP_IOV];
+    size_t total = 0;
+    char *dst;
+    int cnt, j;
+
+    if (!value)
+    {
+        return 0;
+    }
+    if (flags == 0)
+    {
+        hot_fill(cp->ctx->hot, cp->ticket, cp->key, value, value_size);
+    }
+    cnt = skvs_reply_value(cp->cmd, value, value_size, flags, iov);
+    if (cnt < 0)
+    {
+        return -1;
+    }
+    if (t_in_multi)
+    {
+        /* the block keeps its buckets until its replies are gathered */
+        memcpy(cp->iov, iov, cnt * sizeof(*iov));
+        cp->cnt = cnt;
+        return 0;
+    }
+
+    for (j = 0; j < cnt; j++)
+    {
+        total += iov[j].iov_len;
+    }
+    if (cp->out && total <= cp->out->room)
+    {
+        dst = cp->out->buf;
+        for (j = 0; j < cnt; j++)
+        {
+            memcpy(dst, iov[j].iov_base, iov[j].iov_len);
+            dst += iov[j].iov_len;
+        }
+        dst = cp->out->buf;
+    }
+    else
+    {
+        t_mget_len = 0;
+        if (skvs_gather(iov, cnt) < 0)
+        {
+            return -1;
+        }
+        dst = t_mget;
+    }
+    cp->iov->iov_base = dst;
+    cp->iov->iov_len = total;
+    cp->cnt = 1;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* fills iov with the replies to the n keys of an MGET, one per key even
+ * when the lookup fails, so the client stays in step.
+ * returns the number of iovec entries filled. */
+static int
+skvs_mget(struct skvs_ctx *ctx, const char **keys, int n, struct iovec *iov)
+{
+    size_t len;
+    int i;
+
+    t_mget_len = 0;
+    if (hash_search_batch(ctx->table, keys, n, skvs_mget_value, NULL) < 0)
+    {
+        /* n short lines always fit in t_resp */
+        len = strlen(g_msgs[MSG_INTERNAL_ERR]);
+        for (i = 0; i < n; i++)
+        {
+            memcpy(t_resp + i * (len + 1), g_msgs[MSG_INTERNAL_ERR], len);
+            t_resp[i * (len + 1) + len] = g_crlf[0];
+        }
+        iov[0].iov_base = t_resp;
+        iov[0].iov_len = n * (len + 1);
+        return 1;
+    }
+    iov[0].iov_base = t_mget;
+    iov[0].iov_len = t_mget_len;
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+struct skvs_ctx *
+skvs_init(size_t hash_size, int delay, int flags)
+{
+    TRACE_PRINT();
+    struct skvs_ctx *ctx = calloc(1, sizeof(struct skvs_ctx));
+    /* initialize the global hash table */
+    ctx->table = hash_init(hash_size, delay, flags);
+    if (ctx->table == NULL)
+    {
+        DEBUG_PRINT("Failed to initialize global hash table");
+        return NULL;
+    }
+    ctx->export_path = NULL;
+    pthread_mutex_init(&ctx->export_lock, NULL);
+
+    /* mutations are logged for replicas through the table hook */
+    ctx->repl = repl_init(ctx->table);
+    if (ctx->repl == NULL)
+    {
+        DEBUG_PRINT("Failed to initialize replication");
+        hash_destroy(ctx->table);
+        free(ctx);
+        return NULL;
+    }
+
+    /* hot keys are tracked from READs, cached copies are invalidated
+     * through the table hook as well */
+    ctx->hot = hot_init(ctx->table);
+    if (ctx->hot == NULL)
+    {
+        DEBUG_PRINT("Failed to initialize hot-key tracking");
+        repl_destroy(ctx->repl);
+        hash_destroy(ctx->table);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_destroy(struct skvs_ctx *ctx, int dump)
+{
+    TRACE_PRINT();
+    if (dump)
+    {
+        if (ctx->export_path)
+        {
+            skvs_export(ctx);
+        }
+        else
+        {
+            hash_dump(ctx->table);
+        }
+    }
+    if (ctx->shm)
+    {
+        shm_destroy(ctx->shm);
+    }
+    if (ctx->flights)
+    {
+        flight_destroy(ctx->flights);
+    }
+    hot_destroy(ctx->hot);
+    repl_destroy(ctx->repl);
+    if (hash_destroy(ctx->table) < 0)
+    {
+        return -1;
+    }
+    free(ctx);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* threads an export uses, one per CPU up to SKVS_EXPORT_THREADS */
+static int
+export_threads(void)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    if (nthreads > SKVS_EXPORT_THREADS)
+    {
+        nthreads = SKVS_EXPORT_THREADS;
+    }
+
+    return nthreads;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_export(struct skvs_ctx *ctx)
+{
+    TRACE_PRINT();
+    char tmp_path[PATH_MAX];
+    int fd, ret, nthreads = export_threads();
+
+    if (ctx->export_path == NULL)
+    {
+        return -1;
+    }
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp",
+                 ctx->export_path) >= sizeof(tmp_path))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->export_lock);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        pthread_mutex_unlock(&ctx->export_lock);
+        return -1;
+    }
+    ret = hash_export(ctx->table, fd, nthreads);
+    if (close(fd) < 0)
+    {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp_path, ctx->export_path) < 0)
+    {
+        ret = -1;
+    }
+    if (ret < 0)
+    {
+        unlink(tmp_path);
+    }
+
+    pthread_mutex_unlock(&ctx->export_lock);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_snapshot(struct skvs_ctx *ctx, int fd)
+{
+    TRACE_PRINT();
+    return hash_export(ctx->table, fd, export_threads());
+}
+/*---------------------------------------------------------------------------*/
+int skvs_restore(struct skvs_ctx *ctx, int fd)
+{
+    TRACE_PRINT();
+    return repl_load(ctx->repl, fd);
+}
+/*---------------------------------------------------------------------------*/
+/* whether the request line of len bytes is cmd alone, e.g., "SYNC\n" */
+static inline int
+skvs_is_cmd(const char *line, size_t len, enum CMD cmd)
+{
+    size_t n = strlen(g_cmds[cmd]);
+
+    return len == n + 1 && strncasecmp(line, g_cmds[cmd], n) == 0 &&
+           line[n] == g_crlf[0];
+}
+/*---------------------------------------------------------------------------*/
+int skvs_is_sync(const char *line, size_t len)
+{
+    return skvs_is_cmd(line, len, CMD_SYNC);
+}
+/*---------------------------------------------------------------------------*/
+int skvs_is_multi(const char *line, size_t len)
+{
+    return skvs_is_cmd(line, len, CMD_MULTI);
+}
+/*---------------------------------------------------------------------------*/
+size_t skvs_multi_len(const char *rbuf, size_t rlen)
+{
+    const char *line, *nl, *end = rbuf + rlen;
+
+    nl = memchr(rbuf, g_crlf[0], rlen);
+    for (line = nl + 1; nl && line < end; line = nl + 1)
+    {
+        nl = memchr(line, g_crlf[0], end - line);
+        if (nl == NULL)
+        {
+            break;
+        }
+        if (skvs_is_cmd(line, nl - line + 1, CMD_EXEC))
+        {
+            return nl + 1 - rbuf;
+        }
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_sync(struct skvs_ctx *ctx, int fd, volatile sig_atomic_t *stop)
+{
+    TRACE_PRINT();
+    return repl_sync(ctx->repl, fd, stop);
+}
+/*---------------------------------------------------------------------------*/
+ssize_t skvs_frame_len(const char *line, size_t len)
+{
+    TRACE_PRINT();
+    const char *tok;
+    size_t cmd_len, n = 0;
+
+    /* strip the line feed */
+    if (len > 0 && line[len - 1] == g_crlf[0])
+    {
+        len--;
+    }
+
+    /* the command must be CREATE or UPDATE */
+    for (cmd_len = 0; cmd_len < len && line[cmd_len] != ' '; cmd_len++)
+        ;
+    if (cmd_len != 6 || (strncasecmp(line, g_cmds[CMD_CREATE], 6) &&
+                         strncasecmp(line, g_cmds[CMD_UPDATE], 6)))
+    {
+        return -1;
+    }
+
+    /* and the last token must be '#' followed by digits */
+    for (tok = line + len; tok > line && tok[-1] != ' '; tok--)
+        ;
+    if (tok == line || tok >= line + len || *tok != '#' ||
+        tok + 1 == line + len)
+    {
+        return -1;
+    }
+    for (tok++; tok < line + len; tok++)
+    {
+        if (!isdigit((unsigned char)*tok))
+        {
+            return -1;
+        }
+        /* saturate, anything above MAX_BODY_LEN is refused anyway */
+        if (n <= MAX_BODY_LEN)
+        {
+            n = n * 10 + (*tok - '0');
         }
     }
 
-    /* command not recognized */
-    return CMD_INVALID;
+    return n;
 }
 /*---------------------------------------------------------------------------*/
-struct skvs_ctx *
-skvs_init(size_t hash_size, int delay)
+/* copies the key of the plain UPDATE line of len bytes to key.
+ * returns -1 when the line is anything else. */
+static int
+skvs_update_key(const char *line, size_t len, char *key)
 {
-    TRACE_PRINT();
-    struct skvs_ctx *ctx = calloc(1, sizeof(struct skvs_ctx));
-    /* initialize the global hash table */
-    ctx->table = hash_init(hash_size, delay);
-    if (ctx->table == NULL)
+    char buf[BUFFER_SIZE];
+    const char *args[SKVS_MAX_ARGS];
+    int nargs = 0;
+
+    if (len > BUFFER_SIZE || skvs_frame_len(line, len) >= 0)
     {
-        DEBUG_PRINT("Failed to initialize global hash table");
-        return NULL;
+        return -1;
+    }
+    memcpy(buf, line, len);
+    if (skvs_parse(buf, len, args, &nargs) != CMD_UPDATE)
+    {
+        return -1;
     }
+    strcpy(key, args[0]);
 
-    return ctx;
+    return 0;
 }
 /*---------------------------------------------------------------------------*/
-int skvs_destroy(struct skvs_ctx *ctx, int dump)
+int skvs_update_run(const char *rbuf, size_t rlen, size_t *len)
 {
-    TRACE_PRINT();
-    if (dump)
-    {
-        hash_dump(ctx->table);
-    }
-    if (hash_destroy(ctx->table) < 0)
+    char first[MAX_KEY_LEN + 1], key[MAX_KEY_LEN + 1];
+    const char *line = rbuf, *nl, *end = rbuf + rlen;
+    int n = 0;
+
+    *len = 0;
+    for (; n < SKVS_UPDATE_RUN && line < end; line = nl + 1, n++)
     {
-        return -1;
+        nl = memchr(line, g_crlf[0], end - line);
+        if (nl == NULL ||
+            skvs_update_key(line, nl - line + 1, n ? key : first) < 0 ||
+            (n && strcmp(key, first) != 0))
+        {
+            break;
+        }
+        *len = nl + 1 - rbuf;
     }
 
-    return 0;
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+/* writes the bucket lock policy and waits for STATS, in microseconds */
+static int
+skvs_lock_stats(struct skvs_ctx *ctx, char *buf, size_t len)
+{
+    struct rwlock_stats st = {0};
+    uint64_t reads, writes;
+
+    hash_lock_stats(ctx->table, &st);
+    reads = st.read_waits ? st.read_waits : 1;
+    writes = st.write_waits ? st.write_waits : 1;
+
+    return snprintf(buf, len,
+                    " lock=%s read_waits=%" PRIu64 " read_wait_us=%" PRIu64
+                    "/%" PRIu64 " write_waits=%" PRIu64
+                    " write_wait_us=%" PRIu64 "/%" PRIu64,
+                    g_rwlock_policies[ctx->table->lock_policy],
+                    st.read_waits, st.read_wait_ns / reads / 1000,
+                    st.read_wait_max_ns / 1000, st.write_waits,
+                    st.write_wait_ns / writes / 1000,
+                    st.write_wait_max_ns / 1000);
 }
 /*---------------------------------------------------------------------------*/
-const char *
-skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
+/* skvs_serve(), also telling the command and key it served */
+static int
+serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen, char *body,
+      size_t body_len, const struct skvs_out *out, struct iovec *iov,
+      enum CMD *cmdp, const char **keyp)
 {
     TRACE_PRINT();
-    const char *resp, *key = NULL, *value = NULL;
+    const char *resp, *key, *value = NULL;
+    const char *args[SKVS_MAX_ARGS];
     enum CMD cmd;
-    int ret;
+    int ret, flags, nargs = 0;
+    long long num;
+    uint64_t version;
+    char *vbuf, num_str[24];
+    struct skvs_scan scan;
+    struct hot_ticket ticket;
+    struct skvs_copy copy;
+    size_t value_size;
+    uint64_t start;
+    int framed = skvs_frame_len(rbuf, rlen) >= 0;
 
     /* parse the command */
-    cmd = skvs_parse(rbuf, rlen, &key, &value);
+    start = trace_begin();
+    cmd = skvs_parse(rbuf, rlen, args, &nargs);
+    key = nargs > 0 ? args[0] : NULL;
+    value = nargs > 1 ? args[1] : NULL;
+    trace_end(TRACE_EV_PARSE, NULL, NULL, start);
+    *cmdp = cmd;
+    *keyp = key;
+
+    if (ctx->read_only &&
+        (cmd == CMD_CREATE || cmd == CMD_UPDATE || cmd == CMD_DELETE ||
+         cmd == CMD_CAS || cmd == CMD_INCR || cmd == CMD_DECR ||
+         cmd == CMD_APPEND))
+    {
+        /* a replica only changes through the replication stream */
+        free(body);
+        iov[0].iov_base = (void *)g_msgs[MSG_READ_ONLY];
+        goto out;
+    }
+
+    if (framed && (cmd == CMD_CREATE || cmd == CMD_UPDATE))
+    {
+        if (body == NULL)
+        {
+            iov[0].iov_base = (void *)g_msgs[MSG_TOO_LARGE];
+            goto out;
+        }
+        ret = skvs_store(ctx, cmd, key, body, body_len, 1);
+        if (ret > 0)
+        {
+            resp = g_msgs[cmd == CMD_CREATE ? MSG_CREATE_OK : MSG_UPDATE_OK];
+        }
+        else if (ret == 0)
+        {
+            resp = g_msgs[cmd == CMD_CREATE ? MSG_COLLISION : MSG_NOT_FOUND];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        iov[0].iov_base = (void *)resp;
+        goto out;
+    }
+    free(body);
 
     /* handle request */
     switch (cmd)
@@ -169,7 +1012,7 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
         resp = NULL;
         break;
     case CMD_CREATE:
-        ret = hash_insert(ctx->table, key, value);
+        ret = skvs_store(ctx, cmd, key, (char *)value, strlen(value), 0);
         if (ret > 0)
         {
             resp = g_msgs[MSG_CREATE_OK];
@@ -184,22 +1027,47 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
         }
         break;
     case CMD_READ:
-        ret = hash_search(ctx->table, key, &value);
-        if (ret > 0)
+    case CMD_READC:
+        if (hot_lookup(ctx->hot, key, &ticket, &value, &value_size))
         {
-            resp = (const char *)value;
+            return skvs_reply_value(cmd, value, value_size, 0, iov);
         }
-        else if (ret == 0)
+        if (ctx->flights && cmd == CMD_READ && !t_in_multi &&
+            (ret = skvs_read_shared(ctx, key, &ticket, iov)) > 0)
         {
-            resp = g_msgs[MSG_NOT_FOUND];
+            return ret;
         }
-        else
+        /* short values are copied out without the bucket lock */
+        ret = hash_search_copy(ctx->table, key, t_short, sizeof(t_short),
+                               &value_size, &flags);
+        if (ret == 1)
         {
-            resp = g_msgs[MSG_INTERNAL_ERR];
+            if (flags == 0)
+            {
+                hot_fill(ctx->hot, &ticket, key, t_short, value_size);
+            }
+            ret = skvs_reply_value(cmd, t_short, value_size, flags, iov);
+            if (ret > 0)
+            {
+                return ret;
+            }
+            ret = -1;
         }
+        else if (ret == 2)
+        {
+            /* longer ones while the bucket is still locked */
+            copy = (struct skvs_copy){ctx, cmd, &ticket, key, out, iov, 0};
+            ret = hash_search_batch(ctx->table, &key, 1, skvs_copy_value,
+                                    &copy);
+            if (ret > 0)
+            {
+                return copy.cnt;
+            }
+        }
+        resp = g_msgs[ret == 0 ? MSG_NOT_FOUND : MSG_INTERNAL_ERR];
         break;
     case CMD_UPDATE:
-        ret = hash_update(ctx->table, key, value);
+        ret = skvs_store(ctx, cmd, key, (char *)value, strlen(value), 0);
         if (ret > 0)
         {
             resp = g_msgs[MSG_UPDATE_OK];
@@ -228,11 +1096,442 @@ skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen)
             resp = g_msgs[MSG_INTERNAL_ERR];
         }
         break;
+    case CMD_GETS:
+        /* leave room in front of the value for "<version> " */
+        vbuf = t_resp + 21;
+        ret = hash_gets(ctx->table, key, vbuf,
+                        sizeof(t_resp) - 21, &version);
+        if (ret == 2 || (ret == 1 && strchr(vbuf, g_crlf[0])))
+        {
+            /* only values that fit in a response line */
+            resp = g_msgs[MSG_TOO_LARGE];
+        }
+        else if (ret > 0)
+        {
+            ret = sprintf(num_str, "%" PRIu64 " ", version);
+            memcpy(vbuf - ret, num_str, ret);
+            resp = vbuf - ret;
+        }
+        else if (ret == 0)
+        {
+            resp = g_msgs[MSG_NOT_FOUND];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_CAS:
+        if (skvs_parse_ull(args[1], &version) < 0)
+        {
+            resp = g_msgs[MSG_INVALID];
+            break;
+        }
+        ret = hash_cas(ctx->table, key, args[2], version);
+        if (ret == 1)
+        {
+            resp = g_msgs[MSG_CAS_OK];
+        }
+        else if (ret == 2)
+        {
+            resp = g_msgs[MSG_MISMATCH];
+        }
+        else if (ret == 0)
+        {
+            resp = g_msgs[MSG_NOT_FOUND];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_INCR:
+    case CMD_DECR:
+        num = 1;
+        if (value && (skvs_parse_ll(value, &num) < 0 || num == LLONG_MIN))
+        {
+            resp = g_msgs[MSG_INVALID];
+            break;
+        }
+        ret = hash_incr(ctx->table, key, cmd == CMD_INCR ? num : -num, &num);
+        if (ret == 1)
+        {
+            sprintf(t_resp, "%lld", num);
+            resp = t_resp;
+        }
+        else if (ret == 2)
+        {
+            resp = g_msgs[MSG_NOT_NUMBER];
+        }
+        else if (ret == 0)
+        {
+            resp = g_msgs[MSG_NOT_FOUND];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_APPEND:
+        ret = hash_append(ctx->table, key, value, MAX_BODY_LEN);
+        if (ret == 1)
+        {
+            resp = g_msgs[MSG_APPEND_OK];
+        }
+        else if (ret == 2)
+        {
+            resp = g_msgs[MSG_TOO_LARGE];
+        }
+        else if (ret == 0)
+        {
+            resp = g_msgs[MSG_NOT_FOUND];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_RANGE:
+    case CMD_PREFIX:
+        memset(&scan, 0, sizeof(scan));
+        if (skvs_parse_ll(args[cmd == CMD_RANGE ? 2 : 1], &num) < 0 || num <= 0)
+        {
+            resp = g_msgs[MSG_INVALID];
+            break;
+        }
+        if (ctx->table->index == NULL)
+        {
+            resp = g_msgs[MSG_NO_INDEX];
+            break;
+        }
+        scan.limit = num;
+        if (cmd == CMD_RANGE)
+        {
+            /* "-" leaves a bound open */
+            if (strcmp(args[1], "-") != 0)
+            {
+                scan.end = args[1];
+            }
+            resp = skvs_scan(ctx, &scan, strcmp(key, "-") ? key : NULL);
+        }
+        else
+        {
+            scan.prefix = key;
+            scan.prefix_len = strlen(key);
+            resp = skvs_scan(ctx, &scan,
+                             nargs > 2 && strcmp(args[2], key) > 0 ? args[2]
+                                                                   : key);
+        }
+        break;
+    case CMD_SCAN:
+        num = SKVS_SCAN_COUNT;
+        if (skvs_parse_ull(key, &version) < 0 ||
+            (value && (skvs_parse_ll(value, &num) < 0 || num <= 0)))
+        {
+            resp = g_msgs[MSG_INVALID];
+            break;
+        }
+        {
+            /* keys go after room for the next cursor */
+            char *keys = t_resp + 21;
+            size_t cursor = version;
+            ssize_t n = hash_scan(ctx->table, &cursor, num, keys,
+                                  sizeof(t_resp) - 21);
+            if (n < 0)
+            {
+                resp = g_msgs[MSG_INTERNAL_ERR];
+                break;
+            }
+            ret = sprintf(num_str, "%zu", cursor);
+            memcpy(keys - ret, num_str, ret);
+            resp = keys - ret;
+        }
+        break;
+    case CMD_EXPORT:
+        if (ctx->export_path == NULL)
+        {
+            resp = g_msgs[MSG_INVALID];
+        }
+        else if (skvs_export(ctx) == 0)
+        {
+            resp = g_msgs[MSG_EXPORT_OK];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INTERNAL_ERR];
+        }
+        break;
+    case CMD_TRACE:
+        if (ctx->trace_path == NULL)
+        {
+            resp = g_msgs[MSG_INVALID];
+        }
+        else if (strcasecmp(key, "on") == 0 || strcasecmp(key, "off") == 0)
+        {
+            trace_enable(strcasecmp(key, "on") == 0);
+            resp = g_msgs[MSG_TRACE_OK];
+        }
+        else if (strcasecmp(key, "dump") == 0)
+        {
+            resp = trace_dump(ctx->trace_path) >= 0 ? g_msgs[MSG_TRACE_OK]
+                                                     : g_msgs[MSG_INTERNAL_ERR];
+        }
+        else
+        {
+            resp = g_msgs[MSG_INVALID];
+        }
+        break;
+    case CMD_STATS:
+        ret = snprintf(t_resp, sizeof(t_resp),
+                       "entries=%zu version=%" PRIu64,
+                       __atomic_load_n(&ctx->table->total_entries,
+                                       __ATOMIC_RELAXED),
+                       __atomic_load_n(&ctx->table->version_seq,
+                                       __ATOMIC_RELAXED));
+        ret += snprintf(t_resp + ret, sizeof(t_resp) - ret,
+                        " conns=%d rejected=%" PRIu64,
+                        __atomic_load_n(&ctx->conns, __ATOMIC_RELAXED),
+                        __atomic_load_n(&ctx->rejected, __ATOMIC_RELAXED));
+        if (ctx->pool)
+        {
+            ret += pool_stats(ctx->pool, t_resp + ret, sizeof(t_resp) - ret);
+        }
+        ret += snprintf(t_resp + ret, sizeof(t_resp) - ret,
+                        " coalesced_reads=%" PRIu64
+                        " coalesced_updates=%" PRIu64,
+                        ctx->flights ? __atomic_load_n(&ctx->flights->shared,
+                                                       __ATOMIC_RELAXED) : 0,
+                        __atomic_load_n(&ctx->coalesced_updates,
+                                        __ATOMIC_RELAXED));
+        ret += skvs_lock_stats(ctx, t_resp + ret, sizeof(t_resp) - ret);
+        ret += hot_stats(ctx->hot, t_resp + ret, sizeof(t_resp) - ret);
+        if (ctx->shm)
+            ret += shm_stats(ctx->shm, t_resp + ret, sizeof(t_resp) - ret);
+        repl_stats(ctx->repl, t_resp + ret, sizeof(t_resp) - ret);
+        resp = t_resp;
+        break;
+    case CMD_MGET:
+        return skvs_mget(ctx, args, nargs, iov);
+    case CMD_SYNC:
     case CMD_INVALID:
     default:
         resp = g_msgs[MSG_INVALID];
         break;
     }
+    if (resp == NULL)
+    {
+        return 0;
+    }
+    iov[0].iov_base = (void *)resp;
+
+out:
+    iov[0].iov_len = strlen(iov[0].iov_base);
+    iov[1].iov_base = (void *)g_crlf;
+    iov[1].iov_len = strlen(g_crlf);
+
+    return 2;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen,
+               char *body, size_t body_len, const struct skvs_out *out,
+               struct iovec *iov)
+{
+    enum CMD cmd = CMD_INVALID;
+    const char *key = NULL;
+    uint64_t start = trace_begin();
+    int ret;
+
+    ret = serve(ctx, rbuf, rlen, body, body_len, out, iov, &cmd, &key);
+    if (ret > 0)
+    {
+        trace_end(TRACE_EV_OP, cmd >= 0 ? g_cmds[cmd] : NULL, key, start);
+    }
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* checks that the request line of len bytes may be part of a MULTI block,
+ * and copies its key out. only point operations are, with no framed
+ * value, and with their numbers well-formed, so that nothing the block
+ * asks for is refused before it is applied.
+ * returns -1 when the request may not be part of the block. */
+static int
+skvs_multi_op(const char *line, size_t len, char *key)
+{
+    char buf[BUFFER_SIZE];
+    const char *args[SKVS_MAX_ARGS];
+    long long num;
+    uint64_t version;
+    int nargs = 0;
+
+    if (len > BUFFER_SIZE || skvs_frame_len(line, len) >= 0)
+    {
+        return -1;
+    }
+    memcpy(buf, line, len);
+
+    switch (skvs_parse(buf, len, args, &nargs))
+    {
+    case CMD_CREATE:
+    case CMD_READ:
+    case CMD_UPDATE:
+    case CMD_DELETE:
+    case CMD_GETS:
+    case CMD_APPEND:
+        break;
+    case CMD_CAS:
+        if (skvs_parse_ull(args[1], &version) < 0)
+        {
+            return -1;
+        }
+        break;
+    case CMD_INCR:
+    case CMD_DECR:
+        if (nargs > 1 && (skvs_parse_ll(args[1], &num) < 0 || num == LLONG_MIN))
+        {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+    strcpy(key, args[0]);
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_serve_multi(struct skvs_ctx *ctx, char *rbuf, size_t rlen,
+                     struct iovec *iov)
+{
+    TRACE_PRINT();
+    char keys[MULTI_MAX_OPS][MAX_KEY_LEN + 1];
+    const char *keyp[MULTI_MAX_OPS], *key;
+    char *lines[MULTI_MAX_OPS], *line, *nl, *exec;
+    size_t lens[MULTI_MAX_OPS];
+    int valid[MULTI_MAX_OPS];
+    struct iovec resp[SKVS_RESP_IOV];
+    enum CMD cmd;
+    uint64_t start = trace_begin();
+    int i, cnt, n = 0, aborted = 0, ret = 0;
+
+    /* the requests between the MULTI line and the EXEC line */
+    exec = rbuf + rlen - (strlen(g_cmds[CMD_EXEC]) + 1);
+    line = (char *)memchr(rbuf, g_crlf[0], rlen) + 1;
+    for (; line < exec; line = nl + 1, n++)
+    {
+        nl = memchr(line, g_crlf[0], exec - line);
+        if (n >= MULTI_MAX_OPS)
+        {
+            aborted = 1;
+            continue;
+        }
+        lines[n] = line;
+        lens[n] = nl - line + 1;
+        keyp[n] = keys[n];
+        valid[n] = skvs_multi_op(line, lens[n], keys[n]) == 0;
+        if (!valid[n])
+        {
+            aborted = 1;
+        }
+    }
+
+    t_mget_len = 0;
+    if (aborted)
+    {
+        /* nothing is applied, the requests at fault are told apart */
+        for (i = 0; i < n && ret == 0; i++)
+        {
+            ret = skvs_gather_msg(i >= MULTI_MAX_OPS || !valid[i]
+                                      ? MSG_INVALID
+                                      : MSG_ABORTED);
+        }
+    }
+    else if (hash_txn_begin(ctx->table, keyp, n) < 0)
+    {
+        for (i = 0; i < n && ret == 0; i++)
+        {
+            ret = skvs_gather_msg(MSG_INTERNAL_ERR);
+        }
+    }
+    else
+    {
+        /* the replies are gathered before the buckets are released */
+        t_in_multi = 1;
+        for (i = 0; i < n; i++)
+        {
+            cnt = serve(ctx, lines[i], lens[i], NULL, 0, NULL, resp, &cmd,
+                        &key);
+            if (ret == 0)
+            {
+                ret = skvs_gather(resp, cnt);
+            }
+        }
+        t_in_multi = 0;
+        hash_txn_end(ctx->table);
+    }
+    if (ret < 0)
+    {
+        return -1;
+    }
+    trace_end(TRACE_EV_OP, g_cmds[CMD_MULTI], NULL, start);
+    if (t_mget_len == 0)
+    {
+        return 0;
+    }
+
+    iov[0].iov_base = t_mget;
+    iov[0].iov_len = t_mget_len;
+
+    return 1;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_prefetch(struct skvs_ctx *ctx, const char *rbuf, size_t rlen)
+{
+    char keys[HASH_BATCH][MAX_KEY_LEN + 1];
+    const char *ptrs[HASH_BATCH], *end = rbuf + rlen, *nl, *key;
+    size_t klen;
+    int n = 0, lines;
+
+    for (lines = 0; lines < HASH_BATCH && rbuf < end; lines++, rbuf = nl + 1)
+    {
+        nl = memchr(rbuf, g_crlf[0], end - rbuf);
+        if (nl == NULL)
+        {
+            break;
+        }
+        if (nl - rbuf <= 5 || strncasecmp(rbuf, g_cmds[CMD_READ], 4) != 0 ||
+            rbuf[4] != ' ')
+        {
+            continue;
+        }
+        key = rbuf + 5;
+        klen = nl - key;
+        if (klen > MAX_KEY_LEN || memchr(key, ' ', klen))
+        {
+            continue;
+        }
+        memcpy(keys[n], key, klen);
+        keys[n][klen] = '\0';
+        ptrs[n] = keys[n];
+        n++;
+    }
 
-    return resp;
-}
\ No newline at end of file
+    /* a single read gains nothing from it */
+    if (n > 1)
+    {
+        hash_prefetch(ctx->table, ptrs, n);
+    }
+}
+/*---------------------------------------------------------------------------*/
+void skvs_thread_exit(void)
+{
+    TRACE_PRINT();
+    free(t_raw);
+    t_raw = NULL;
+    t_raw_cap = 0;
+    free(t_mget);
+    t_mget = NULL;
+    t_mget_len = t_mget_cap = 0;
+    hot_thread_exit();
+    trace_thread_exit();
+}
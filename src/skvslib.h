@@ -6,9 +6,21 @@
 #define _SKVSLIB_H
 /*---------------------------------------------------------------------------*/
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "hashtable.h"
+#include "repl.h"
+#include "hotkey.h"
+#include "trace.h"
+#include "shm.h"
+#include "flight.h"
+#include "pool.h"
 #include "common.h"
 /*---------------------------------------------------------------------------*/
 /* response message indices */
@@ -21,8 +33,20 @@ enum MSG
     MSG_UPDATE_OK,
     MSG_DELETE_OK,
     MSG_INTERNAL_ERR,
+    MSG_CAS_OK,
+    MSG_MISMATCH,
+    MSG_APPEND_OK,
+    MSG_NOT_NUMBER,
+    MSG_TOO_LARGE,
+    MSG_NO_INDEX,
+    MSG_EXPORT_OK,
+    MSG_READ_ONLY,
+    MSG_BUSY,
+    MSG_TRACE_OK,
+    MSG_ABORTED,
     MSG_COUNT
 };
+extern const char *g_msgs[MSG_COUNT];
 /* command indices */
 enum CMD
 {
@@ -32,39 +56,219 @@ enum CMD
     CMD_READ,
     CMD_UPDATE,
     CMD_DELETE,
+    CMD_GETS,
+    CMD_CAS,
+    CMD_INCR,
+    CMD_DECR,
+    CMD_APPEND,
+    CMD_RANGE,
+    CMD_PREFIX,
+    CMD_SCAN,
+    CMD_EXPORT,
+    CMD_READC,
+    CMD_STATS,
+    CMD_SYNC,
+    CMD_TRACE,
+    CMD_MGET,
+    CMD_MULTI,
+    CMD_EXEC,
     CMD_COUNT
 };
+/* maximum number of arguments following a command, the keys of an MGET */
+#define SKVS_MAX_ARGS MGET_MAX_KEYS
+/* number of keys a SCAN returns when no count is given */
+#define SKVS_SCAN_COUNT 10
+/* number of iovec entries a response may use */
+#define SKVS_RESP_IOV 3
+/* upper bound of the UPDATEs of one key merged by skvs_update_run() */
+#define SKVS_UPDATE_RUN 64
+/* upper bound of threads used by an export */
+#define SKVS_EXPORT_THREADS 8
 /*---------------------------------------------------------------------------*/
 /* SKVS context */
 struct skvs_ctx {
     int sock;
     hashtable_t *table;
+
+    /* export destination, NULL when exports are disabled */
+    const char *export_path;
+    pthread_mutex_t export_lock; // one export at a time
+
+    /* CREATE and UPDATE values of at least this many bytes are stored
+     * compressed, 0 disables compression */
+    size_t compress_min;
+
+    /* replication state; a replica refuses mutations with READ ONLY */
+    struct repl *repl;
+    int read_only;
+    /* READ frequencies, and per-thread caches of hot values when
+     * hot->cache is set */
+    struct hotkeys *hot;
+    /* where TRACE DUMP writes, NULL when tracing is disabled */
+    const char *trace_path;
+    /* shared-memory mirror for local readers, NULL when disabled */
+    struct shm_mirror *shm;
+    /* READs of a key in flight, shared by the READs of the same key that
+     * run at the same time, NULL when READs are not coalesced */
+    struct flights *flights;
+    /* UPDATEs answered without being applied, as the next one in the same
+     * batch overwrote them (see skvs_update_run()) */
+    uint64_t coalesced_updates;
+    /* admission control, maintained by the server */
+    int conns;         // connections open
+    uint64_t rejected; // connections refused with BUSY
+    /* workers serving the connections, set by the server */
+    struct pool *pool;
 };
 /*---------------------------------------------------------------------------*/
 /**
  * initiates SKVS context including a thread-safe global hash table.
+ * flags are passed to hash_init() (e.g., HASH_ORDERED).
  * returns NULL when any internal errors occur.
  * returns the SKVS context pointer on success.
  */
-struct skvs_ctx *skvs_init(size_t hash_size, int delay);
+struct skvs_ctx *skvs_init(size_t hash_size, int delay, int flags);
 /*---------------------------------------------------------------------------*/
 /**
  * destroys SKVS context and the hash table.
- * when set dump, dumps the hash table before destroy it.
+ * when set dump, exports the hash table if ctx->export_path is set,
+ * or dumps it to stdout otherwise, before destroy it.
  * returns -1 when any internal errors occur.
  * returns 0 on success.
  */
 int skvs_destroy(struct skvs_ctx *ctx, int dump);
 /*---------------------------------------------------------------------------*/
 /**
- * returns the complete SKVS commands for the given request on success
- * returns NULL when the request is incomplete.
- * 
- * !Caveat!
- * The return value has no line feed.
- * You should copy the return value to application buffer,
- * and add a line feed at the end.
+ * exports the hash table to ctx->export_path in the hash_export() format.
+ * the file is written next to the destination and renamed over it at the
+ * end, so readers never see a partial export.
+ * can be called while requests are being served.
+ * returns -1 when any internal errors occur, or no path is configured.
+ * returns 0 on success.
+ */
+int skvs_export(struct skvs_ctx *ctx);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes the hash table to fd in the hash_export() stream format, e.g.,
+ * to hand it to the server that takes over.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int skvs_snapshot(struct skvs_ctx *ctx, int fd);
+/*---------------------------------------------------------------------------*/
+/**
+ * loads a table written by skvs_snapshot() from fd.
+ * returns -1 when any internal errors occur, or the stream is malformed.
+ * returns 0 on success.
+ */
+int skvs_restore(struct skvs_ctx *ctx, int fd);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns 1 when the request line of len bytes is SYNC, which the caller
+ * answers with skvs_sync() on the connection instead of skvs_serve().
+ * returns 0 otherwise.
+ */
+int skvs_is_sync(const char *line, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * streams replication to the replica connected on fd until it goes away
+ * or *stop is set. see repl_sync().
+ * returns -1 when the stream ends.
+ */
+int skvs_sync(struct skvs_ctx *ctx, int fd, volatile sig_atomic_t *stop);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the length of the body a framed request line declares,
+ * e.g., 5 for "CREATE key #5", or -1 when the line is not framed.
+ * only CREATE and UPDATE can be framed. the body (exactly that many bytes,
+ * then a line feed) follows the request line on the wire.
+ */
+ssize_t skvs_frame_len(const char *line, size_t len);
+/*---------------------------------------------------------------------------*/
+/* room for skvs_serve() to write a reply in, e.g., the free end of the
+ * output buffer of the connection */
+struct skvs_out
+{
+    char *buf;
+    size_t room;
+};
+/*---------------------------------------------------------------------------*/
+/**
+ * serves one request line of rlen bytes in rbuf, which is modified.
+ * for a framed request, body holds the body_len bytes of its value
+ * (null-terminated at body_len) and is adopted by this function,
+ * or is NULL when the body was refused for being larger than MAX_BODY_LEN.
+ * fills iov with the response, line feed included, which is valid
+ * until the next call on the same thread.
+ * a READ reply never points into the table: it is copied out while the
+ * bucket is still locked, to out->buf when it fits in out->room bytes
+ * (then iov is a single entry at out->buf), else to a per-thread buffer.
+ * out may be NULL.
+ * a READ value that does not fit in a message, contains a line feed,
+ * or starts with '#' is answered framed, i.e., "#<len>\n<value>\n".
+ * READC is READ for clients that decompress: a compressed value is sent
+ * as stored, framed as "#<len> <raw_len>\n<LZ block>\n".
+ * "MGET key1 key2 ..." is answered as if each key was READ in turn, in
+ * one response, with the keys looked up by hash_search_batch().
+ * returns the number of iovec entries filled (at most SKVS_RESP_IOV).
+ * returns 0 when the request is incomplete.
+ */
+int skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen,
+               char *body, size_t body_len, const struct skvs_out *out,
+               struct iovec *iov);
+/*---------------------------------------------------------------------------*/
+/**
+ * counts the plain "UPDATE key value" lines for one key at the start of
+ * the rlen bytes of rbuf, at most SKVS_UPDATE_RUN, and sets *len to the
+ * bytes they take, line feeds included. only the last of them has to be
+ * applied: the others would be overwritten before any other request of
+ * the connection is served, and are answered with the same UPDATE OK.
+ * returns the number of lines, 0 when the first is not such an UPDATE.
+ */
+int skvs_update_run(const char *rbuf, size_t rlen, size_t *len);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns 1 when the request line of len bytes is MULTI, which opens a
+ * block of requests ended by an EXEC line, served by skvs_serve_multi().
+ * returns 0 otherwise.
+ */
+int skvs_is_multi(const char *line, size_t len);
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the length of the MULTI block at the start of rbuf, through
+ * its EXEC line, or 0 when the EXEC line is not in the rlen bytes yet.
+ */
+size_t skvs_multi_len(const char *rbuf, size_t rlen);
+/*---------------------------------------------------------------------------*/
+/**
+ * serves a whole MULTI block of rlen bytes in rbuf (see skvs_multi_len()),
+ * which is modified: up to MULTI_MAX_OPS CREATE, READ, UPDATE, DELETE,
+ * GETS, CAS, INCR, DECR or APPEND requests, none framed, applied in order
+ * with the buckets of all their keys write-locked (hash_txn_begin()), so
+ * no other client sees any of them apart. each is answered as if sent
+ * alone, and one that fails does not undo the others. when a request
+ * cannot be part of the block, none is applied: it is answered with
+ * INVALID CMD, and the others with ABORTED.
+ * the MULTI and EXEC lines are not answered.
+ * fills iov like skvs_serve() does.
+ * returns the number of iovec entries filled, 0 when the block is empty.
+ * returns -1 when the replies cannot be made, and the client would get
+ * out of step.
+ */
+int skvs_serve_multi(struct skvs_ctx *ctx, char *rbuf, size_t rlen,
+                     struct iovec *iov);
+/*---------------------------------------------------------------------------*/
+/**
+ * prefetches the buckets of the keys read by the READ requests among the
+ * first HASH_BATCH lines of rbuf, which are about to be served one by one
+ * (pipelined), so their cache misses overlap.
+ */
+void skvs_prefetch(struct skvs_ctx *ctx, const char *rbuf, size_t rlen);
+/*---------------------------------------------------------------------------*/
+/**
+ * releases the per-thread buffers of skvs_serve().
+ * called by each serving thread before it exits.
  */
-const char *skvs_serve(struct skvs_ctx *ctx, char *rbuf, size_t rlen);
+void skvs_thread_exit(void);
 /*---------------------------------------------------------------------------*/
 #endif // _SKVSLIB_H
\ No newline at end of file
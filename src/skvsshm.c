@@ -0,0 +1,235 @@
+/*---------------------------------------------------------------------------*/
+/* skvsshm.c                                                                 */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "skvsclient.h"
+#include "hashtable.h"
+#include "shm.h"
+/*---------------------------------------------------------------------------*/
+static inline const struct shm_header *
+header(const skvs_shm_t *m)
+{
+    return (const struct shm_header *)m->base;
+}
+/*---------------------------------------------------------------------------*/
+/* maps the region called m->name into m->base and m->size, checking that
+ * its layout stays inside it.
+ * returns -1 when any internal errors occur. */
+static int
+shm_map(skvs_shm_t *m)
+{
+    const struct shm_header *hdr;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = shm_open(m->name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct shm_header))
+    {
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    hdr = base;
+    if (memcmp(hdr->magic, SHM_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->format != SHM_FORMAT || hdr->size != (uint64_t)st.st_size ||
+        hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+        hdr->buckets_off + (uint64_t)hdr->nbuckets *
+                               sizeof(struct shm_bucket) > hdr->nodes_off ||
+        hdr->nodes_off + (uint64_t)hdr->nnodes *
+                             sizeof(struct shm_node) > hdr->arena_off ||
+        hdr->arena_off + hdr->arena_size > hdr->size)
+    {
+        munmap(base, st.st_size);
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    m->base = base;
+    m->size = st.st_size;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+skvs_shm_t *skvs_shm_open(const char *name)
+{
+    TRACE_PRINT();
+    skvs_shm_t *m = calloc(1, sizeof(skvs_shm_t));
+
+    if (m == NULL)
+    {
+        return NULL;
+    }
+    m->scratch = malloc(SHM_VALUE_MAX);
+    if (m->scratch == NULL ||
+        snprintf(m->name, sizeof(m->name), "%s%s",
+                 name[0] == '/' ? "" : "/", name) >= (int)sizeof(m->name) ||
+        shm_map(m) < 0)
+    {
+        free(m->scratch);
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+/*---------------------------------------------------------------------------*/
+void skvs_shm_close(skvs_shm_t *m)
+{
+    TRACE_PRINT();
+    munmap((void *)m->base, m->size);
+    free(m->scratch);
+    free(m);
+}
+/*---------------------------------------------------------------------------*/
+/* switches to the region of the server that took over, if there is one.
+ * returns -1 when m still maps a closed region. */
+static int
+shm_remap(skvs_shm_t *m)
+{
+    skvs_shm_t fresh = *m;
+
+    if (shm_map(&fresh) < 0 ||
+        __atomic_load_n(&header(&fresh)->closed, __ATOMIC_ACQUIRE))
+    {
+        if (fresh.base != m->base)
+        {
+            munmap((void *)fresh.base, fresh.size);
+        }
+        return -1;
+    }
+    munmap((void *)m->base, m->size);
+    m->base = fresh.base;
+    m->size = fresh.size;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+int skvs_shm_read(skvs_shm_t *m, const char *key, char *buf, size_t len,
+                  size_t *value_len)
+{
+    const struct shm_header *hdr;
+    const struct shm_bucket *bucket;
+    const struct shm_node *nodes, *n;
+    size_t key_size = strlen(key);
+    uint32_t seq, ref, steps, flags = 0, size = 0;
+    uint64_t off = 0;
+    long raw;
+    int tries, found;
+
+    if (__atomic_load_n(&header(m)->closed, __ATOMIC_ACQUIRE) &&
+        shm_remap(m) < 0)
+    {
+        return -1;
+    }
+    if (key_size > MAX_KEY_LEN)
+    {
+        return 0;
+    }
+
+    hdr = header(m);
+    bucket = (const struct shm_bucket *)(m->base + hdr->buckets_off) +
+             (shm_hash(key) & (hdr->nbuckets - 1));
+    nodes = (const struct shm_node *)(m->base + hdr->nodes_off);
+
+    for (tries = 0; tries < SHM_RETRIES; tries++)
+    {
+        seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue; // being written
+        }
+
+        /* walk the chain, which may change under us, so every reference
+         * is checked before it is followed */
+        found = 0;
+        ref = bucket->head;
+        for (steps = 0; ref && ref <= hdr->nnodes && steps < hdr->nnodes;
+             steps++)
+        {
+            n = &nodes[ref - 1];
+            if (n->key_size == key_size &&
+                memcmp(n->key, key, key_size) == 0)
+            {
+                flags = n->flags;
+                size = n->value_size;
+                off = n->value_off;
+                found = 1;
+                break;
+            }
+            ref = n->next;
+        }
+
+        /* copy the value out, unless it cannot be in place */
+        if (found && !(flags & SHM_UNMIRRORED) &&
+            (off < hdr->arena_off || size > SHM_VALUE_MAX ||
+             off + size > hdr->size))
+        {
+            continue; // torn, the bucket has changed
+        }
+        if (found && !(flags & SHM_UNMIRRORED))
+        {
+            if (flags & NODE_COMPRESSED)
+                memcpy(m->scratch, m->base + off, size);
+            else if (size < len)
+                memcpy(buf, m->base + off, size);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) != seq)
+        {
+            continue;
+        }
+
+        /* what was read is consistent */
+        if (!found)
+        {
+            return __atomic_load_n(&hdr->incomplete, __ATOMIC_RELAXED) ? -1
+                                                                       : 0;
+        }
+        if (flags & SHM_UNMIRRORED)
+        {
+            return -1;
+        }
+        if (flags & NODE_COMPRESSED)
+        {
+            if (size < COMPRESSED_HDR)
+            {
+                return -1;
+            }
+            raw = compressed_raw_size(m->scratch);
+            *value_len = raw;
+            if ((size_t)raw >= len ||
+                lz_decompress(m->scratch + COMPRESSED_HDR,
+                              size - COMPRESSED_HDR, buf, len) != raw)
+            {
+                return -1;
+            }
+            buf[raw] = '\0';
+            return 1;
+        }
+        *value_len = size;
+        if (size >= len)
+        {
+            return -1;
+        }
+        buf[size] = '\0';
+        return 1;
+    }
+
+    return -1;
+}
+/*---------------------------------------------------------------------------*/
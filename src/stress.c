@@ -0,0 +1,971 @@
+/*---------------------------------------------------------------------------*/
+/* stress.c                                                                  */
+/*---------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "common.h"
+#include "hashtable.h"
+#include "skvsclient.h"
+/*---------------------------------------------------------------------------*/
+/* a concurrency stress test.
+ *
+ * "table" and "server" modes run threads of random CREATE, READ, UPDATE
+ * and DELETE requests over a few keys, either on hashtable.c directly or
+ * on a server, recording when each request was called and when it
+ * returned. the history is then checked for linearizability, one key at
+ * a time (linearizability is compositional), with the search of Wing &
+ * Gong as improved by Lowe: requests are linearized in every order the
+ * history allows, backtracking on replies the model of a single register
+ * cannot give, and remembering the (linearized set, state) pairs already
+ * explored. every value written is unique, so a READ tells which write
+ * it saw.
+ *
+ * "lock" mode runs readers and writers on one rwlock_t, checks that no
+ * writer ever shares it, and watches for a thread that waits for it too
+ * long: while others still get the lock it is starving, and when nobody
+ * does a wakeup was lost.
+ *
+ * the requests of each thread depend only on the seed; the interleaving
+ * is up to the scheduler, so a failure is reported with the seed and the
+ * history of the key that failed. */
+#define STRESS_THREADS 8
+#define STRESS_OPS 2000 // requests per thread
+#define STRESS_KEYS 8
+#define STRESS_SEED 1
+#define STRESS_HASH_SIZE 4 // few buckets, so keys share locks
+#define STRESS_STALL_MS 2000 // a wait this long is a failure
+#define CHECK_STEPS 100000000ULL // search budget for one key
+#define CHECK_SHOWN 64           // requests printed of a failed history
+#define LOCK_READERS 4
+#define LOCK_WRITERS 4
+#define LOCK_SECONDS 3
+#define LOCK_HOLD 256      // most spins with the lock held
+#define WAIT_BUCKETS 64    // of the wait histogram, one per power of two
+/*---------------------------------------------------------------------------*/
+enum kind
+{
+    OP_CREATE,
+    OP_READ,
+    OP_UPDATE,
+    OP_DELETE,
+    OP_KINDS
+};
+static const char *g_kinds[OP_KINDS] = {"CREATE", "READ", "UPDATE",
+                                        "DELETE"};
+/*---------------------------------------------------------------------------*/
+/* one request of the history. a value is a nonzero id, 0 is "no key" */
+struct op
+{
+    int kind;
+    int key;
+    uint32_t arg;   // value written by CREATE and UPDATE
+    uint32_t ret;   // value a READ saw
+    int ok;         // CREATE/UPDATE/DELETE took effect
+    uint64_t call;  // logical times, from g_clock
+    uint64_t done;
+};
+/*---------------------------------------------------------------------------*/
+struct stress
+{
+    const char *mode;
+    hashtable_t *table;      // "table" mode
+    skvs_client_t *client;   // "server" mode
+    int threads, ops, keys;
+    uint64_t seed;
+    char prefix[32];         // of the key names
+    int stall_ms;            // no request done for this long is a failure
+    int finished;            // threads done
+    int policy;              // of the table and rwlock, RWLOCK_POLICY
+};
+/*---------------------------------------------------------------------------*/
+struct tester
+{
+    struct stress *s;
+    pthread_t thread;
+    int id;
+    uint64_t seed;
+    skvs_conn_t *conn;
+    struct op *ops;
+    int nops;
+    int failed; // a request got no valid reply
+};
+/*---------------------------------------------------------------------------*/
+/* orders every call and return of every thread */
+static uint64_t g_clock;
+/*---------------------------------------------------------------------------*/
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+/* xorshift64*, one state per thread */
+static uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+/*---------------------------------------------------------------------------*/
+static uint64_t tick(void)
+{
+    return __atomic_add_fetch(&g_clock, 1, __ATOMIC_SEQ_CST);
+}
+/*---------------------------------------------------------------------------*/
+static void key_name(struct stress *s, int key, char *buf)
+{
+    snprintf(buf, MAX_KEY_LEN + 1, "%s%d", s->prefix, key);
+}
+/*---------------------------------------------------------------------------*/
+/* parses a value id, 0 when str is not one */
+static uint32_t value_id(const char *str)
+{
+    char *end;
+    unsigned long v = strtoul(str, &end, 10);
+
+    return *str && *end == '\0' && v <= UINT32_MAX ? v : 0;
+}
+/*---------------------------------------------------------------------------*/
+/* runs op on the table. returns -1 when any internal errors occur */
+static int exec_table(struct tester *t, struct op *op)
+{
+    hashtable_t *table = t->s->table;
+    char key[MAX_KEY_LEN + 1], buf[16], *value;
+    uint64_t version;
+    int ret;
+
+    /* on the heap, as a server would pass it */
+    key_name(t->s, op->key, key);
+    snprintf(buf, sizeof(buf), "%u", op->arg);
+    if ((value = strdup(buf)) == NULL)
+        return -1;
+    switch (op->kind)
+    {
+    case OP_CREATE:
+        ret = hash_insert(table, key, value);
+        break;
+    case OP_READ:
+        ret = hash_gets(table, key, buf, sizeof(buf), &version);
+        if (ret == 1 && (op->ret = value_id(buf)) == 0)
+            ret = -1;
+        break;
+    case OP_UPDATE:
+        ret = hash_update(table, key, value);
+        break;
+    default:
+        ret = hash_delete(table, key);
+        break;
+    }
+    free(value);
+    op->ok = ret == 1;
+
+    return ret < 0 || ret > 1 ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+/* runs op on the server. returns -1 when the reply is not one of those
+ * the request may get */
+static int exec_server(struct tester *t, struct op *op)
+{
+    static const char *oks[OP_KINDS] = {"CREATE OK", NULL, "UPDATE OK",
+                                        "DELETE OK"};
+    char key[MAX_KEY_LEN + 1], value[16];
+    skvs_op_t req = {0};
+    int ret = 0;
+
+    key_name(t->s, op->key, key);
+    snprintf(value, sizeof(value), "%u", op->arg);
+    if (skvs_submit(t->conn, &req, g_kinds[op->kind], key,
+                    op->kind == OP_CREATE || op->kind == OP_UPDATE ? value
+                                                                   : NULL,
+                    strlen(value)) < 0 ||
+        skvs_wait(t->conn, &req) != SKVS_OK)
+    {
+        skvs_op_release(&req);
+        return -1;
+    }
+
+    if (op->kind == OP_READ)
+    {
+        if (strcmp(req.reply, "NOT FOUND") != 0 &&
+            (op->ret = value_id(req.reply)) == 0)
+            ret = -1;
+    }
+    else if (strcmp(req.reply, oks[op->kind]) == 0)
+        op->ok = 1;
+    else if (strcmp(req.reply, op->kind == OP_CREATE ? "COLLISION"
+                                                     : "NOT FOUND"))
+        ret = -1;
+    if (ret < 0)
+        fprintf(stderr, "stress: %s %s got \"%s\"\n", g_kinds[op->kind],
+                key, req.reply);
+    skvs_op_release(&req);
+
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+static void *test_run(void *arg)
+{
+    struct tester *t = arg;
+    struct stress *s = t->s;
+    struct op *op;
+
+    if (s->client && (t->conn = skvs_acquire(s->client)) == NULL)
+        t->failed = 1;
+    for (t->nops = 0; !t->failed && t->nops < s->ops; t->nops++)
+    {
+        op = &t->ops[t->nops];
+        op->kind = rnd(&t->seed) % OP_KINDS;
+        op->key = rnd(&t->seed) % s->keys;
+        /* ids are unique across threads: thread in the top byte */
+        op->arg = ((uint32_t)t->id << 24) | (t->nops + 1);
+
+        op->call = tick();
+        t->failed = (s->client ? exec_server(t, op) : exec_table(t, op)) < 0;
+        op->done = tick();
+    }
+    if (t->conn)
+        skvs_release(s->client, t->conn);
+    __atomic_add_fetch(&s->finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* deletes the keys, so the history starts with none of them */
+static int clear_keys(struct stress *s)
+{
+    char key[MAX_KEY_LEN + 1];
+    skvs_op_t req = {0};
+    int i, ret;
+
+    for (i = 0; i < s->keys; i++)
+    {
+        key_name(s, i, key);
+        if (s->table)
+            ret = hash_delete(s->table, key) < 0 ? -1 : 0;
+        else
+            ret = skvs_call(s->client, &req, "DELETE", key, NULL, 0) ==
+                          SKVS_OK ? 0 : -1;
+        skvs_op_release(&req);
+        if (ret < 0)
+            return -1;
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* the linearizability check of one key.
+ * the history is a list of call and return events in time order; to
+ * linearize a request, its call and return are lifted out of the list. */
+struct event
+{
+    struct event *prev, *next;
+    struct event *match; // the return of a call, NULL for a return
+    struct op *op;
+    int id;              // of the request, its bit in the linearized set
+    uint64_t time;
+};
+/*---------------------------------------------------------------------------*/
+/* a set of (linearized set, state) pairs already explored */
+struct seen
+{
+    uint64_t *slots; // each: hash, state, then words of the set
+    size_t cap, count;
+    int words;
+};
+/*---------------------------------------------------------------------------*/
+static int event_cmp(const void *a, const void *b)
+{
+    const struct event *x = a, *y = b;
+
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+/*---------------------------------------------------------------------------*/
+/* applies op to the register holding *state.
+ * returns 0 when the reply of op cannot be given in that state. */
+static int model_step(const struct op *op, uint32_t *state)
+{
+    switch (op->kind)
+    {
+    case OP_CREATE:
+        if (*state != 0)
+            return !op->ok;
+        if (op->ok)
+            *state = op->arg;
+        return op->ok;
+    case OP_READ:
+        return op->ret == *state;
+    case OP_UPDATE:
+        if (*state == 0)
+            return !op->ok;
+        if (op->ok)
+            *state = op->arg;
+        return op->ok;
+    default:
+        if (*state == 0)
+            return !op->ok;
+        if (op->ok)
+            *state = 0;
+        return op->ok;
+    }
+}
+/*---------------------------------------------------------------------------*/
+static uint64_t seen_hash(const uint64_t *set, int words, uint32_t state)
+{
+    uint64_t h = 14695981039346656037ULL ^ state;
+    int i;
+
+    for (i = 0; i < words; i++)
+        h = (h ^ set[i]) * 1099511628211ULL;
+    return h | 1; // 0 marks an empty slot
+}
+/*---------------------------------------------------------------------------*/
+/* adds (set, state) to seen.
+ * returns 1 when it was there already, -1 when out of memory */
+static int seen_add(struct seen *sn, const uint64_t *set, uint32_t state)
+{
+    size_t stride = 2 + sn->words, i, j, cap;
+    uint64_t h = seen_hash(set, sn->words, state), *slot, *slots;
+
+    if ((sn->count + 1) * 2 > sn->cap)
+    {
+        cap = sn->cap ? sn->cap * 2 : 1024;
+        slots = calloc(cap, stride * sizeof(uint64_t));
+        if (slots == NULL)
+            return -1;
+        for (i = 0; i < sn->cap; i++)
+        {
+            slot = sn->slots + i * stride;
+            if (slot[0] == 0)
+                continue;
+            for (j = slot[0] % cap; slots[j * stride]; j = (j + 1) % cap)
+                ;
+            memcpy(slots + j * stride, slot, stride * sizeof(uint64_t));
+        }
+        free(sn->slots);
+        sn->slots = slots;
+        sn->cap = cap;
+    }
+
+    for (i = h % sn->cap;; i = (i + 1) % sn->cap)
+    {
+        slot = sn->slots + i * stride;
+        if (slot[0] == 0)
+            break;
+        if (slot[0] == h && slot[1] == state &&
+            memcmp(slot + 2, set, sn->words * sizeof(uint64_t)) == 0)
+            return 1;
+    }
+    slot[0] = h;
+    slot[1] = state;
+    memcpy(slot + 2, set, sn->words * sizeof(uint64_t));
+    sn->count++;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void lift(struct event *call)
+{
+    call->prev->next = call->next;
+    call->next->prev = call->prev;
+    call->match->prev->next = call->match->next;
+    if (call->match->next)
+        call->match->next->prev = call->match->prev;
+}
+/*---------------------------------------------------------------------------*/
+static void unlift(struct event *call)
+{
+    call->match->prev->next = call->match;
+    if (call->match->next)
+        call->match->next->prev = call->match;
+    call->prev->next = call;
+    call->next->prev = call;
+}
+/*---------------------------------------------------------------------------*/
+/* checks the n requests of one key, setting *stuck to the request that
+ * could not be linearized after the longest prefix that could.
+ * returns 1 when they are linearizable, 0 when not, -1 when the search
+ * ran out of memory or budget. */
+static int check_key(struct op **ops, int n, struct op **stuck)
+{
+    struct event *events, head = {0}, *e, **stack;
+    uint32_t state = 0, *states, next;
+    uint64_t *set, steps = 0;
+    struct seen sn = {0};
+    int i, depth = 0, deepest = -1, ret = -1;
+
+    sn.words = (n + 63) / 64;
+    events = calloc(2 * n, sizeof(struct event));
+    stack = malloc(sizeof(struct event *) * (n + 1));
+    states = malloc(sizeof(uint32_t) * (n + 1));
+    set = calloc(sn.words + 1, sizeof(uint64_t));
+    if (events == NULL || stack == NULL || states == NULL || set == NULL)
+        goto out;
+
+    for (i = 0; i < n; i++)
+    {
+        events[2 * i] = (struct event){.op = ops[i], .id = i,
+                                       .time = ops[i]->call};
+        events[2 * i + 1] = (struct event){.op = ops[i], .id = i,
+                                           .time = ops[i]->done};
+    }
+    qsort(events, 2 * n, sizeof(struct event), event_cmp);
+    /* sorting moved them, so pair them up only now */
+    for (i = 0; i < 2 * n; i++)
+        stack[events[i].id] = NULL;
+    for (i = 0; i < 2 * n; i++)
+    {
+        if (stack[events[i].id] == NULL)
+            stack[events[i].id] = &events[i];
+        else
+            stack[events[i].id]->match = &events[i];
+    }
+    head.next = events;
+    for (i = 0; i < 2 * n; i++)
+    {
+        events[i].prev = i ? &events[i - 1] : &head;
+        events[i].next = i + 1 < 2 * n ? &events[i + 1] : NULL;
+    }
+
+    e = head.next;
+    while (head.next)
+    {
+        if (++steps > CHECK_STEPS)
+            goto out;
+        if (e->match)
+        {
+            /* a call: linearize it now if the model allows */
+            next = state;
+            if (model_step(e->op, &next))
+            {
+                set[e->id / 64] |= 1ULL << (e->id % 64);
+                i = seen_add(&sn, set, next);
+                if (i < 0)
+                    goto out;
+                if (i == 0)
+                {
+                    stack[depth] = e;
+                    states[depth++] = state;
+                    state = next;
+                    lift(e);
+                    e = head.next;
+                    continue;
+                }
+                set[e->id / 64] &= ~(1ULL << (e->id % 64));
+            }
+            e = e->next;
+        }
+        else
+        {
+            /* a return whose call could not be linearized: undo the last
+             * one and try the call after it instead */
+            if (depth > deepest)
+            {
+                deepest = depth;
+                *stuck = e->op;
+            }
+            if (depth == 0)
+            {
+                ret = 0;
+                goto out;
+            }
+            e = stack[--depth];
+            state = states[depth];
+            set[e->id / 64] &= ~(1ULL << (e->id % 64));
+            unlift(e);
+            e = e->next;
+        }
+    }
+    ret = 1;
+
+out:
+    free(sn.slots);
+    free(set);
+    free(states);
+    free(stack);
+    free(events);
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+static int op_cmp(const void *a, const void *b)
+{
+    const struct op *x = *(struct op *const *)a, *y = *(struct op *const *)b;
+
+    return x->call < y->call ? -1 : x->call > y->call;
+}
+/*---------------------------------------------------------------------------*/
+/* prints the requests around stuck, which is marked */
+static void print_history(struct stress *s, struct op **ops, int n,
+                          struct op *stuck)
+{
+    char key[MAX_KEY_LEN + 1];
+    int i, first = 0;
+
+    qsort(ops, n, sizeof(struct op *), op_cmp);
+    for (i = 0; i < n; i++)
+    {
+        if (ops[i] == stuck)
+            first = i > CHECK_SHOWN / 2 ? i - CHECK_SHOWN / 2 : 0;
+    }
+    if (first > 0)
+        printf("  ... %d before\n", first);
+    for (i = first; i < n && i < first + CHECK_SHOWN; i++)
+    {
+        key_name(s, ops[i]->key, key);
+        printf("%s [%" PRIu64 ", %" PRIu64 "] %s %s",
+               ops[i] == stuck ? "->" : "  ", ops[i]->call,
+               ops[i]->done, g_kinds[ops[i]->kind], key);
+        if (ops[i]->kind == OP_READ)
+            printf(" -> %u\n", ops[i]->ret);
+        else if (ops[i]->kind == OP_DELETE)
+            printf(" -> %s\n", ops[i]->ok ? "ok" : "fail");
+        else
+            printf(" %u -> %s\n", ops[i]->arg, ops[i]->ok ? "ok" : "fail");
+    }
+    if (i < n)
+        printf("  ... %d after\n", n - i);
+}
+/*---------------------------------------------------------------------------*/
+/* checks the history of every key.
+ * returns 0 when all are linearizable, -1 otherwise */
+static int check(struct stress *s, struct tester *testers)
+{
+    struct op **ops, *stuck = NULL;
+    int i, j, k, n, ret, failed = 0;
+
+    ops = malloc(sizeof(struct op *) * s->threads * s->ops);
+    if (ops == NULL)
+        return -1;
+    for (k = 0; k < s->keys; k++)
+    {
+        n = 0;
+        for (i = 0; i < s->threads; i++)
+        {
+            for (j = 0; j < testers[i].nops; j++)
+            {
+                if (testers[i].ops[j].key == k)
+                    ops[n++] = &testers[i].ops[j];
+            }
+        }
+        ret = check_key(ops, n, &stuck);
+        if (ret == 1)
+            continue;
+        failed = 1;
+        printf("key %d: %d requests %s\n", k, n,
+               ret == 0 ? "are NOT linearizable"
+                        : "could not be checked, out of memory or budget");
+        if (ret == 0)
+            print_history(s, ops, n, stuck);
+    }
+    free(ops);
+
+    return failed ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+static int run_history(struct stress *s)
+{
+    struct tester *testers;
+    uint64_t total = 0, clock, last_clock = 0, last_progress;
+    int i, failed = 0, ret;
+
+    if (clear_keys(s) < 0)
+    {
+        fprintf(stderr, "stress: cannot clear the keys\n");
+        return -1;
+    }
+    testers = calloc(s->threads, sizeof(struct tester));
+    if (testers == NULL)
+        return -1;
+    for (i = 0; i < s->threads; i++)
+    {
+        testers[i].s = s;
+        testers[i].id = i + 1;
+        testers[i].seed = s->seed * 0x9e3779b97f4a7c15ULL + (i + 1);
+        testers[i].ops = calloc(s->ops, sizeof(struct op));
+        if (testers[i].ops == NULL)
+            return -1;
+    }
+    for (i = 0; i < s->threads; i++)
+        pthread_create(&testers[i].thread, NULL, test_run, &testers[i]);
+
+    /* a table or server that stops answering cannot be joined */
+    last_progress = now_ns();
+    while (__atomic_load_n(&s->finished, __ATOMIC_ACQUIRE) < s->threads)
+    {
+        usleep(10000);
+        clock = __atomic_load_n(&g_clock, __ATOMIC_RELAXED);
+        if (clock != last_clock)
+        {
+            last_clock = clock;
+            last_progress = now_ns();
+        }
+        else if (now_ns() - last_progress > (uint64_t)s->stall_ms * 1000000)
+        {
+            printf("%s: no request done in %d ms: lost wakeup or "
+                   "deadlock\n%s: %d threads, seed %" PRIu64 ": FAILED\n",
+                   s->mode, s->stall_ms, s->mode, s->threads, s->seed);
+            fflush(stdout);
+            _exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < s->threads; i++)
+    {
+        pthread_join(testers[i].thread, NULL);
+        failed |= testers[i].failed;
+        total += testers[i].nops;
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "stress: requests failed, not checking\n");
+        ret = -1;
+    }
+    else
+    {
+        ret = check(s, testers);
+        printf("%s: %" PRIu64 " requests on %d keys by %d threads, seed %"
+               PRIu64 ": %s\n", s->mode, total, s->keys, s->threads,
+               s->seed, ret == 0 ? "linearizable" : "FAILED");
+    }
+
+    for (i = 0; i < s->threads; i++)
+        free(testers[i].ops);
+    free(testers);
+    return ret;
+}
+/*---------------------------------------------------------------------------*/
+/* lock mode */
+struct lock_stress
+{
+    rwlock_t lock;
+    int readers_in, writers_in; // threads holding the lock
+    int violations;
+    int stop;
+    int hold;  // most spins with the lock held
+    int yield; // yield the CPU with the lock held, so that waiters pile
+               // up even on a single core
+};
+/*---------------------------------------------------------------------------*/
+struct locker
+{
+    struct lock_stress *ls;
+    pthread_t thread;
+    int writer;
+    uint64_t seed;
+    uint64_t acquired;
+    uint64_t waiting_since; // 0 while not waiting
+    uint64_t max_wait_ns;
+    uint64_t waits[WAIT_BUCKETS]; // by the log2 of their ns
+    int failed;
+};
+/*---------------------------------------------------------------------------*/
+static void *lock_run(void *arg)
+{
+    struct locker *l = arg;
+    struct lock_stress *ls = l->ls;
+    uint64_t start, wait, spins;
+    int *mine = l->writer ? &ls->writers_in : &ls->readers_in;
+
+    while (!__atomic_load_n(&ls->stop, __ATOMIC_RELAXED))
+    {
+        start = now_ns();
+        __atomic_store_n(&l->waiting_since, start, __ATOMIC_RELAXED);
+        if ((l->writer ? rwlock_write_lock(&ls->lock)
+                       : rwlock_read_lock(&ls->lock)) < 0)
+        {
+            l->failed = 1;
+            break;
+        }
+        __atomic_store_n(&l->waiting_since, 0, __ATOMIC_RELAXED);
+        wait = now_ns() - start;
+        if (wait > l->max_wait_ns)
+            l->max_wait_ns = wait;
+        l->waits[wait ? 63 - __builtin_clzll(wait) : 0]++;
+
+        __atomic_add_fetch(mine, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ls->writers_in, __ATOMIC_SEQ_CST) >
+                (l->writer ? 1 : 0) ||
+            (l->writer && __atomic_load_n(&ls->readers_in, __ATOMIC_SEQ_CST)))
+            __atomic_add_fetch(&ls->violations, 1, __ATOMIC_RELAXED);
+        for (spins = rnd(&l->seed) % (ls->hold + 1); spins > 0; spins--)
+            __asm__ __volatile__("" ::: "memory");
+        if (ls->yield)
+            sched_yield();
+        __atomic_sub_fetch(mine, 1, __ATOMIC_SEQ_CST);
+
+        if ((l->writer ? rwlock_write_unlock(&ls->lock)
+                       : rwlock_read_unlock(&ls->lock)) < 0)
+        {
+            l->failed = 1;
+            break;
+        }
+        __atomic_add_fetch(&l->acquired, 1, __ATOMIC_RELAXED);
+        if (rnd(&l->seed) % 8 == 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* upper bound of the pct percentile of the waits in hist, at most max */
+static uint64_t wait_percentile(const uint64_t *hist, double pct,
+                                uint64_t max)
+{
+    uint64_t total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < WAIT_BUCKETS; i++)
+        total += hist[i];
+    for (i = 0; i < WAIT_BUCKETS - 1; i++)
+    {
+        seen += hist[i];
+        if (seen > total * pct / 100.0)
+            break;
+    }
+    return (2ULL << i) - 1 < max ? (2ULL << i) - 1 : max;
+}
+/*---------------------------------------------------------------------------*/
+static int run_lock(struct stress *s, int readers, int writers, int seconds,
+                    int yield)
+{
+    struct lock_stress ls;
+    struct locker *lockers;
+    uint64_t deadline, since, total, last_total = 0, last_progress;
+    uint64_t max_wait[2] = {0}, acquired[2] = {0}, now;
+    uint64_t waits[2][WAIT_BUCKETS] = {{0}};
+    int i, j, n = readers + writers, stuck = -1, failed = 0;
+    int stall_ms = s->stall_ms;
+
+    memset(&ls, 0, sizeof(ls));
+    ls.hold = LOCK_HOLD;
+    ls.yield = yield;
+    lockers = calloc(n, sizeof(struct locker));
+    if (lockers == NULL || rwlock_init(&ls.lock, 0, s->policy) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+    {
+        lockers[i].ls = &ls;
+        lockers[i].writer = i >= readers;
+        lockers[i].seed = s->seed * 0x9e3779b97f4a7c15ULL + (i + 1);
+        pthread_create(&lockers[i].thread, NULL, lock_run, &lockers[i]);
+    }
+
+    /* watch the waiters */
+    now = last_progress = now_ns();
+    deadline = now + (uint64_t)seconds * 1000000000;
+    while ((now = now_ns()) < deadline && stuck < 0)
+    {
+        usleep(10000);
+        total = 0;
+        for (i = 0; i < n; i++)
+            total += __atomic_load_n(&lockers[i].acquired, __ATOMIC_RELAXED);
+        if (total != last_total)
+        {
+            last_total = total;
+            last_progress = now;
+        }
+        for (i = 0; i < n && stuck < 0; i++)
+        {
+            since = __atomic_load_n(&lockers[i].waiting_since,
+                                    __ATOMIC_RELAXED);
+            if (since && since < now &&
+                now - since > (uint64_t)stall_ms * 1000000)
+                stuck = i;
+        }
+    }
+
+    if (stuck >= 0)
+    {
+        /* the stuck threads cannot be joined, report and leave */
+        pthread_mutex_lock(&ls.lock.lock);
+        printf("lock: %s %d waited over %d ms, %s; read_count=%d "
+               "write_count=%d writer tickets %u..%u read_admitted=%d\n",
+               lockers[stuck].writer ? "writer" : "reader", stuck, stall_ms,
+               now - last_progress > (uint64_t)stall_ms * 1000000 / 2
+                   ? "and no thread got the lock: lost wakeup or deadlock"
+                   : "while others got the lock: starvation",
+               ls.lock.read_count, ls.lock.write_count,
+               ls.lock.write_serving, ls.lock.write_ticket,
+               ls.lock.read_admitted);
+        pthread_mutex_unlock(&ls.lock.lock);
+        printf("lock: %s, %d readers, %d writers, seed %" PRIu64
+               ": FAILED\n", g_rwlock_policies[s->policy], readers, writers,
+               s->seed);
+        fflush(stdout);
+        _exit(EXIT_FAILURE);
+    }
+
+    __atomic_store_n(&ls.stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++)
+    {
+        pthread_join(lockers[i].thread, NULL);
+        failed |= lockers[i].failed;
+        acquired[lockers[i].writer] += lockers[i].acquired;
+        if (lockers[i].max_wait_ns > max_wait[lockers[i].writer])
+            max_wait[lockers[i].writer] = lockers[i].max_wait_ns;
+        for (j = 0; j < WAIT_BUCKETS; j++)
+            waits[lockers[i].writer][j] += lockers[i].waits[j];
+    }
+    rwlock_destroy(&ls.lock);
+    free(lockers);
+
+    failed |= ls.violations > 0;
+    printf("lock: %s, %d readers, %d writers, seed %" PRIu64 ": read=%" PRIu64
+           " write=%" PRIu64 " read_wait_us(p99/max)=%.1f/%.1f "
+           "write_wait_us(p99/max)=%.1f/%.1f violations=%d: %s\n",
+           g_rwlock_policies[s->policy], readers, writers, s->seed,
+           acquired[0], acquired[1], wait_percentile(waits[0], 99, max_wait[0]) / 1e3,
+           max_wait[0] / 1e3, wait_percentile(waits[1], 99, max_wait[1]) / 1e3,
+           max_wait[1] / 1e3, ls.violations, failed ? "FAILED" : "ok");
+
+    return failed ? -1 : 0;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    char *ip = DEFAULT_LOOPBACK_IP;
+    int port = DEFAULT_PORT;
+    int readers = LOCK_READERS, writers = LOCK_WRITERS;
+    int seconds = LOCK_SECONDS, yield = 0;
+    struct stress s;
+    int opt, ret;
+
+    memset(&s, 0, sizeof(s));
+    s.mode = "table";
+    s.threads = STRESS_THREADS;
+    s.ops = STRESS_OPS;
+    s.keys = STRESS_KEYS;
+    s.seed = STRESS_SEED;
+    s.stall_ms = STRESS_STALL_MS;
+
+    while ((opt = getopt(argc, argv, "m:i:p:u:c:n:k:S:P:R:W:s:yw:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            s.mode = optarg;
+            break;
+        case 'i':
+            ip = optarg;
+            break;
+        case 'u':
+            if (!IS_UNIX_PATH(optarg))
+            {
+                fprintf(stderr, "Invalid unix socket %s, expected a path "
+                                "with a '/' or @name\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            s.threads = atoi(optarg);
+            break;
+        case 'n':
+            s.ops = atoi(optarg);
+            break;
+        case 'k':
+            s.keys = atoi(optarg);
+            break;
+        case 'S':
+            s.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'P':
+            for (s.policy = 0; s.policy < RWLOCK_POLICIES; s.policy++)
+            {
+                if (strcmp(optarg, g_rwlock_policies[s.policy]) == 0)
+                    break;
+            }
+            break;
+        case 'R':
+            readers = atoi(optarg);
+            break;
+        case 'W':
+            writers = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'y':
+            yield = 1;
+            break;
+        case 'w':
+            s.stall_ms = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-m table|server|lock (table)] "
+                   "[-S seed (%d)] [-w stall_ms (%d)]\n"
+                   "  table, lock: [-P reader|writer|fair (reader)]\n"
+                   "  table, server: [-c threads (%d)] "
+                   "[-n requests_per_thread (%d)] [-k keys (%d)]\n"
+                   "  server: [-i server (%s)] [-p port (%d)] "
+                   "[-u unix_path|@name]\n"
+                   "  lock: [-R readers (%d)] [-W writers (%d)] "
+                   "[-s seconds (%d)] [-y (yield holding the lock)]\n",
+                   argv[0], STRESS_SEED, STRESS_STALL_MS, STRESS_THREADS,
+                   STRESS_OPS, STRESS_KEYS, DEFAULT_LOOPBACK_IP,
+                   DEFAULT_PORT, LOCK_READERS, LOCK_WRITERS, LOCK_SECONDS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (s.threads <= 0 || s.threads > 255 || s.ops <= 0 ||
+        s.ops >= 1 << 24 || s.keys <= 0 || readers < 0 || writers < 0 ||
+        readers + writers == 0 || seconds <= 0 || s.stall_ms <= 0 ||
+        s.policy == RWLOCK_POLICIES)
+    {
+        fprintf(stderr, "stress: invalid parameters\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(s.prefix, sizeof(s.prefix), "stress%" PRIu64 "_", s.seed);
+
+    if (strcmp(s.mode, "lock") == 0)
+    {
+        ret = run_lock(&s, readers, writers, seconds, yield);
+    }
+    else if (strcmp(s.mode, "table") == 0)
+    {
+        s.table = hash_init(STRESS_HASH_SIZE, 0,
+                            s.policy == RWLOCK_PHASE_FAIR    ? HASH_LOCK_FAIR
+                            : s.policy == RWLOCK_WRITER_PREF ? HASH_LOCK_WRITER
+                                                             : 0);
+        if (s.table == NULL)
+        {
+            perror("hash_init failed");
+            exit(EXIT_FAILURE);
+        }
+        ret = run_history(&s);
+        hash_destroy(s.table);
+    }
+    else if (strcmp(s.mode, "server") == 0)
+    {
+        s.client = skvs_client_open(ip, port, s.threads, 0);
+        if (s.client == NULL)
+        {
+            fprintf(stderr, "stress: invalid server %s\n", ip);
+            exit(EXIT_FAILURE);
+        }
+        ret = run_history(&s);
+        skvs_client_close(s.client);
+    }
+    else
+    {
+        fprintf(stderr, "stress: unknown mode %s\n", s.mode);
+        exit(EXIT_FAILURE);
+    }
+
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,215 @@
+/*---------------------------------------------------------------------------*/
+/* trace.c                                                                   */
+/*---------------------------------------------------------------------------*/
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "trace.h"
+/*---------------------------------------------------------------------------*/
+struct trace_event
+{
+    uint64_t seq;   // position in the ring + 1, 0 while being written
+    uint64_t start; // ns, CLOCK_MONOTONIC
+    uint64_t dur;   // ns
+    const char *name;
+    char arg[TRACE_ARG_LEN + 1];
+};
+/*---------------------------------------------------------------------------*/
+struct trace_ring
+{
+    struct trace_event events[TRACE_RING_SIZE];
+    uint64_t head; // events ever recorded
+    int tid;       // shown as the thread id
+    char name[32];
+    int in_use;
+    struct trace_ring *next;
+};
+/*---------------------------------------------------------------------------*/
+int g_trace_on = 0;
+static struct trace_ring *g_rings; // every ring ever made, newest first
+static int g_nrings;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *t_ring;
+/*---------------------------------------------------------------------------*/
+static const char *g_ev_names[TRACE_EV_COUNT] = {
+    "accept",
+    "read",
+    "parse",
+    "lock wait",
+    "op",
+    "write"};
+/*---------------------------------------------------------------------------*/
+void trace_end(int type, const char *name, const char *arg, uint64_t start)
+{
+    struct trace_ring *r = t_ring;
+    struct trace_event *e;
+    uint64_t now = trace_begin();
+
+    if (start == 0 || now == 0 || r == NULL)
+    {
+        return;
+    }
+
+    e = &r->events[r->head % TRACE_RING_SIZE];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->start = start;
+    e->dur = now - start;
+    e->name = name ? name : g_ev_names[type];
+    if (arg)
+    {
+        strncpy(e->arg, arg, TRACE_ARG_LEN);
+        e->arg[TRACE_ARG_LEN] = '\0';
+    }
+    else
+    {
+        e->arg[0] = '\0';
+    }
+    __atomic_store_n(&e->seq, r->head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+/*---------------------------------------------------------------------------*/
+int trace_thread_start(const char *name, int idx)
+{
+    struct trace_ring *r;
+
+    if (t_ring)
+    {
+        return 0;
+    }
+
+    /* reuse the ring of a thread that exited */
+    pthread_mutex_lock(&g_rings_lock);
+    for (r = g_rings; r && r->in_use; r = r->next)
+        ;
+    if (r == NULL)
+    {
+        r = calloc(1, sizeof(struct trace_ring));
+        if (r == NULL)
+        {
+            pthread_mutex_unlock(&g_rings_lock);
+            return -1;
+        }
+        r->tid = ++g_nrings;
+        r->next = g_rings;
+        g_rings = r;
+    }
+    r->in_use = 1;
+    snprintf(r->name, sizeof(r->name), "%s %d", name, idx);
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = r;
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+void trace_thread_exit(void)
+{
+    if (t_ring)
+    {
+        pthread_mutex_lock(&g_rings_lock);
+        t_ring->in_use = 0;
+        pthread_mutex_unlock(&g_rings_lock);
+        t_ring = NULL;
+    }
+}
+/*---------------------------------------------------------------------------*/
+void trace_enable(int on)
+{
+    __atomic_store_n(&g_trace_on, on, __ATOMIC_RELAXED);
+}
+/*---------------------------------------------------------------------------*/
+/* writes the events of r still in place; returns how many */
+static long
+dump_ring(FILE *fp, struct trace_ring *r, int pid, int *first)
+{
+    struct trace_event e;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), i, seq;
+    long n = 0;
+    char *c;
+
+    fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *first ? "" : ",", pid, r->tid, r->name);
+    *first = 0;
+
+    i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (; i < head; i++)
+    {
+        seq = __atomic_load_n(&r->events[i % TRACE_RING_SIZE].seq,
+                              __ATOMIC_ACQUIRE);
+        memcpy(&e, &r->events[i % TRACE_RING_SIZE], sizeof(e));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != i + 1 ||
+            __atomic_load_n(&r->events[i % TRACE_RING_SIZE].seq,
+                            __ATOMIC_RELAXED) != seq)
+        {
+            continue; // overwritten meanwhile
+        }
+        e.arg[TRACE_ARG_LEN] = '\0';
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u",
+                e.name, pid, r->tid, e.start / 1000,
+                (unsigned)(e.start % 1000), e.dur / 1000,
+                (unsigned)(e.dur % 1000));
+        if (e.arg[0])
+        {
+            /* keys hold no spaces; quotes and backslashes are escaped */
+            fputs(",\"args\":{\"key\":\"", fp);
+            for (c = e.arg; *c; c++)
+            {
+                if (*c == '"' || *c == '\\')
+                    fputc('\\', fp);
+                if ((unsigned char)*c >= 0x20)
+                    fputc(*c, fp);
+            }
+            fputs("\"}", fp);
+        }
+        fputc('}', fp);
+        n++;
+    }
+
+    return n;
+}
+/*---------------------------------------------------------------------------*/
+long trace_dump(const char *path)
+{
+    TRACE_PRINT();
+    struct trace_ring *r;
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+    long n = 0;
+    int first = 1;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path))
+    {
+        return -1;
+    }
+    fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", fp);
+    pthread_mutex_lock(&g_rings_lock);
+    r = g_rings;
+    pthread_mutex_unlock(&g_rings_lock);
+    /* rings are never freed and only ever prepended */
+    for (; r; r = r->next)
+    {
+        n += dump_ring(fp, r, getpid(), &first);
+    }
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return n;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,90 @@
+/*---------------------------------------------------------------------------*/
+/* trace.h                                                                   */
+/*---------------------------------------------------------------------------*/
+#ifndef _TRACE_H
+#define _TRACE_H
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+/*---------------------------------------------------------------------------*/
+/* request tracing that can stay compiled in.
+ *
+ * while tracing is off, a trace point costs one load and a branch. while
+ * it is on, each thread that called trace_thread_start() records timed
+ * spans into its own ring of TRACE_RING_SIZE events, overwriting the
+ * oldest. a ring has a single writer and is read without locks: every
+ * event carries a sequence number that is cleared while it is being
+ * written, so a dump skips events it caught half-written.
+ * trace_dump() writes the rings in the Chrome trace event format, which
+ * chrome://tracing and Perfetto load. */
+#define TRACE_RING_SIZE 16384 // events per thread
+#define TRACE_ARG_LEN MAX_KEY_LEN
+/*---------------------------------------------------------------------------*/
+/* span types */
+enum TRACE_EV
+{
+    TRACE_EV_ACCEPT, // a new connection handed to the workers
+    TRACE_EV_READ,   // a read from a client socket
+    TRACE_EV_PARSE,  // parsing a request line
+    TRACE_EV_LOCK,   // waiting for a bucket lock
+    TRACE_EV_OP,     // executing a command
+    TRACE_EV_WRITE,  // a write to a client socket
+    TRACE_EV_COUNT
+};
+/*---------------------------------------------------------------------------*/
+extern int g_trace_on;
+/*---------------------------------------------------------------------------*/
+/**
+ * returns the start time of a span, or 0 while tracing is off.
+ */
+static inline uint64_t trace_begin(void)
+{
+    struct timespec ts;
+
+    if (!__atomic_load_n(&g_trace_on, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * records a span of type from start until now, named name (or after its
+ * type when NULL), with an optional argument such as a key.
+ * does nothing when start is 0 or the thread has no ring.
+ */
+void trace_end(int type, const char *name, const char *arg, uint64_t start);
+/*---------------------------------------------------------------------------*/
+/**
+ * gives the calling thread a ring, shown as "name idx" in dumps.
+ * threads that never call it are not traced.
+ * returns -1 when any internal errors occur.
+ * returns 0 on success.
+ */
+int trace_thread_start(const char *name, int idx);
+/*---------------------------------------------------------------------------*/
+/**
+ * hands the ring of the calling thread back for reuse. its events stay
+ * in dumps until overwritten.
+ */
+void trace_thread_exit(void);
+/*---------------------------------------------------------------------------*/
+/**
+ * turns recording on or off.
+ */
+void trace_enable(int on);
+/*---------------------------------------------------------------------------*/
+/**
+ * writes every ring to path as Chrome trace JSON, through path.tmp
+ * renamed over path. recording may continue meanwhile.
+ * returns -1 when any internal errors occur.
+ * returns the number of events written on success.
+ */
+long trace_dump(const char *path);
+/*---------------------------------------------------------------------------*/
+#endif // _TRACE_H